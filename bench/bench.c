@@ -0,0 +1,322 @@
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "histogram.h"
+#include "networking.h"
+
+/* Headless load generator for `chat host`.
+ *
+ * Opens a number of speaker and listener connections to a running server.
+ * Speakers send SEGMENT_MESSAGEs at a fixed rate, each stamped with the time
+ * it was sent, and every connection (speakers included, since the server
+ * fans out to everyone) records the latency from send to receipt of every
+ * message it gets. A single JSON object describing the run is printed to
+ * stdout once it completes.
+ */
+
+#define MAX_EVENTS 256
+#define TICK_NS 1000000
+// Every message starts with the send time as fixed width hex
+#define STAMP_LENGTH 16
+
+struct BenchConfig {
+	uint32_t ip;
+	uint16_t port;
+	unsigned int speakers;
+	unsigned int listeners;
+	unsigned int message_size;
+	double rate;
+	double duration;
+	double warmup;
+	double drain;
+	bool compression;
+};
+
+struct BenchClient {
+	struct Connection connection;
+	uint64_t next_send_ns;
+};
+
+struct BenchStats {
+	uint64_t sent;
+	uint64_t received;
+	uint64_t received_bytes;
+	uint64_t disconnects;
+	struct Histogram latency;
+};
+
+static uint64_t nowNs() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void raiseFileLimit() {
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) != 0) return;
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+}
+
+static int connectClient(struct BenchConfig* config) {
+	struct sockaddr_in server_address = {0};
+	server_address.sin_family = AF_INET;
+	server_address.sin_port = htons(config->port);
+	server_address.sin_addr = (struct in_addr) { htonl(config->ip) };
+
+	int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (socket_fd == -1) return -1;
+
+	if (connect(socket_fd, (struct sockaddr*)&server_address, sizeof(struct sockaddr_in)) != 0) {
+		close(socket_fd);
+		return -1;
+	}
+
+	int enable = 1;
+	setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+	fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) | O_NONBLOCK);
+	return socket_fd;
+}
+
+static uint64_t sendStamped(struct BenchClient* client, char* contents, unsigned int size, struct BenchStats* stats) {
+	uint64_t sent_ns = nowNs();
+	char stamp[STAMP_LENGTH + 1];
+	snprintf(stamp, sizeof(stamp), "%016lx", sent_ns);
+	memcpy(contents, stamp, STAMP_LENGTH);
+
+	struct Frame* frame = Frame_newMessage(0, "bench", 5, contents, size);
+	queueFrame(&client->connection, frame);
+	Frame_release(frame);
+	flushConnection(&client->connection);
+	stats->sent++;
+	return sent_ns;
+}
+
+// Only messages sent within [record_start_ns, record_end_ns) are counted, so
+// that `received` can be compared against the sends made in that window
+static void receiveAll(struct BenchClient* client, struct BenchStats* stats, uint64_t record_start_ns, uint64_t record_end_ns) {
+	struct Connection* connection = &client->connection;
+	while (true) {
+		updateConnection(connection);
+		if (!connection->segment_ready) break;
+
+		if (connection->segment_type == SEGMENT_HELLO) {
+			// Only needed to accept compressed segments, sends stay plain
+			connection->features = connection->segment.hello.features;
+		} else if (connection->segment_type == SEGMENT_MESSAGE) {
+			struct Segment_Message* segment = &connection->segment.message;
+			if (segment->contents_len >= STAMP_LENGTH) {
+				char stamp[STAMP_LENGTH + 1];
+				memcpy(stamp, segment->contents, STAMP_LENGTH);
+				stamp[STAMP_LENGTH] = '\0';
+				uint64_t sent_ns = strtoull(stamp, NULL, 16);
+				if (sent_ns >= record_start_ns && sent_ns < record_end_ns) {
+					uint64_t now_ns = nowNs();
+					Histogram_record(&stats->latency, now_ns > sent_ns ? now_ns - sent_ns : 0);
+					stats->received++;
+					stats->received_bytes += Frame_messageLength(segment->sender_len, segment->contents_len);
+				}
+			}
+		}
+
+		markHandled(connection);
+	}
+}
+
+static int runBench(struct BenchConfig* config) {
+	raiseFileLimit();
+
+	unsigned int num_clients = config->speakers + config->listeners;
+	struct BenchClient* clients = calloc(num_clients, sizeof(struct BenchClient));
+	struct BenchStats* stats = calloc(1, sizeof(struct BenchStats));
+
+	int epoll_fd = epoll_create1(0);
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	struct itimerspec tick = {0};
+	tick.it_interval.tv_nsec = TICK_NS;
+	tick.it_value.tv_nsec = TICK_NS;
+	timerfd_settime(timer_fd, 0, &tick, NULL);
+
+	struct epoll_event timer_event = {0};
+	timer_event.events = EPOLLIN;
+	timer_event.data.ptr = NULL;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &timer_event);
+
+	for (unsigned int i = 0; i < num_clients; i++) {
+		int socket_fd = connectClient(config);
+		if (socket_fd == -1) {
+			fprintf(stderr, "Failed to connect client %u: %s\n", i, strerror(errno));
+			return 1;
+		}
+
+		struct BenchClient* client = &clients[i];
+		client->connection = newConnection(socket_fd);
+		uint32_t features = FEATURE_BATCH;
+		if (config->compression) features |= FEATURE_DEFLATE;
+		struct Frame* hello = Frame_newHello(PROTOCOL_VERSION, features);
+		queueFrame(&client->connection, hello);
+		Frame_release(hello);
+		flushConnection(&client->connection);
+
+		struct epoll_event event = {0};
+		event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		event.data.ptr = client;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_fd, &event);
+	}
+
+	char* contents = malloc(config->message_size);
+	memset(contents, 'x', config->message_size);
+
+	// Spread the speakers' first sends across one interval so they do not all
+	// fire on the same tick
+	uint64_t interval_ns = config->rate > 0 ? 1e9 / config->rate : 0;
+	uint64_t start_ns = nowNs();
+	for (unsigned int i = 0; i < config->speakers; i++)
+		clients[i].next_send_ns = start_ns + (interval_ns * i) / (config->speakers ? config->speakers : 1);
+
+	uint64_t record_start_ns = start_ns + config->warmup * 1e9;
+	uint64_t send_end_ns = record_start_ns + config->duration * 1e9;
+	uint64_t end_ns = send_end_ns + config->drain * 1e9;
+	uint64_t recorded_sent = 0;
+
+	struct epoll_event events[MAX_EVENTS];
+	while (true) {
+		uint64_t now_ns = nowNs();
+		if (now_ns >= end_ns) break;
+
+		int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, 100);
+		for (int i = 0; i < num_events; i++) {
+			struct BenchClient* client = events[i].data.ptr;
+			if (client == NULL) {
+				uint64_t expirations;
+				read(timer_fd, &expirations, sizeof(expirations));
+				if (now_ns >= send_end_ns) continue;
+
+				for (unsigned int j = 0; j < config->speakers; j++) {
+					struct BenchClient* speaker = &clients[j];
+					while (speaker->next_send_ns <= now_ns) {
+						uint64_t sent_ns = sendStamped(speaker, contents, config->message_size, stats);
+						if (sent_ns >= record_start_ns && sent_ns < send_end_ns) recorded_sent++;
+						speaker->next_send_ns += interval_ns;
+					}
+				}
+				continue;
+			}
+
+			if (events[i].events & EPOLLOUT) flushConnection(&client->connection);
+			receiveAll(client, stats, record_start_ns, send_end_ns);
+			if (client->connection.reader.closed) {
+				stats->disconnects++;
+				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->connection.socket, NULL);
+			}
+		}
+	}
+
+	double seconds = config->duration;
+	uint64_t expected = recorded_sent * num_clients;
+	printf(
+		"{\"speakers\":%u,\"listeners\":%u,\"message_size\":%u,\"rate\":%.1f,\"duration_s\":%.3f,"
+		"\"sent\":%lu,\"received\":%lu,\"expected\":%lu,\"disconnects\":%lu,"
+		"\"sent_msgs_per_s\":%.1f,\"delivered_msgs_per_s\":%.1f,\"delivered_bytes_per_s\":%.1f,"
+		"\"latency_ns\":{\"p50\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu}}\n",
+		config->speakers, config->listeners, config->message_size, config->rate, seconds,
+		recorded_sent, stats->received, expected, stats->disconnects,
+		recorded_sent / seconds, stats->received / seconds, stats->received_bytes / seconds,
+		Histogram_percentile(&stats->latency, 50),
+		Histogram_percentile(&stats->latency, 99),
+		Histogram_percentile(&stats->latency, 99.9),
+		Histogram_percentile(&stats->latency, 100)
+	);
+
+	for (unsigned int i = 0; i < num_clients; i++)
+		cleanupConnection(&clients[i].connection);
+	free(contents);
+	free(clients);
+	free(stats);
+	close(timer_fd);
+	close(epoll_fd);
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 3) goto invalid;
+
+	struct BenchConfig config = {0};
+	config.speakers = 10;
+	config.listeners = 100;
+	config.message_size = 64;
+	config.rate = 100;
+	config.duration = 5;
+	config.warmup = 1;
+	config.drain = 1;
+
+	char extra;
+
+	struct in_addr address;
+	if (inet_pton(AF_INET, argv[1], &address) != 1) goto invalid;
+	config.ip = ntohl(address.s_addr);
+	if (sscanf(argv[2], "%hu%c", &config.port, &extra) != 1) goto invalid;
+
+	for (int i = 3; i < argc; i += 2) {
+		if (i+1 >= argc) goto invalid;
+		char* option = argv[i];
+		char* value = argv[i+1];
+
+		if (strcmp(option, "--speakers") == 0) {
+			if (sscanf(value, "%u%c", &config.speakers, &extra) != 1) goto invalid;
+		} else if (strcmp(option, "--listeners") == 0) {
+			if (sscanf(value, "%u%c", &config.listeners, &extra) != 1) goto invalid;
+		} else if (strcmp(option, "--size") == 0) {
+			if (sscanf(value, "%u%c", &config.message_size, &extra) != 1) goto invalid;
+		} else if (strcmp(option, "--rate") == 0) {
+			if (sscanf(value, "%lf%c", &config.rate, &extra) != 1) goto invalid;
+		} else if (strcmp(option, "--duration") == 0) {
+			if (sscanf(value, "%lf%c", &config.duration, &extra) != 1) goto invalid;
+		} else if (strcmp(option, "--warmup") == 0) {
+			if (sscanf(value, "%lf%c", &config.warmup, &extra) != 1) goto invalid;
+		} else if (strcmp(option, "--compression") == 0) {
+			if (strcmp(value, "on") == 0) config.compression = true;
+			else if (strcmp(value, "off") == 0) config.compression = false;
+			else goto invalid;
+		} else {
+			goto invalid;
+		}
+	}
+
+	if (config.message_size < STAMP_LENGTH || config.message_size > SEGMENT_MAX_LENGTH - 32) goto invalid;
+	if (config.rate <= 0 || config.duration <= 0) goto invalid;
+
+	return runBench(&config);
+
+invalid:
+	printf("Invalid usage. Correct usage as follows:\n");
+	printf("\t%s IP PORT [OPTIONS]\n", argv[0]);
+	printf("Where:\n");
+	printf("\tIP and PORT are the address of a running `chat host`\n");
+	printf("OPTIONS:\n");
+	printf("\t--speakers N\tconnections sending messages (default 10)\n");
+	printf("\t--listeners N\tconnections only receiving messages (default 100)\n");
+	printf("\t--size BYTES\tmessage text length, at least %d (default 64)\n", STAMP_LENGTH);
+	printf("\t--rate N\tmessages per second sent by each speaker (default 100)\n");
+	printf("\t--duration S\tseconds to measure for (default 5)\n");
+	printf("\t--warmup S\tseconds to run before measuring (default 1)\n");
+	printf("\t--compression on|off\tnegotiate FEATURE_DEFLATE (default off)\n");
+	return 1;
+}
@@ -0,0 +1,416 @@
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "dyn_arr.h"
+
+#include "networking.h"
+#include "rooms.h"
+#include "slab.h"
+#include "timer_wheel.h"
+
+/* Microbenchmarks for the hot primitives, isolated from the event loop.
+ *
+ * Each benchmark prints one JSON object with its time and heap allocations
+ * per operation. Allocations are counted by interposing malloc and friends
+ * over glibc's own entry points, so calls made from the prebuilt objects in
+ * lib/ are counted too.
+ */
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* pointer, size_t size);
+
+static uint64_t allocations = 0;
+
+void* malloc(size_t size) {
+	allocations++;
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+	allocations++;
+	return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size) {
+	allocations++;
+	return __libc_realloc(pointer, size);
+}
+
+#define BATCH_SIZE 256
+#define CHURN_ENTRIES 16384
+#define CHURN_ROOMS 1024
+
+struct Measurement {
+	uint64_t ops;
+	uint64_t ns;
+	uint64_t allocations;
+};
+
+static uint64_t nowNs() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void startTiming(uint64_t* start_ns, uint64_t* start_allocations) {
+	*start_allocations = allocations;
+	*start_ns = nowNs();
+}
+
+static void stopTiming(struct Measurement* measurement, uint64_t start_ns, uint64_t start_allocations, uint64_t ops) {
+	measurement->ns += nowNs() - start_ns;
+	measurement->allocations += allocations - start_allocations;
+	measurement->ops += ops;
+}
+
+static void report(char* name, struct Measurement* measurement) {
+	printf(
+		"{\"name\":\"%s\",\"ops\":%lu,\"ns_per_op\":%.2f,\"allocs_per_op\":%.3f}\n",
+		name, measurement->ops,
+		(double)measurement->ns / measurement->ops,
+		(double)measurement->allocations / measurement->ops
+	);
+}
+
+static void openPair(int sockets[2]) {
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+	for (int i = 0; i < 2; i++) {
+		int size = 4 * 1024 * 1024;
+		setsockopt(sockets[i], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+		setsockopt(sockets[i], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+		fcntl(sockets[i], F_SETFL, fcntl(sockets[i], F_GETFL) | O_NONBLOCK);
+	}
+}
+
+static void drain(int socket) {
+	char bfr[65536];
+	while (recv(socket, bfr, sizeof(bfr), 0) > 0);
+}
+
+static void benchEncode(uint64_t iterations, char* contents) {
+	struct Measurement measurement = {0};
+	uint16_t contents_len = strlen(contents);
+
+	for (uint64_t done = 0; done < iterations; done += BATCH_SIZE) {
+		uint64_t start_ns, start_allocations;
+		startTiming(&start_ns, &start_allocations);
+		for (int i = 0; i < BATCH_SIZE; i++) {
+			struct Frame* frame = Frame_newMessage(0, "sender", 6, contents, contents_len);
+			Frame_release(frame);
+		}
+		stopTiming(&measurement, start_ns, start_allocations, BATCH_SIZE);
+	}
+
+	report("Frame_newMessage", &measurement);
+}
+
+static void benchSend(uint64_t iterations, char* contents) {
+	struct Measurement measurement = {0};
+	int sockets[2];
+	openPair(sockets);
+	struct Connection connection = newConnection(sockets[0]);
+
+	for (uint64_t done = 0; done < iterations; done += BATCH_SIZE) {
+		uint64_t start_ns, start_allocations;
+		startTiming(&start_ns, &start_allocations);
+		for (int i = 0; i < BATCH_SIZE; i++)
+			sendSegment_Message(&connection, "sender", contents);
+		stopTiming(&measurement, start_ns, start_allocations, BATCH_SIZE);
+
+		drain(sockets[1]);
+		while (hasPendingOutput(&connection)) {
+			flushConnection(&connection);
+			drain(sockets[1]);
+		}
+	}
+
+	report("sendSegment_Message", &measurement);
+	cleanupConnection(&connection);
+	close(sockets[1]);
+}
+
+static void benchDecode(uint64_t iterations, char* contents) {
+	struct Measurement measurement = {0};
+	int sockets[2];
+	openPair(sockets);
+	struct Connection connection = newConnection(sockets[0]);
+
+	// One batch of encoded segments, written to the socket ahead of each
+	// timed decode pass
+	struct Frame* frame = Frame_newMessage(0, "sender", 6, contents, strlen(contents));
+	size_t batch_length = frame->length * BATCH_SIZE;
+	unsigned char* batch = malloc(batch_length);
+	for (int i = 0; i < BATCH_SIZE; i++)
+		memcpy(batch + frame->length * i, frame->data, frame->length);
+	Frame_release(frame);
+
+	for (uint64_t done = 0; done < iterations; done += BATCH_SIZE) {
+		send(sockets[1], batch, batch_length, 0);
+
+		uint64_t start_ns, start_allocations;
+		startTiming(&start_ns, &start_allocations);
+		int decoded = 0;
+		while (decoded < BATCH_SIZE) {
+			updateConnection(&connection);
+			if (!connection.segment_ready) continue;
+			markHandled(&connection);
+			decoded++;
+		}
+		stopTiming(&measurement, start_ns, start_allocations, BATCH_SIZE);
+	}
+
+	report("updateConnection", &measurement);
+	free(batch);
+	cleanupConnection(&connection);
+	close(sockets[1]);
+}
+
+// As benchDecode, with the segments arriving packed into SEGMENT_BATCHes
+static void benchDecodeBatch(uint64_t iterations, char* contents) {
+	struct Measurement measurement = {0};
+	int sockets[2];
+	openPair(sockets);
+	struct Connection connection = newConnection(sockets[0]);
+
+	struct Frame* frame = Frame_newMessage(0, "sender", 6, contents, strlen(contents));
+	struct Frame* frames[BATCH_SIZE];
+	for (int i = 0; i < BATCH_SIZE; i++)
+		frames[i] = frame;
+
+	unsigned char* batches = NULL;
+	size_t batches_length = 0;
+	for (size_t packed = 0; packed < BATCH_SIZE;) {
+		size_t count;
+		struct Frame* batch = Frame_newBatch(frames + packed, BATCH_SIZE - packed, &count);
+		batches = realloc(batches, batches_length + batch->length);
+		memcpy(batches + batches_length, batch->data, batch->length);
+		batches_length += batch->length;
+		Frame_release(batch);
+		packed += count;
+	}
+	Frame_release(frame);
+
+	for (uint64_t done = 0; done < iterations; done += BATCH_SIZE) {
+		send(sockets[1], batches, batches_length, 0);
+
+		uint64_t start_ns, start_allocations;
+		startTiming(&start_ns, &start_allocations);
+		int decoded = 0;
+		while (decoded < BATCH_SIZE) {
+			updateConnection(&connection);
+			if (!connection.segment_ready) continue;
+			markHandled(&connection);
+			decoded++;
+		}
+		stopTiming(&measurement, start_ns, start_allocations, BATCH_SIZE);
+	}
+
+	report("updateConnection (batched)", &measurement);
+	free(batches);
+	cleanupConnection(&connection);
+	close(sockets[1]);
+}
+
+// Removes a pseudo-random entry and pushes a fresh one, keeping the array at
+// CHURN_ENTRIES connections as a connection table under steady turnover would
+static void benchChurn(uint64_t iterations) {
+	struct Measurement measurement = {0};
+	struct DynamicArray connections = DynamicArray_new(sizeof(struct Connection), 1);
+	struct Connection entry = {0};
+	for (int i = 0; i < CHURN_ENTRIES; i++) {
+		entry.socket = i;
+		DynamicArray_push(&connections, &entry);
+	}
+
+	uint64_t state = 0x9E3779B97F4A7C15;
+	for (uint64_t done = 0; done < iterations; done += BATCH_SIZE) {
+		uint64_t start_ns, start_allocations;
+		startTiming(&start_ns, &start_allocations);
+		for (int i = 0; i < BATCH_SIZE; i++) {
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+			DynamicArray_remove(&connections, state % connections.num_elements);
+			entry.socket = i;
+			DynamicArray_push(&connections, &entry);
+		}
+		stopTiming(&measurement, start_ns, start_allocations, BATCH_SIZE);
+	}
+
+	report("DynamicArray_remove+push", &measurement);
+	DynamicArray_free(&connections);
+}
+
+// The same turnover on a slab, removing by ID. Each round also looks up one
+// stale ID and one live one, as a message addressed to a client would.
+static void benchSlabChurn(uint64_t iterations) {
+	struct Measurement measurement = {0};
+	struct Slab connections;
+	initSlab(&connections, sizeof(struct Connection));
+	uint64_t* ids = malloc(CHURN_ENTRIES * sizeof(uint64_t));
+	for (int i = 0; i < CHURN_ENTRIES; i++) {
+		struct Connection* entry = Slab_insert(&connections, &ids[i]);
+		entry->socket = i;
+	}
+
+	uint64_t state = 0x9E3779B97F4A7C15;
+	uint64_t found = 0;
+	for (uint64_t done = 0; done < iterations; done += BATCH_SIZE) {
+		uint64_t start_ns, start_allocations;
+		startTiming(&start_ns, &start_allocations);
+		for (int i = 0; i < BATCH_SIZE; i++) {
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+			uint64_t* id = &ids[state % CHURN_ENTRIES];
+			uint64_t stale = *id;
+			Slab_remove(&connections, stale);
+			struct Connection* entry = Slab_insert(&connections, id);
+			entry->socket = i;
+			found += Slab_get(&connections, stale) != NULL;
+			found += Slab_get(&connections, ids[(state >> 32) % CHURN_ENTRIES]) != NULL;
+		}
+		stopTiming(&measurement, start_ns, start_allocations, BATCH_SIZE);
+	}
+
+	// Only the live lookups succeed
+	if (found != measurement.ops) printf("Slab lookups found %lu of %lu live IDs\n", found, measurement.ops);
+	report("Slab_remove+insert+get", &measurement);
+	free(ids);
+	cleanupSlab(&connections);
+}
+
+// Moves members between rooms at random, as joins and leaves do, and looks a
+// room up by name each time, as relayed room messages do
+static void benchRoomChurn(uint64_t iterations) {
+	struct Measurement measurement = {0};
+	struct Rooms rooms;
+	initRooms(&rooms);
+	char names[CHURN_ROOMS][16];
+	int name_lengths[CHURN_ROOMS];
+	for (int i = 0; i < CHURN_ROOMS; i++)
+		name_lengths[i] = snprintf(names[i], sizeof(names[i]), "room-%d", i);
+	struct Membership** memberships = malloc(CHURN_ENTRIES * sizeof(struct Membership*));
+	for (int i = 0; i < CHURN_ENTRIES; i++)
+		memberships[i] = Rooms_join(&rooms, names[i % CHURN_ROOMS], name_lengths[i % CHURN_ROOMS], &memberships[i]);
+
+	uint64_t state = 0x9E3779B97F4A7C15;
+	uint64_t found = 0;
+	for (uint64_t done = 0; done < iterations; done += BATCH_SIZE) {
+		uint64_t start_ns, start_allocations;
+		startTiming(&start_ns, &start_allocations);
+		for (int i = 0; i < BATCH_SIZE; i++) {
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+			struct Membership** membership = &memberships[state % CHURN_ENTRIES];
+			int room = (state >> 32) % CHURN_ROOMS;
+			Rooms_leave(&rooms, *membership);
+			*membership = Rooms_join(&rooms, names[room], name_lengths[room], membership);
+			found += Rooms_find(&rooms, names[(state >> 16) % CHURN_ROOMS], name_lengths[(state >> 16) % CHURN_ROOMS]) != NULL;
+		}
+		stopTiming(&measurement, start_ns, start_allocations, BATCH_SIZE);
+	}
+
+	if (found == 0) printf("No room was found\n");
+	report("Rooms_leave+join+find", &measurement);
+	for (int i = 0; i < CHURN_ENTRIES; i++)
+		Rooms_leave(&rooms, memberships[i]);
+	free(memberships);
+	cleanupRooms(&rooms);
+}
+
+// Pushes back one of many armed timers, as each message received does to its
+// client's idle timer, while the clock moves on and anything due fires
+static void benchTimerRearm(uint64_t iterations) {
+	struct Measurement measurement = {0};
+	uint64_t now_ns = 0;
+	uint64_t timeout_ns = 30000000000ull;
+	struct TimerWheel wheel;
+	initTimerWheel(&wheel, now_ns);
+	struct Timer* timers = calloc(CHURN_ENTRIES, sizeof(struct Timer));
+	for (int i = 0; i < CHURN_ENTRIES; i++)
+		TimerWheel_arm(&wheel, &timers[i], now_ns + timeout_ns * i / CHURN_ENTRIES);
+
+	uint64_t state = 0x9E3779B97F4A7C15;
+	uint64_t fired = 0;
+	for (uint64_t done = 0; done < iterations; done += BATCH_SIZE) {
+		uint64_t start_ns, start_allocations;
+		startTiming(&start_ns, &start_allocations);
+		for (int i = 0; i < BATCH_SIZE; i++) {
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+			now_ns += 1000;
+			TimerWheel_arm(&wheel, &timers[state % CHURN_ENTRIES], now_ns + timeout_ns);
+			TimerWheel_advance(&wheel, now_ns);
+			struct Timer* timer;
+			while ((timer = TimerWheel_pop(&wheel)) != NULL) {
+				TimerWheel_arm(&wheel, timer, now_ns + timeout_ns);
+				fired++;
+			}
+		}
+		stopTiming(&measurement, start_ns, start_allocations, BATCH_SIZE);
+	}
+
+	if (fired == 0 && now_ns > timeout_ns) printf("No timer fired in %lu simulated ns\n", now_ns);
+	report("TimerWheel_arm+advance", &measurement);
+	free(timers);
+}
+
+int main(int argc, char* argv[]) {
+	uint64_t iterations = 1000000;
+	unsigned int message_size = 64;
+
+	char extra;
+	for (int i = 1; i < argc; i += 2) {
+		if (i+1 >= argc) goto invalid;
+		char* option = argv[i];
+		char* value = argv[i+1];
+
+		if (strcmp(option, "--iterations") == 0) {
+			if (sscanf(value, "%lu%c", &iterations, &extra) != 1) goto invalid;
+		} else if (strcmp(option, "--size") == 0) {
+			if (sscanf(value, "%u%c", &message_size, &extra) != 1) goto invalid;
+		} else {
+			goto invalid;
+		}
+	}
+
+	if (iterations == 0 || message_size > SEGMENT_MAX_LENGTH - 32) goto invalid;
+
+	char* contents = malloc(message_size + 1);
+	memset(contents, 'x', message_size);
+	contents[message_size] = '\0';
+
+	benchEncode(iterations, contents);
+	benchSend(iterations, contents);
+	benchDecode(iterations, contents);
+	benchDecodeBatch(iterations, contents);
+	benchChurn(iterations);
+	benchSlabChurn(iterations);
+	benchRoomChurn(iterations);
+	benchTimerRearm(iterations);
+
+	free(contents);
+	return 0;
+
+invalid:
+	printf("Invalid usage. Correct usage as follows:\n");
+	printf("\t%s [--iterations N] [--size BYTES]\n", argv[0]);
+	printf("Where:\n");
+	printf("\tN is the number of operations per benchmark (default 1000000)\n");
+	printf("\tBYTES is the message text length (default 64)\n");
+	return 1;
+}
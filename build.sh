@@ -7,6 +7,8 @@ fi
 
 FILES=$(find "src/" -name "*.c")
 LIB_FILES=$(find "lib/" -name "*.o")
+# Benchmarks link against everything but the chat entry point
+BENCH_DEPS=$(find "src/" -name "*.c" ! -name "main.c")
 
 COMPILER=clang
 
@@ -15,6 +17,13 @@ if ! command -v clang; then
 fi
 
 BINARY_NAME="chat"
+LIBS="-lz"
 
-$COMPILER -I "src/headers" -I "lib/headers" -O3 $LIB_FILES $FILES -o "bin/release/$BINARY_NAME"
-$COMPILER -I "src/headers" -I "lib/headers" -O0 -g $LIB_FILES $FILES -o "bin/debug/$BINARY_NAME"
+$COMPILER -I "src/headers" -I "lib/headers" -O3 $LIB_FILES $FILES $LIBS -o "bin/release/$BINARY_NAME"
+$COMPILER -I "src/headers" -I "lib/headers" -O0 -g $LIB_FILES $FILES $LIBS -o "bin/debug/$BINARY_NAME"
+
+for BENCH in bench/*.c; do
+	BENCH_NAME=$(basename "$BENCH" .c)
+	$COMPILER -I "src/headers" -I "lib/headers" -O3 $LIB_FILES $BENCH_DEPS "$BENCH" $LIBS -o "bin/release/$BENCH_NAME"
+	$COMPILER -I "src/headers" -I "lib/headers" -O0 -g $LIB_FILES $BENCH_DEPS "$BENCH" $LIBS -o "bin/debug/$BENCH_NAME"
+done
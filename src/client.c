@@ -2,188 +2,528 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <threads.h>
+#include <time.h>
 
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
 #include "term_ctrl.h"
 
 #include "networking.h"
+#include "screen.h"
+#include "scrollback.h"
 
 #include "client.h"
 
 
-#define LOG_LENGTH 50
-struct MessageLog {
-	char* history[LOG_LENGTH];
-	size_t write_index;
-	size_t msg_count;
+// Terminals hand over at most 4095 characters of a line in canonical mode,
+// which also bounds how much can be pasted as one message
+#define INPUT_LENGTH (4 * 1024)
+// ProtocolFeature flags always offered to the server
+#define CLIENT_FEATURES (FEATURE_BATCH | FEATURE_HEARTBEAT | FEATURE_ROOMS | FEATURE_NICKNAMES)
+// Messages before the newest received that are tracked to catch duplicates
+#define SEEN_WINDOW 1024
+#define RECONNECT_MIN_MS 100
+#define RECONNECT_MAX_MS 5000
+
+struct ClientState {
+	const struct ClientConfig* config;
+	struct sockaddr_in server_address;
+	// `connection` is only open while connected, and is still being
+	// established while connecting
+	struct Connection connection;
+	bool connected;
+	bool connecting;
+	// Set when the server speaks a protocol version this client does not, so
+	// there is no point reconnecting
+	bool incompatible;
+	// While disconnected, when to next try to reconnect
+	uint64_t retry_at_ns;
+	unsigned int backoff_ms;
+	// The newest sequence number received, and a ring of bits marking which of
+	// the SEEN_WINDOW numbers up to it have been received
+	uint64_t last_seq;
+	uint64_t seen[SEEN_WINDOW / 64];
+	// The room typed messages go to, empty for everyone. It is joined again
+	// on reconnecting.
+	char room[ROOM_NAME_MAX + 1];
+	// The nickname to register, empty for none. It is registered again on
+	// reconnecting.
+	char nick[NICKNAME_MAX + 1];
+	// Keyboard input not yet terminated by a newline
+	char input_bfr[INPUT_LENGTH];
+	size_t input_len;
+	bool shutdown;
+	// The view changed since the screen was last drawn
+	bool redraw;
+	struct Screen screen;
+	struct Scrollback scrollback;
+	// Lines scrolled up from the newest
+	size_t scroll;
 };
-char* getNthNewestMessage(struct MessageLog* log, size_t n) {
-	if (n > log->write_index) {
-		return log->history[log->write_index+LOG_LENGTH-n];
-	} else {
-		return log->history[log->write_index-n];
-	}
+
+static uint64_t nowNs() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void scrollTo(struct ClientState* state, size_t scroll) {
+	size_t max_scroll = state->scrollback.num_lines > 0 ? state->scrollback.num_lines - 1 : 0;
+	state->scroll = scroll < max_scroll ? scroll : max_scroll;
+	state->redraw = true;
+}
+
+static const char* scrollbackSource(void* context, size_t n, size_t* length) {
+	struct ClientState* state = context;
+	return Scrollback_get(&state->scrollback, state->scroll + n, length);
+}
+
+// Bytes of its output snprintf left in a buffer of `size` bytes, given what
+// it returned
+static size_t printedLength(int length, size_t size) {
+	if (length < 0) return 0;
+	return (size_t)length < size ? (size_t)length : size - 1;
 }
-void appendMessage(struct MessageLog* log, char* message) {
-	if (log->msg_count == LOG_LENGTH)
-		free(log->history[log->write_index]);
 
-	log->history[log->write_index] = malloc(strlen(message));
-	strcpy(log->history[log->write_index], message);
-	log->write_index = (log->write_index+1) % LOG_LENGTH;
+static void appendLine(struct ClientState* state, char* line, size_t length) {
+	Scrollback_append(&state->scrollback, line, length);
+	// Keep the view still while scrolled up
+	if (state->scroll > 0) scrollTo(state, state->scroll + 1);
+	state->redraw = true;
+}
 
-	if (log->msg_count < LOG_LENGTH)
-		log->msg_count++;
+static void appendNotice(struct ClientState* state, char* notice) {
+	char bfr[128];
+	int length = snprintf(bfr, sizeof(bfr), "<CLIENT> %s", notice);
+	appendLine(state, bfr, printedLength(length, sizeof(bfr)));
 }
-void emptyLog(struct MessageLog* log) {
-	size_t erase_index = log->write_index;
-	for (size_t i = 0; i < log->msg_count; i++) {
-		erase_index--;
-		if (erase_index >= LOG_LENGTH) erase_index = LOG_LENGTH-1;
-		free(log->history[erase_index]);
+
+// Sends the rest of a "/msg NICK TEXT" line, and shows it as sent since the
+// server does not echo direct messages back
+static void sendDirect(struct ClientState* state, char* line) {
+	char* text = strchr(line, ' ');
+	if (!(state->connection.features & FEATURE_NICKNAMES)) {
+		appendNotice(state, "This server has no nicknames.");
+		return;
+	}
+	if (text == NULL || text == line) {
+		appendNotice(state, "Usage: /msg NICK TEXT");
+		return;
 	}
-	log->write_index = 0;
-	log->msg_count = 0;
+	*text++ = '\0';
+	if (!sendSegment_Direct(&state->connection, line, text)) {
+		appendNotice(state, "Message too long, not sent.");
+		return;
+	}
+
+	char bfr[INPUT_LENGTH + 40];
+	int length = snprintf(bfr, sizeof(bfr), "[to %s] %s", line, text);
+	appendLine(state, bfr, printedLength(length, sizeof(bfr)));
 }
 
-struct ClientState {
-	struct Connection connection;
-	char input_bfr[256];
-	bool input_ready;
-	bool shutdown;
-	size_t width, height;
-	struct MessageLog log;
-};
+static void submitLine(struct ClientState* state, char* line) {
+	if (strcmp(line, "exit") == 0) {
+		state->shutdown = true;
+		return;
+	}
 
-static void inputLoop(struct ClientState* state) {
-	while (true) {
-		while (state->input_ready) { usleep(10000); }
-		if (state->shutdown) break;
+	size_t page = Screen_messageRows(&state->screen);
+	if (page > 1) page--;
 
-		fgets(state->input_bfr, 256, stdin);
-		unsigned long msg_len = strlen(state->input_bfr);
-		if (state->input_bfr[msg_len-1] == '\n') state->input_bfr[msg_len-1] = '\0';
-		state->input_ready = true;
+	if (strcmp(line, "/pgup") == 0) {
+		scrollTo(state, state->scroll + page);
+	} else if (strcmp(line, "/pgdn") == 0) {
+		scrollTo(state, state->scroll > page ? state->scroll - page : 0);
+	} else if (strcmp(line, "/bottom") == 0) {
+		scrollTo(state, 0);
+	} else if (!state->connected || state->connecting) {
+		appendNotice(state, "Not connected, message not sent.");
+	} else if (strncmp(line, "/join ", 6) == 0) {
+		char* room = line + 6;
+		if (!(state->connection.features & FEATURE_ROOMS)) appendNotice(state, "This server has no rooms.");
+		else if (strlen(room) == 0 || strlen(room) > ROOM_NAME_MAX) appendNotice(state, "Room names are 1 to 64 bytes long.");
+		else sendSegment_Join(&state->connection, room);
+	} else if (strncmp(line, "/nick ", 6) == 0) {
+		if (!(state->connection.features & FEATURE_NICKNAMES)) appendNotice(state, "This server has no nicknames.");
+		else sendSegment_Nick(&state->connection, line + 6);
+	} else if (strncmp(line, "/msg ", 5) == 0) {
+		sendDirect(state, line + 5);
+	} else if (strcmp(line, "/leave") == 0) {
+		if (state->room[0] == '\0') appendNotice(state, "Not in a room.");
+		else sendSegment_Leave(&state->connection, state->room);
+	} else if (state->room[0] != '\0') {
+		// The server fills in who a message is from
+		if (!sendSegment_RoomMessage(&state->connection, state->room, "", line))
+			appendNotice(state, "Message too long, not sent.");
+	} else if (!sendSegment_Message(&state->connection, "", line)) {
+		appendNotice(state, "Message too long, not sent.");
 	}
+	cursorMoveTo(state->screen.height, 1);
+	displayEraseLine();
+	fflush(stdout);
 }
 
-static void displayMessages(struct ClientState* state) {
-	cursorSavePosition();
+// The terminal stays in canonical mode, so stdin only becomes readable once
+// a whole line has been entered. Lines longer than the buffer are sent in
+// pieces, as fgets would have split them.
+static void handleInput(struct ClientState* state) {
+	ssize_t bytes_read = read(STDIN_FILENO, state->input_bfr + state->input_len, INPUT_LENGTH - 1 - state->input_len);
+	if (bytes_read == -1 && errno == EINTR) return;
+	if (bytes_read <= 0) {
+		state->shutdown = true;
+		return;
+	}
+	state->input_len += bytes_read;
 
-	size_t cur_row = state->height-2;
-	size_t end_row = 1;
-	cursorMoveTo(cur_row, 1);
-	for (size_t i = 0; i < state->log.msg_count; i++) {
-		if (cur_row < end_row) break;
+	char* line = state->input_bfr;
+	char* input_end = state->input_bfr + state->input_len;
+	char* newline;
+	while (!state->shutdown && (newline = memchr(line, '\n', input_end - line)) != NULL) {
+		*newline = '\0';
+		submitLine(state, line);
+		line = newline + 1;
+	}
+
+	state->input_len = input_end - line;
+	memmove(state->input_bfr, line, state->input_len);
+	if (state->input_len == INPUT_LENGTH - 1) {
+		state->input_bfr[state->input_len] = '\0';
+		submitLine(state, state->input_bfr);
+		state->input_len = 0;
+	}
+}
+
+static void handleResize(struct ClientState* state, int signal_fd) {
+	struct signalfd_siginfo info;
+	while (read(signal_fd, &info, sizeof(info)) == sizeof(info));
+
+	Screen_resize(&state->screen);
+	state->redraw = true;
+}
+
+// Returns false if message `seq` has been received before. Messages too old
+// to be tracked are assumed to have been.
+static bool markSeen(struct ClientState* state, uint64_t seq) {
+	if (seq == 0) return true;
 
-		// TODO: This probably breaks if the message is longer than one line
-		printf("%s", getNthNewestMessage(&state->log, i+1));
-		displayEraseLineFromCursor();
-		cursorMoveUpToLeft(1);
+	uint64_t* word = &state->seen[(seq % SEEN_WINDOW) / 64];
+	uint64_t bit = 1ull << (seq % 64);
 
-		cur_row--;
+	if (seq > state->last_seq) {
+		if (seq - state->last_seq >= SEEN_WINDOW) {
+			memset(state->seen, 0, sizeof(state->seen));
+		} else {
+			for (uint64_t i = state->last_seq + 1; i < seq; i++)
+				state->seen[(i % SEEN_WINDOW) / 64] &= ~(1ull << (i % 64));
+		}
+		state->last_seq = seq;
+		*word |= bit;
+		return true;
 	}
 
-	cursorRestorePosition();
-	fflush(stdout);
+	if (state->last_seq - seq >= SEEN_WINDOW || (*word & bit)) return false;
+	*word |= bit;
+	return true;
 }
 
 static void handleSegment(struct ClientState* state) {
 	switch (state->connection.segment_type) {
 		case SEGMENT_MESSAGE: {
 			char bfr[SEGMENT_MAX_LENGTH + 40];
-			struct Segment_Message* segment = state->connection.segment;
-			sprintf(bfr, "<%s> %s", segment->sender, segment->contents);
-			appendMessage(&state->log, bfr);
+			struct Segment_Message* segment = &state->connection.segment.message;
+			// Messages resent on resuming may have already arrived
+			if (!markSeen(state, segment->seq)) break;
+			int length = snprintf(bfr, sizeof(bfr), "<%.*s> %.*s",
+				(int)segment->sender_len, segment->sender, (int)segment->contents_len, segment->contents);
+			appendLine(state, bfr, printedLength(length, sizeof(bfr)));
+			break;
+		}
+		case SEGMENT_ROOM_MESSAGE: {
+			char bfr[SEGMENT_MAX_LENGTH + 40];
+			struct Segment_RoomMessage* segment = &state->connection.segment.room_message;
+			int length = snprintf(bfr, sizeof(bfr), "[%.*s] <%.*s> %.*s", (int)segment->room_len, segment->room,
+				(int)segment->sender_len, segment->sender, (int)segment->contents_len, segment->contents);
+			appendLine(state, bfr, printedLength(length, sizeof(bfr)));
+			break;
+		}
+		case SEGMENT_DIRECT: {
+			char bfr[SEGMENT_MAX_LENGTH + 40];
+			struct Segment_Direct* segment = &state->connection.segment.direct;
+			int length = snprintf(bfr, sizeof(bfr), "[from %.*s] %.*s",
+				(int)segment->nick_len, segment->nick, (int)segment->contents_len, segment->contents);
+			appendLine(state, bfr, printedLength(length, sizeof(bfr)));
+			break;
+		}
+		case SEGMENT_NICK: {
+			struct Segment_Nick* segment = &state->connection.segment.nick;
+			if (segment->nick_len > NICKNAME_MAX) break;
+			bool changed = segment->nick_len != strlen(state->nick) || memcmp(segment->nick, state->nick, segment->nick_len) != 0;
+			memcpy(state->nick, segment->nick, segment->nick_len);
+			state->nick[segment->nick_len] = '\0';
+			if (!changed) break;
+
+			char notice[NICKNAME_MAX + 32];
+			snprintf(notice, sizeof(notice), "You are now known as %s.", state->nick);
+			appendNotice(state, notice);
+			break;
+		}
+		case SEGMENT_JOIN: {
+			struct Segment_Room* segment = &state->connection.segment.room;
+			if (segment->room_len > ROOM_NAME_MAX) break;
+			char room[ROOM_NAME_MAX + 1];
+			memcpy(room, segment->room, segment->room_len);
+			room[segment->room_len] = '\0';
+			if (strcmp(room, state->room) == 0) break;
+
+			// Only one room at a time is typed into, so the last is left
+			if (state->room[0] != '\0') sendSegment_Leave(&state->connection, state->room);
+			strcpy(state->room, room);
+			char notice[ROOM_NAME_MAX + 64];
+			snprintf(notice, sizeof(notice), "Joined %s, /leave to talk to everyone again.", room);
+			appendNotice(state, notice);
+			break;
+		}
+		case SEGMENT_LEAVE: {
+			struct Segment_Room* segment = &state->connection.segment.room;
+			if (segment->room_len != strlen(state->room) || memcmp(segment->room, state->room, segment->room_len) != 0) break;
+			state->room[0] = '\0';
+			appendNotice(state, "Left the room, talking to everyone.");
 			break;
 		}
 		case SEGMENT_STATUS: {
 			char bfr[SEGMENT_MAX_LENGTH + 40];
-			struct Segment_Status* segment = state->connection.segment;
-			sprintf(bfr, "<SERVER> %s", segment->status);
-			appendMessage(&state->log, bfr);
+			struct Segment_Status* segment = &state->connection.segment.status;
+			int length = snprintf(bfr, sizeof(bfr), "<SERVER> %.*s", (int)segment->status_len, segment->status);
+			appendLine(state, bfr, printedLength(length, sizeof(bfr)));
+			break;
+		}
+		case SEGMENT_RESUME: {
+			if (state->connection.segment.resume.seq > state->last_seq) break;
+			state->last_seq = 0;
+			memset(state->seen, 0, sizeof(state->seen));
+			appendNotice(state, "The server restarted, messages sent while disconnected were lost.");
+			break;
+		}
+		case SEGMENT_PING: {
+			sendSegment_Pong(&state->connection, state->connection.segment.ping.token);
+			break;
+		}
+		case SEGMENT_HELLO: {
+			struct Segment_Hello* segment = &state->connection.segment.hello;
+			if (segment->version == PROTOCOL_VERSION) {
+				state->connection.features = segment->features;
+				if ((segment->features & FEATURE_DEFLATE) && !enableCompression(&state->connection))
+					appendNotice(state, "Unable to start compressing, sending uncompressed.");
+				if (state->nick[0] != '\0' && (segment->features & FEATURE_NICKNAMES))
+					sendSegment_Nick(&state->connection, state->nick);
+				if (state->room[0] == '\0') break;
+				// Rooms last only as long as the connection
+				if (segment->features & FEATURE_ROOMS) {
+					sendSegment_Join(&state->connection, state->room);
+				} else {
+					state->room[0] = '\0';
+					appendNotice(state, "The server no longer has rooms, talking to everyone.");
+				}
+				break;
+			}
+
+			char notice[96];
+			snprintf(notice, sizeof(notice), "The server speaks protocol version %u, this client speaks %u.",
+				segment->version, PROTOCOL_VERSION);
+			appendNotice(state, notice);
+			state->incompatible = true;
 			break;
 		}
 		default:
-			printf("Default segment type?\n");
+			// Segments this client has no use for are ignored
 			break;
 	}
 	markHandled(&state->connection);
 }
 
-int client(uint32_t ip, uint16_t port) {
-	struct sockaddr_in server_address = {0};
-	server_address.sin_family = AF_INET;
-	server_address.sin_port = htons(port);
-	server_address.sin_addr = (struct in_addr) { htonl(ip) };
+// Asks for what was missed: everything since the newest message received, or
+// on first connecting, the configured amount of history
+static void requestMissed(struct ClientState* state) {
+	struct Frame* request;
+	if (state->last_seq > 0) request = Frame_newResume(state->last_seq);
+	else if (state->config->history > 0) request = Frame_newHistory(state->config->history, 0);
+	else return;
 
-	int sfd_server = socket(AF_INET, SOCK_STREAM, 0);
+	queueFrame(&state->connection, request);
+	Frame_release(request);
+	flushConnection(&state->connection);
+}
 
-	if (connect(sfd_server, (struct sockaddr*)&server_address, sizeof(struct sockaddr_in)) != 0) {
-		printf("Failed to connect.\n");
-		printf("errno: %d\n", errno);
-		return 1;
+// Opens the conversation on a new connection. Requests can follow the hello
+// straight away, as the server answers them in order.
+static void greetServer(struct ClientState* state) {
+	uint32_t features = CLIENT_FEATURES;
+	if (state->config->compression) features |= FEATURE_DEFLATE;
+	struct Frame* hello = Frame_newHello(PROTOCOL_VERSION, features);
+	queueFrame(&state->connection, hello);
+	Frame_release(hello);
+	requestMissed(state);
+}
+
+static void scheduleReconnect(struct ClientState* state) {
+	state->retry_at_ns = nowNs() + state->backoff_ms * 1000000ull;
+	state->backoff_ms = state->backoff_ms * 2 < RECONNECT_MAX_MS ? state->backoff_ms * 2 : RECONNECT_MAX_MS;
+}
+
+static void dropConnection(struct ClientState* state) {
+	cleanupConnection(&state->connection);
+	state->connected = false;
+	state->connecting = false;
+	scheduleReconnect(state);
+}
+
+static void startReconnect(struct ClientState* state) {
+	int sfd_server = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (sfd_server == -1) {
+		scheduleReconnect(state);
+		return;
 	}
 
-	fcntl(sfd_server, F_SETFL, fcntl(sfd_server, F_GETFL) | O_NONBLOCK);
+	if (connect(sfd_server, (struct sockaddr*)&state->server_address, sizeof(struct sockaddr_in)) != 0 && errno != EINPROGRESS) {
+		close(sfd_server);
+		scheduleReconnect(state);
+		return;
+	}
 
-	struct Connection server_connection = newConnection(sfd_server);
+	state->connection = newConnection(sfd_server);
+	state->connected = true;
+	state->connecting = true;
+}
+
+static void finishReconnect(struct ClientState* state) {
+	int error = 0;
+	socklen_t error_len = sizeof(error);
+	getsockopt(state->connection.socket, SOL_SOCKET, SO_ERROR, &error, &error_len);
+	if (error != 0) {
+		dropConnection(state);
+		return;
+	}
+
+	state->connecting = false;
+	state->backoff_ms = RECONNECT_MIN_MS;
+	appendNotice(state, "Reconnected.");
+	greetServer(state);
+}
+
+// Milliseconds poll may sleep for before a reconnect is due
+static int pollTimeout(struct ClientState* state) {
+	if (state->connected || state->incompatible) return -1;
+	uint64_t now_ns = nowNs();
+	if (now_ns >= state->retry_at_ns) return 0;
+	return (state->retry_at_ns - now_ns + 999999) / 1000000;
+}
 
+int client(const struct ClientConfig* config) {
 	struct ClientState state = {0};
-	state.connection = server_connection;
+	state.config = config;
+	state.server_address.sin_family = AF_INET;
+	state.server_address.sin_port = htons(config->port);
+	state.server_address.sin_addr = (struct in_addr) { htonl(config->ip) };
+	state.backoff_ms = RECONNECT_MIN_MS;
+	if (config->nick != NULL) snprintf(state.nick, sizeof(state.nick), "%s", config->nick);
+
+	int sfd_server = socket(AF_INET, SOCK_STREAM, 0);
 
-	thrd_t input_thread;
-	if (thrd_create(&input_thread, (thrd_start_t)inputLoop, &state) != thrd_success) {
-		printf("Failed to create thread.\n");
+	if (connect(sfd_server, (struct sockaddr*)&state.server_address, sizeof(struct sockaddr_in)) != 0) {
+		printf("Failed to connect.\n");
+		printf("errno: %d\n", errno);
 		return 1;
 	}
 
+	fcntl(sfd_server, F_SETFL, fcntl(sfd_server, F_GETFL) | O_NONBLOCK);
+
+	state.connection = newConnection(sfd_server);
+	state.connected = true;
+	state.scrollback = newScrollback(config->scrollback);
+	greetServer(&state);
+
 	printf("Entering alt buffer\n");
 	displayEnterAltBuffer();
 	fflush(stdout);
 
-	state.width = 80;
-	state.height = 15;
+	// Resizes are picked up by the poll loop rather than a handler
+	sigset_t resize_signals;
+	sigemptyset(&resize_signals);
+	sigaddset(&resize_signals, SIGWINCH);
+	sigprocmask(SIG_BLOCK, &resize_signals, NULL);
+	int signal_fd = signalfd(-1, &resize_signals, SFD_NONBLOCK | SFD_CLOEXEC);
 
-	cursorMoveTo(state.height, 1);
-	fflush(stdout);
+	state.screen = newScreen(STDOUT_FILENO);
+	Screen_flush(&state.screen);
 
-	while (true) {
-		updateConnection(&state.connection);
+	// Sleeps until the keyboard, the server or the terminal has something for
+	// us, or until it is time to try reconnecting
+	while (!state.shutdown) {
+		struct pollfd fds[3] = {0};
+		fds[0].fd = STDIN_FILENO;
+		fds[0].events = POLLIN;
+		// Negative descriptors are ignored by poll
+		fds[1].fd = state.connected ? state.connection.socket : -1;
+		fds[1].events = POLLIN;
+		if (state.connecting || hasPendingOutput(&state.connection)) fds[1].events |= POLLOUT;
+		fds[2].fd = signal_fd;
+		fds[2].events = POLLIN;
 
-		if (state.connection.segment_ready) {
-			handleSegment(&state);
-			displayMessages(&state);
+		if (poll(fds, 3, pollTimeout(&state)) == -1) {
+			if (errno == EINTR) continue;
+			break;
 		}
-		
-		if (state.input_ready) {
-			if (strcmp(state.input_bfr, "exit") == 0) {
-				state.shutdown = true;
-				state.input_ready = false;
-				break;
+
+		if (fds[2].revents & POLLIN)
+			handleResize(&state, signal_fd);
+
+		if (!state.connected && !state.incompatible && nowNs() >= state.retry_at_ns) {
+			startReconnect(&state);
+		} else if (state.connecting) {
+			if (fds[1].revents & (POLLOUT | POLLHUP | POLLERR)) finishReconnect(&state);
+		} else if (state.connected) {
+			if (fds[1].revents & POLLOUT)
+				flushConnection(&state.connection);
+
+			if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+				while (true) {
+					updateConnection(&state.connection);
+					if (!state.connection.segment_ready) break;
+					handleSegment(&state);
+				}
+
+				if (state.connection.reader.closed) {
+					dropConnection(&state);
+					if (state.incompatible) appendNotice(&state, "Disconnected by the server.");
+					else appendNotice(&state, "Lost connection to the server, reconnecting.");
+				}
 			}
+		}
+
+		if (fds[0].revents & (POLLIN | POLLHUP))
+			handleInput(&state);
 
-			sendSegment_Message(&state.connection, "client", state.input_bfr);
-			cursorMoveTo(state.height, 1);
-			displayEraseLine();
-			state.input_ready = false;
-			fflush(stdout);
+		// Everything that happened this tick is drawn as one frame
+		if (state.redraw) {
+			Screen_drawMessages(&state.screen, scrollbackSource, &state);
+			Screen_flush(&state.screen);
+			state.redraw = false;
 		}
 	}
-	cleanupConnection(&state.connection);
-	emptyLog(&state.log);
+	if (state.connected) cleanupConnection(&state.connection);
+	cleanupScreen(&state.screen);
+	close(signal_fd);
+	cleanupScrollback(&state.scrollback);
 	displayLeaveAltBuffer();
 	fflush(stdout);
 
-	thrd_join(input_thread, NULL);
-	
-	close(sfd_server);
 	return 0;
 }
@@ -0,0 +1,153 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+#include "handoff.h"
+
+static bool socketAddress(const char* path, struct sockaddr_un* address) {
+	*address = (struct sockaddr_un) {0};
+	address->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address->sun_path)) {
+		logMessage("Handoff socket path is too long.\n");
+		return false;
+	}
+	strcpy(address->sun_path, path);
+	return true;
+}
+
+int Handoff_listen(const char* path) {
+	struct sockaddr_un address;
+	if (!socketAddress(path, &address)) return -1;
+
+	int sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sfd == -1) {
+		logMessage("Unable to create handoff socket.\n");
+		return -1;
+	}
+
+	unlink(path);
+	if (bind(sfd, (struct sockaddr*) &address, sizeof(struct sockaddr_un)) != 0
+	|| listen(sfd, 1) != 0) {
+		logMessage("Unable to bind handoff socket: %s\n", strerror(errno));
+		close(sfd);
+		return -1;
+	}
+
+	return sfd;
+}
+
+int Handoff_connect(const char* path) {
+	struct sockaddr_un address;
+	if (!socketAddress(path, &address)) return -1;
+
+	int sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sfd == -1) return -1;
+	if (connect(sfd, (struct sockaddr*) &address, sizeof(struct sockaddr_un)) != 0) {
+		close(sfd);
+		return -1;
+	}
+	return sfd;
+}
+
+static bool sendAll(int socket, const void* data, size_t length) {
+	const unsigned char* bytes = data;
+	while (length > 0) {
+		ssize_t bytes_sent = send(socket, bytes, length, MSG_NOSIGNAL);
+		if (bytes_sent == -1 && errno == EINTR) continue;
+		if (bytes_sent <= 0) return false;
+		bytes += bytes_sent;
+		length -= bytes_sent;
+	}
+	return true;
+}
+
+// Reads exactly `length` bytes. A descriptor passed along with any of them is
+// kept in `fd`.
+static bool receiveAll(int socket, void* data, size_t length, int* fd) {
+	unsigned char* bytes = data;
+	while (length > 0) {
+		struct iovec iovec = { bytes, length };
+		union {
+			struct cmsghdr header;
+			char space[CMSG_SPACE(sizeof(int))];
+		} control;
+		struct msghdr message = {0};
+		message.msg_iov = &iovec;
+		message.msg_iovlen = 1;
+		message.msg_control = &control;
+		message.msg_controllen = sizeof(control);
+
+		ssize_t bytes_received = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+		if (bytes_received == -1 && errno == EINTR) continue;
+		if (bytes_received <= 0) return false;
+
+		struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+		if (header != NULL && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+			int received;
+			memcpy(&received, CMSG_DATA(header), sizeof(int));
+			if (fd != NULL && *fd == -1) *fd = received;
+			else close(received);
+		}
+		bytes += bytes_received;
+		length -= bytes_received;
+	}
+	return true;
+}
+
+bool Handoff_send(int socket, const struct HandoffRecord* record, int fd, const void* payload) {
+	size_t sent = 0;
+	if (fd != -1) {
+		// The descriptor rides along with the first bytes of the record
+		struct iovec iovec = { (void*)record, sizeof(struct HandoffRecord) };
+		union {
+			struct cmsghdr header;
+			char space[CMSG_SPACE(sizeof(int))];
+		} control = {0};
+		struct msghdr message = {0};
+		message.msg_iov = &iovec;
+		message.msg_iovlen = 1;
+		message.msg_control = &control;
+		message.msg_controllen = sizeof(control);
+
+		struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+		header->cmsg_level = SOL_SOCKET;
+		header->cmsg_type = SCM_RIGHTS;
+		header->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(header), &fd, sizeof(int));
+
+		ssize_t bytes_sent;
+		do bytes_sent = sendmsg(socket, &message, MSG_NOSIGNAL);
+		while (bytes_sent == -1 && errno == EINTR);
+		if (bytes_sent <= 0) return false;
+		sent = bytes_sent;
+	}
+
+	return sendAll(socket, (const unsigned char*)record + sent, sizeof(struct HandoffRecord) - sent)
+		&& sendAll(socket, payload, record->payload_length);
+}
+
+bool Handoff_receive(int socket, struct HandoffRecord* record, int* fd, unsigned char** payload) {
+	*fd = -1;
+	*payload = NULL;
+	// Records never share a read with what comes after them, so a descriptor
+	// read alongside one was sent with it
+	if (!receiveAll(socket, record, sizeof(struct HandoffRecord), fd)) goto failed;
+	if (record->payload_length == 0) return true;
+
+	*payload = malloc(record->payload_length);
+	if (!receiveAll(socket, *payload, record->payload_length, NULL)) goto failed;
+	return true;
+
+failed:
+	if (*fd != -1) close(*fd);
+	*fd = -1;
+	free(*payload);
+	*payload = NULL;
+	return false;
+}
@@ -0,0 +1,100 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash_index.h"
+
+#define INITIAL_CAPACITY 16
+
+// FNV-1a
+static uint64_t hashKey(const char* key, size_t key_len) {
+	uint64_t hash = 0xCBF29CE484222325;
+	for (size_t i = 0; i < key_len; i++) {
+		hash ^= (unsigned char)key[i];
+		hash *= 0x100000001B3;
+	}
+	return hash;
+}
+
+// Returns the slot holding the key, or the empty slot it would go in
+static size_t findSlot(const struct HashIndex* index, uint64_t hash, const char* key, size_t key_len) {
+	size_t mask = index->capacity - 1;
+	size_t slot = hash & mask;
+	while (true) {
+		const struct HashEntry* entry = &index->entries[slot];
+		if (entry->value == NULL) return slot;
+		if (entry->hash == hash && entry->key_len == key_len && memcmp(entry->key, key, key_len) == 0) return slot;
+		slot = (slot + 1) & mask;
+	}
+}
+
+// Doubles the table, which is kept under three quarters full
+static void grow(struct HashIndex* index) {
+	struct HashEntry* old_entries = index->entries;
+	size_t old_capacity = index->capacity;
+	index->capacity = old_capacity > 0 ? old_capacity * 2 : INITIAL_CAPACITY;
+	index->entries = calloc(index->capacity, sizeof(struct HashEntry));
+
+	for (size_t i = 0; i < old_capacity; i++) {
+		struct HashEntry* entry = &old_entries[i];
+		if (entry->value == NULL) continue;
+		index->entries[findSlot(index, entry->hash, entry->key, entry->key_len)] = *entry;
+	}
+	free(old_entries);
+}
+
+void initHashIndex(struct HashIndex* index) {
+	index->entries = NULL;
+	index->capacity = 0;
+	index->count = 0;
+}
+
+void* HashIndex_get(const struct HashIndex* index, const char* key, size_t key_len) {
+	if (index->count == 0) return NULL;
+	return index->entries[findSlot(index, hashKey(key, key_len), key, key_len)].value;
+}
+
+bool HashIndex_insert(struct HashIndex* index, const char* key, size_t key_len, void* value) {
+	if ((index->count + 1) * 4 > index->capacity * 3) grow(index);
+
+	uint64_t hash = hashKey(key, key_len);
+	struct HashEntry* entry = &index->entries[findSlot(index, hash, key, key_len)];
+	if (entry->value != NULL) return false;
+
+	entry->hash = hash;
+	entry->key = key;
+	entry->key_len = key_len;
+	entry->value = value;
+	index->count++;
+	return true;
+}
+
+void* HashIndex_remove(struct HashIndex* index, const char* key, size_t key_len) {
+	if (index->count == 0) return NULL;
+	size_t mask = index->capacity - 1;
+	size_t hole = findSlot(index, hashKey(key, key_len), key, key_len);
+	void* value = index->entries[hole].value;
+	if (value == NULL) return NULL;
+
+	// Entries further along the run move into the hole unless that would put
+	// them before the slot they hash to
+	size_t slot = hole;
+	while (true) {
+		slot = (slot + 1) & mask;
+		struct HashEntry* entry = &index->entries[slot];
+		if (entry->value == NULL) break;
+		size_t home = entry->hash & mask;
+		if (((slot - home) & mask) < ((slot - hole) & mask)) continue;
+		index->entries[hole] = *entry;
+		hole = slot;
+	}
+	index->entries[hole].value = NULL;
+	index->count--;
+	return value;
+}
+
+void cleanupHashIndex(struct HashIndex* index) {
+	free(index->entries);
+	initHashIndex(index);
+}
@@ -1,6 +1,21 @@
 #pragma once
 
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
-int client(uint32_t ip, uint16_t port);
+struct ClientConfig {
+	uint32_t ip;
+	uint16_t port;
+	// Lines of history kept for scrolling back
+	size_t scrollback;
+	// Messages from before joining to ask the server to replay
+	uint32_t history;
+	// Offer the server FEATURE_DEFLATE
+	bool compression;
+	// Nickname to register on connecting, or NULL for none
+	char* nick;
+};
+
+int client(const struct ClientConfig* config);
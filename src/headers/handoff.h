@@ -0,0 +1,81 @@
+#pragma once
+
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "networking.h"
+
+// Bumped whenever a record changes, since both sides copy them as they are
+#define HANDOFF_VERSION 1
+
+/* HANDOFF SEQUENCE
+ * A running server hands its sockets to a newly started one over a Unix
+ * socket. The new process connects and sends HANDOFF_STATE with its version.
+ * The running one stops where it is and replies with:
+ * - HANDOFF_STATE, carrying the next sequence number and how many listening
+ *   sockets follow
+ * - HANDOFF_LISTENER, once per listening socket, passed along with it
+ * - HANDOFF_CLIENT, once per connection, passed along with it
+ * - HANDOFF_MESSAGE, once per message in its retransmit window
+ * - HANDOFF_END, once it has let go of everything, journal included
+ */
+enum HandoffRecordType {
+	HANDOFF_STATE,
+	HANDOFF_LISTENER,
+	HANDOFF_CLIENT,
+	HANDOFF_MESSAGE,
+	HANDOFF_END,
+};
+
+// Marks a compressed stream the peer has not started in `HandoffClient`
+#define HANDOFF_NO_STREAM UINT32_MAX
+
+// Everything about a connection that lives outside its socket. The record's
+// payload holds, in order: the bytes received but not yet parsed, the output
+// not yet written, the nickname, the window of each of the peer's compressed
+// streams that has started, and the name of each room, each preceded by a
+// byte giving its length.
+struct HandoffClient {
+	uint32_t features;
+	bool greeted;
+	uint64_t joined_seq;
+	uint64_t replay_next_seq;
+	uint64_t replay_end_seq;
+	uint64_t replay_missed;
+	uint32_t input_length;
+	// The output starts with however much of its oldest frame was written
+	uint32_t output_length;
+	uint32_t output_written;
+	uint32_t nickname_length;
+	uint32_t window_lengths[COMPRESSION_STREAM_COUNT];
+	uint32_t num_rooms;
+};
+
+struct HandoffRecord {
+	enum HandoffRecordType type;
+	// Bytes that follow the record
+	uint32_t payload_length;
+	union {
+		struct {
+			uint32_t version;
+			uint32_t num_listeners;
+			uint64_t next_seq;
+		} state;
+		// The payload is the message's frame
+		struct {
+			uint64_t seq;
+		} message;
+		struct HandoffClient client;
+	};
+};
+
+// Returns -1 on failure
+int Handoff_listen(const char* path);
+// Returns -1, logging nothing, if no server is listening at `path`
+int Handoff_connect(const char* path);
+// Sends `fd` along with the record unless it is -1
+bool Handoff_send(int socket, const struct HandoffRecord* record, int fd, const void* payload);
+// Sets `fd` to the descriptor passed with the record, or -1, and `payload` to
+// an allocation holding its payload, or NULL if it has none
+bool Handoff_receive(int socket, struct HandoffRecord* record, int* fd, unsigned char** payload);
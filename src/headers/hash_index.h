@@ -0,0 +1,35 @@
+#pragma once
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct HashEntry {
+	uint64_t hash;
+	const char* key;
+	size_t key_len;
+	// NULL while the entry is empty
+	void* value;
+};
+
+// Maps byte string keys to values in one flat table, probing linearly from
+// the slot a key hashes to. Removal shifts the entries after it back rather
+// than leaving tombstones, so lookups never probe further than the longest
+// run of occupied slots. Keys are not copied; each must stay valid, and
+// unchanged, until it is removed, which is simplest when the value owns it.
+struct HashIndex {
+	struct HashEntry* entries;
+	size_t capacity;
+	size_t count;
+};
+
+void initHashIndex(struct HashIndex* index);
+// Returns NULL if nothing is stored under the key
+void* HashIndex_get(const struct HashIndex* index, const char* key, size_t key_len);
+// `value` must not be NULL. Returns false, storing nothing, if the key is
+// already in use.
+bool HashIndex_insert(struct HashIndex* index, const char* key, size_t key_len, void* value);
+// Returns the value that was stored under the key, or NULL if there was none
+void* HashIndex_remove(struct HashIndex* index, const char* key, size_t key_len);
+void cleanupHashIndex(struct HashIndex* index);
@@ -0,0 +1,30 @@
+#pragma once
+
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Log-linear histogram in the style of HdrHistogram. Values below
+// HISTOGRAM_SUB_BUCKETS are counted exactly; above that every power of two is
+// split into HISTOGRAM_SUB_BUCKETS/2 buckets, keeping the relative error of
+// any reported value under 1/32 across the full 64 bit range.
+//
+// A histogram has a single writer, which records without atomic
+// read-modify-write operations. Other threads may merge it into their own
+// histogram at any time and will see a slightly stale but untorn view.
+#define HISTOGRAM_SUB_BUCKET_BITS 6
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS + (64 - HISTOGRAM_SUB_BUCKET_BITS) * (HISTOGRAM_SUB_BUCKETS / 2))
+
+struct Histogram {
+	_Atomic uint64_t counts[HISTOGRAM_BUCKETS];
+	_Atomic uint64_t total;
+	_Atomic uint64_t max;
+};
+
+void Histogram_record(struct Histogram* histogram, uint64_t value);
+void Histogram_merge(struct Histogram* into, const struct Histogram* from);
+void Histogram_clear(struct Histogram* histogram);
+// Returns the smallest recorded value such that `percentile` percent of all
+// recorded values are at or below it, rounded to its bucket's upper bound
+uint64_t Histogram_percentile(const struct Histogram* histogram, double percentile);
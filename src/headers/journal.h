@@ -0,0 +1,132 @@
+#pragma once
+
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <threads.h>
+
+#include "dyn_arr.h"
+
+#include "mpsc_queue.h"
+#include "networking.h"
+
+// Size each segment file is created at. A frame that does not fit in what is
+// left of the active segment starts a new one.
+#define JOURNAL_SEGMENT_SIZE (64 * 1024 * 1024)
+// Bytes of frames between sparse index entries
+#define JOURNAL_INDEX_INTERVAL (4 * 1024)
+
+/* JOURNAL LAYOUT
+ * The journal is a directory of segment files, each named after the sequence
+ * number of its first frame as 20 decimal digits with a `.log` extension.
+ * A segment holds encoded frames back to back, exactly as they are sent on
+ * the wire, and each frame's sequence number is one higher than the frame
+ * before it. The unused remainder of a segment is zero filled, so a zero type
+ * byte marks the end of its frames. Sequence numbers start at 1. Segments are
+ * truncated to their frames once a newer segment is started.
+ *
+ * Beside each segment is a `.sum` file holding the CRC-32 of each of its
+ * frames, in order, as uint32_t in host byte order. Recovery stops at the
+ * first frame that does not match its checksum, or has none.
+ *
+ * Beside each segment is a `.idx` file of JournalIndexEntry records in host
+ * byte order: one for the first frame of the segment, then one for the first
+ * frame to start in each following JOURNAL_INDEX_INTERVAL bytes.
+ */
+struct JournalIndexEntry {
+	uint64_t seq;
+	// Wall clock time the frame was appended, in nanoseconds since the epoch
+	uint64_t timestamp;
+	uint64_t offset;
+};
+
+struct JournalSegment {
+	uint64_t base_seq;
+	int fd;
+	int index_fd;
+	int sum_fd;
+	// Bytes of whole frames in the segment, and how many frames that is
+	uint64_t length;
+	uint64_t count;
+	struct DynamicArray index;
+};
+
+// A frame waiting to be written by the journal thread
+struct JournalEntry {
+	struct MPSCNode node;
+	uint64_t seq;
+	uint64_t timestamp;
+	struct Frame* frame;
+};
+
+/* Frames are appended from any thread without blocking, each with a sequence
+ * number handed out by the caller. Every number from `first_seq` on must be
+ * appended exactly once, in any order. A single journal thread writes them
+ * through a shared mapping of the active segment, batching everything that
+ * has arrived since it last woke, and syncs at most once per `fsync_ms` while
+ * there are unsynced writes.
+ */
+struct Journal {
+	unsigned int fsync_ms;
+	int dir_fd;
+	// Sequence number following the last frame recovered on start, or the
+	// `start_seq` it was started at if that is later
+	uint64_t first_seq;
+	thrd_t thread;
+	atomic_bool running;
+	atomic_bool wake_pending;
+	int wake_fd;
+	struct MPSCQueue queue;
+	// `segments`, and the segments in it, may be read by other threads while
+	// holding `lock`, which the journal thread only holds to change them.
+	// Everything else below belongs to the journal thread.
+	mtx_t lock;
+	struct DynamicArray segments;
+	// Mapping of the active segment, which is the last one in `segments`
+	unsigned char* map;
+	// Checksums of the frames copied into the active segment since they were
+	// last written to its `.sum` file
+	struct DynamicArray sums;
+	// Entries that arrived ahead of an earlier sequence number, as a min-heap
+	struct JournalEntry** pending;
+	size_t num_pending;
+	size_t pending_capacity;
+	// Sequence number of the next frame to write
+	uint64_t write_seq;
+	// Bytes of the active segment as of the last sync
+	uint64_t synced_length;
+	uint64_t last_sync_ns;
+};
+
+// Opens the journal in the directory at `path`, creating either if needed,
+// and starts the thread that writes to it. Numbering skips ahead to a new
+// segment at `start_seq` if the journal ends before it.
+bool Journal_start(struct Journal* journal, const char* path, unsigned int fsync_ms, uint64_t start_seq);
+// Writes and syncs everything appended so far, then stops the journal thread
+void Journal_stop(struct Journal* journal);
+
+// Queues `frame` to be written as frame `seq`. The caller keeps its own
+// reference to `frame`.
+void Journal_append(struct Journal* journal, struct Frame* frame, uint64_t seq);
+
+// A run of whole frames within one segment file. The file descriptor stays
+// open for as long as the journal runs.
+struct JournalRange {
+	uint64_t seq;
+	uint64_t count;
+	int fd;
+	uint64_t offset;
+	uint64_t length;
+};
+// Finds the frames from `seq` up to, but not including, `end_seq`. If `seq`
+// is older than the journal, the range starts at the oldest frame instead.
+// The range stops at the end of a segment, and at the first index entry past
+// `max_bytes` from its start. Returns false if none of the frames have been
+// written yet.
+bool Journal_read(struct Journal* journal, uint64_t seq, uint64_t end_seq, uint64_t max_bytes, struct JournalRange* range);
+// Returns the sequence number of the frame to start from to include every
+// frame appended since `timestamp`, in nanoseconds since the epoch. Timestamps
+// are only kept per index entry, so up to an interval of older frames may
+// come before them.
+uint64_t Journal_findTime(struct Journal* journal, uint64_t timestamp);
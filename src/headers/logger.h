@@ -0,0 +1,19 @@
+#pragma once
+
+
+#include <stdbool.h>
+
+// Lines each thread may log per second, and how many it may log at once
+// after staying quiet for a while
+#define LOG_RATE 20
+#define LOG_BURST 100
+
+bool Logger_start();
+// Writes out everything still queued and stops the logging thread
+void Logger_stop();
+
+// Formats a line and hands it to the logging thread, never blocking the
+// caller on output. Lines over a thread's rate limit are dropped, and the
+// next line that gets through reports how many were. Before `Logger_start`
+// or after `Logger_stop`, lines are written directly instead.
+void logMessage(const char* format, ...) __attribute__((format(printf, 1, 2)));
@@ -0,0 +1,65 @@
+#pragma once
+
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "histogram.h"
+#include "networking.h"
+
+enum Counter {
+	COUNTER_ACCEPTS,
+	COUNTER_DISCONNECTS,
+	COUNTER_BYTES_IN,
+	COUNTER_BYTES_OUT,
+	COUNTER_DROPPED_FRAMES,
+	// Bytes of frames fed to the shared broadcast compressor, and what they
+	// compressed to
+	COUNTER_COMPRESSOR_IN,
+	COUNTER_COMPRESSOR_OUT,
+	// Times a connection was stopped for sending segments, or bytes, faster
+	// than its rate limits allow
+	COUNTER_SEGMENT_THROTTLES,
+	COUNTER_BYTE_THROTTLES,
+	// Times a connection had used up its share of a tick with more still to
+	// be read, which was left for a later tick
+	COUNTER_DEFERRED_READS,
+
+	COUNTER_COUNT,
+};
+
+// Gauges hold a current level rather than a running total
+enum Gauge {
+	GAUGE_CONNECTIONS,
+	GAUGE_QUEUED_BYTES,
+
+	GAUGE_COUNT,
+};
+
+// Metrics recorded by a single thread. Like `Histogram`, only the owning
+// thread writes to it, and it does so without atomic read-modify-write
+// operations; readers on other threads merge every thread's metrics together.
+struct Metrics {
+	_Atomic uint64_t counters[COUNTER_COUNT];
+	_Atomic int64_t gauges[GAUGE_COUNT];
+	_Atomic uint64_t segments_in[SEGMENT_TYPE_COUNT];
+	_Atomic uint64_t segments_out[SEGMENT_TYPE_COUNT];
+	// Time spent handling one batch of events
+	struct Histogram loop_time;
+	// Time spent queueing one tick's broadcasts, or one status, on every
+	// connection of a worker
+	struct Histogram fanout_time;
+};
+
+uint64_t Metrics_nowNs();
+
+void Metrics_count(struct Metrics* metrics, enum Counter counter, uint64_t amount);
+void Metrics_adjust(struct Metrics* metrics, enum Gauge gauge, int64_t amount);
+void Metrics_countSegmentIn(struct Metrics* metrics, unsigned char type);
+void Metrics_countSegmentOut(struct Metrics* metrics, unsigned char type, uint64_t amount);
+
+void Metrics_merge(struct Metrics* into, const struct Metrics* from);
+// Writes `metrics` in the Prometheus text exposition format. Returns the
+// number of bytes that would have been written, as snprintf does.
+size_t Metrics_format(const struct Metrics* metrics, char* bfr, size_t size);
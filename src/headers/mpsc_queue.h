@@ -0,0 +1,24 @@
+#pragma once
+
+
+#include <stdatomic.h>
+
+// Intrusive multi-producer single-consumer queue. Embed an `MPSCNode` in the
+// item being queued and recover the item from the node on pop. Any thread may
+// push; only the owning thread may pop. Neither operation takes a lock.
+struct MPSCNode {
+	_Atomic(struct MPSCNode*) next;
+};
+
+struct MPSCQueue {
+	_Atomic(struct MPSCNode*) head;
+	struct MPSCNode* tail;
+	struct MPSCNode stub;
+};
+
+void MPSCQueue_init(struct MPSCQueue* queue);
+void MPSCQueue_push(struct MPSCQueue* queue, struct MPSCNode* node);
+// Returns NULL when the queue is empty, or when a producer is midway through a
+// push. In the latter case the producer is expected to signal the consumer
+// once it is done, so the consumer can simply try again after its next wakeup.
+struct MPSCNode* MPSCQueue_pop(struct MPSCQueue* queue);
@@ -1,69 +1,468 @@
 #pragma once
 
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <zlib.h>
 
-#define SEGMENT_MAX_LENGTH 1024
+#include "dyn_arr.h"
+
+// Version of the protocol described below, exchanged in SEGMENT_HELLO
+#define PROTOCOL_VERSION 2
+// Largest segment body either side will send or accept
+#define SEGMENT_MAX_LENGTH (64 * 1024)
+// Largest a segment header can be: the type and a 3 byte varint length
+#define SEGMENT_MAX_HEADER 4
+// Longest room name either side will send or accept, in bytes
+#define ROOM_NAME_MAX 64
+// Longest nickname either side will send or accept, in bytes
+#define NICKNAME_MAX 32
 
 /* SEGMENT STRUCTURE
  * 1 byte: segment type, one of the SegmentType enumerations
- * 2 bytes: segment remaining data, # of bytes the rest of the segment has
+ * varint: segment remaining data, # of bytes the rest of the segment has, at
+ *	most SEGMENT_MAX_LENGTH
  * n bytes: a number of bytes corresponding to the count specified by the
- *	previous two bytes. This data is interpeted on a per-segment basis
+ *	varint. This data is interpeted on a per-segment basis
+ *
+ * Varints are unsigned LEB128: 7 bits per byte, least significant group
+ * first, with the high bit set on every byte but the last. They must use as
+ * few bytes as possible. Other integers are fixed width and big endian.
+ *
+ * The first segment each side sends is a SEGMENT_HELLO, and a server
+ * disconnects a client that starts with anything else. A segment that breaks
+ * the rules here, or whose fields run past its end, ends the connection.
+ * Bytes left over at the end of a well formed segment are ignored.
  */
 enum SegmentType {
 	SEGMENT_NONE,
 	SEGMENT_MESSAGE,
 	SEGMENT_STATUS,
+	SEGMENT_HISTORY,
+	SEGMENT_RESUME,
+	SEGMENT_HELLO,
+	SEGMENT_BATCH,
+	SEGMENT_COMPRESSED,
+	SEGMENT_PING,
+	SEGMENT_PONG,
+	SEGMENT_JOIN,
+	SEGMENT_LEAVE,
+	SEGMENT_ROOM_MESSAGE,
+	SEGMENT_NICK,
+	SEGMENT_DIRECT,
+
+	// Not a segment type; the number of types above
+	SEGMENT_TYPE_COUNT,
+};
+// Optional parts of the protocol, negotiated in SEGMENT_HELLO
+enum ProtocolFeature {
+	// The client accepts SEGMENT_BATCH
+	FEATURE_BATCH = 1 << 0,
+	// Both sides accept SEGMENT_COMPRESSED
+	FEATURE_DEFLATE = 1 << 1,
+	// Both sides answer SEGMENT_PING
+	FEATURE_HEARTBEAT = 1 << 2,
+	// The server accepts SEGMENT_JOIN, SEGMENT_LEAVE and SEGMENT_ROOM_MESSAGE
+	FEATURE_ROOMS = 1 << 3,
+	// The server accepts SEGMENT_NICK and SEGMENT_DIRECT
+	FEATURE_NICKNAMES = 1 << 4,
 };
+const char* segmentTypeName(unsigned char type);
+// Decodes the segment header at the start of `size` bytes of `data`. Returns
+// the header's length, 0 if it is not all there yet, or -1 if it is invalid.
+int decodeSegmentHeader(const unsigned char* data, size_t size, unsigned char* type, size_t* length);
+
+/* Decoded segments do not own their text. Each string is a view into the
+ * receiving connection's buffer, is NOT null terminated, and is only valid
+ * until `markHandled` is called on the connection. Copy anything that needs
+ * to outlive the segment.
+ */
 
 /* SEGMENT_MESSAGE STRUCTURE
- * 2 bytes: length of the following sender text
- * n bytes: sender name
- * 2 bytes: length of the following message text
+ * 8 bytes: sequence number the server gave the message, one higher for each
+ *	message broadcast. Clients send 0.
+ * varint: length of the following sender text
+ * n bytes: sender name. The server ignores what a client sends here, and
+ *	fills in the nickname the client registered, or UNNAMED_SENDER.
+ * varint: length of the following message text
  * n bytes: message text
  */
 struct Segment_Message {
-	uint16_t sender_len;
+	uint64_t seq;
+	uint32_t sender_len;
 	char* sender;
-	uint16_t contents_len;
+	uint32_t contents_len;
 	char* contents;
 };
 /* SEGMENT_STATUS STRUCTURE
- * 2 bytes: length of the status text
+ * varint: length of the status text
  * n bytes: status text
  */
 struct Segment_Status {
-	uint16_t status_len;
+	uint32_t status_len;
 	char* status;
 };
+/* SEGMENT_HISTORY STRUCTURE
+ * Sent by a client to have messages from before it joined replayed to it.
+ * Replay covers the most recent `count` messages that are no older than
+ * `since`, ending with the last message sent before the client joined.
+ * 4 bytes: count, 0 for no limit
+ * 8 bytes: since, in milliseconds since the epoch, 0 for no limit
+ */
+struct Segment_History {
+	uint32_t count;
+	uint64_t since;
+};
+/* SEGMENT_RESUME STRUCTURE
+ * Sent by a client reconnecting after losing its connection, in place of
+ * SEGMENT_HISTORY, to be sent the messages it missed in between. The server
+ * first answers with a SEGMENT_RESUME of its own, followed by the missed
+ * messages.
+ * 8 bytes: from a client, the newest sequence number it received. From the
+ *	server, the sequence number live delivery continues from; if that is not
+ *	past the client's, the server's numbering has started over.
+ */
+struct Segment_Resume {
+	uint64_t seq;
+};
+/* SEGMENT_HELLO STRUCTURE
+ * Opens the conversation in each direction. The server answers a client's
+ * hello with its own, then disconnects if it does not speak the client's
+ * version.
+ * 2 bytes: protocol version the sender speaks
+ * 4 bytes: ProtocolFeature flags. From a client, every feature it supports.
+ *	From the server, the ones that are in use on the connection.
+ */
+struct Segment_Hello {
+	uint16_t version;
+	uint32_t features;
+};
+/* SEGMENT_BATCH STRUCTURE
+ * Carries several segments in one, only sent to clients that negotiated
+ * FEATURE_BATCH. Decoding hands out the segments inside one at a time, as if
+ * they had been sent separately, so a SEGMENT_BATCH is never seen itself.
+ * n bytes: complete segments back to back, filling the batch exactly, none of
+ *	which may be a SEGMENT_HELLO, SEGMENT_BATCH or SEGMENT_COMPRESSED
+ */
+/* SEGMENT_COMPRESSED STRUCTURE
+ * Only sent once FEATURE_DEFLATE has been agreed. Carries the next piece of
+ * one of the sender's raw deflate streams, ending in a sync flush with its
+ * final 4 bytes (00 00 FF FF) left off. Every piece of a stream is sent, in
+ * order, so each can refer back to the ones before it. Decompressed, a piece
+ * holds up to COMPRESSED_MAX_INFLATED bytes of segments, under the same rules
+ * as the contents of a SEGMENT_BATCH, and is decoded just like one.
+ * 1 byte: the CompressionStream the data belongs to, in the low 7 bits. The
+ *	high bit is set when the stream starts over, with no history, here.
+ * n bytes: compressed data
+ */
+enum CompressionStream {
+	// The sender's stream for this connection alone
+	COMPRESSION_PRIVATE,
+	// The server's stream of broadcasts, shared by many connections
+	COMPRESSION_SHARED,
+
+	COMPRESSION_STREAM_COUNT,
+};
+#define COMPRESSION_RESTART 0x80
+/* SEGMENT_PING AND SEGMENT_PONG STRUCTURE
+ * Only sent once FEATURE_HEARTBEAT has been agreed. Either side may send a
+ * SEGMENT_PING to check that the other is still there, which answers with a
+ * SEGMENT_PONG carrying the same token. The server pings clients that have
+ * gone quiet, and disconnects those that do not answer.
+ * 8 bytes: token, chosen by the sender of the ping
+ */
+struct Segment_Ping {
+	uint64_t token;
+};
+/* SEGMENT_JOIN AND SEGMENT_LEAVE STRUCTURE
+ * Sent by a client to join or leave a room, once FEATURE_ROOMS has been
+ * agreed. The server answers each with the same segment once it is done, or
+ * with a SEGMENT_STATUS saying why it could not be. Rooms are separate from
+ * the conversation every client is part of, and are only as lasting as the
+ * connection: a client that reconnects must join them again.
+ * varint: length of the room name, 1 to ROOM_NAME_MAX bytes
+ * n bytes: room name
+ */
+struct Segment_Room {
+	uint32_t room_len;
+	char* room;
+};
+/* SEGMENT_ROOM_MESSAGE STRUCTURE
+ * A message sent to the members of one room, which the sender must be in.
+ * Room messages are delivered live only: they take no sequence number, and
+ * are neither replayed by SEGMENT_HISTORY nor resent on SEGMENT_RESUME.
+ * varint: length of the room name
+ * n bytes: room name
+ * varint: length of the following sender text
+ * n bytes: sender name, filled in by the server as for SEGMENT_MESSAGE
+ * varint: length of the following message text
+ * n bytes: message text
+ */
+struct Segment_RoomMessage {
+	uint32_t room_len;
+	char* room;
+	uint32_t sender_len;
+	char* sender;
+	uint32_t contents_len;
+	char* contents;
+};
+// The sender of messages from clients that have not registered a nickname,
+// which no client may register
+#define UNNAMED_SENDER "anonymous"
+/* SEGMENT_NICK STRUCTURE
+ * Sent by a client to register the nickname its messages are sent under,
+ * once FEATURE_NICKNAMES has been agreed, in place of any it registered
+ * before. The server answers with the same segment once the nickname is the
+ * client's, or with a SEGMENT_STATUS saying why it is not. Nicknames are
+ * unique across the server and are released when the connection closes.
+ * varint: length of the nickname, 1 to NICKNAME_MAX bytes, none of which may
+ *	be spaces or control characters
+ * n bytes: nickname
+ */
+struct Segment_Nick {
+	uint32_t nick_len;
+	char* nick;
+};
+/* SEGMENT_DIRECT STRUCTURE
+ * A message for one client alone. A client sends it to the holder of a
+ * nickname, and must have registered one itself; the server passes it on
+ * with the nickname replaced by the sender's. Like room messages, direct
+ * messages are delivered live only, and are lost if the recipient is gone.
+ * varint: length of the nickname, of the recipient from a client and of the
+ *	sender from the server
+ * n bytes: nickname
+ * varint: length of the following message text
+ * n bytes: message text
+ */
+struct Segment_Direct {
+	uint32_t nick_len;
+	char* nick;
+	uint32_t contents_len;
+	char* contents;
+};
+#define COMPRESSED_MAX_INFLATED (SEGMENT_MAX_HEADER + SEGMENT_MAX_LENGTH)
 
 
+// A fully encoded segment, ready to be written to any number of connections.
+// Frames are immutable once built and are shared by reference count, so a
+// broadcast is encoded once no matter how many connections it is queued on.
+//
+// A frame may instead refer to `length` bytes of already encoded segments at
+// `file_offset` in the file `fd`, which are sent with `sendfile` and never
+// copied into the process. `data` is empty in that case, and `segments` is
+// how many segments the bytes hold.
+struct Frame {
+	atomic_uint refs;
+	size_t length;
+	int fd;
+	uint64_t file_offset;
+	unsigned int segments;
+	unsigned char data[];
+};
+// Bytes a SEGMENT_MESSAGE with text of the given lengths takes on the wire
+size_t Frame_messageLength(size_t sender_len, size_t contents_len);
+// Return NULL if the text would take the segment past SEGMENT_MAX_LENGTH
+struct Frame* Frame_newMessage(uint64_t seq, char* sender, size_t sender_len, char* contents, size_t contents_len);
+struct Frame* Frame_newStatus(char* status, size_t status_len);
+struct Frame* Frame_newHistory(uint32_t count, uint64_t since);
+struct Frame* Frame_newResume(uint64_t seq);
+struct Frame* Frame_newHello(uint16_t version, uint32_t features);
+struct Frame* Frame_newPing(uint64_t token);
+struct Frame* Frame_newPong(uint64_t token);
+// `type` is SEGMENT_JOIN or SEGMENT_LEAVE
+struct Frame* Frame_newRoom(enum SegmentType type, char* room, size_t room_len);
+// Returns NULL if the text would take the segment past SEGMENT_MAX_LENGTH
+struct Frame* Frame_newRoomMessage(char* room, size_t room_len, char* sender, size_t sender_len, char* contents, size_t contents_len);
+struct Frame* Frame_newNick(char* nick, size_t nick_len);
+// Returns NULL if the text would take the segment past SEGMENT_MAX_LENGTH
+struct Frame* Frame_newDirect(char* nick, size_t nick_len, char* contents, size_t contents_len);
+// Packs as many of `frames` as fit, from the first, into one SEGMENT_BATCH,
+// and sets `packed` to how many that is. A frame too large to share a batch
+// is handed back on its own, with a new reference. The frames must not be
+// file backed.
+struct Frame* Frame_newBatch(struct Frame** frames, size_t num_frames, size_t* packed);
+// A SEGMENT_STATUS framed as the first protocol version did, with a 2 byte
+// length in place of each varint. Lets clients too old to send SEGMENT_HELLO
+// be told why they are being disconnected.
+struct Frame* Frame_newLegacyStatus(char* status, uint16_t status_len);
+// A frame of segments that are already encoded, copied from `data`
+struct Frame* Frame_copy(const void* data, size_t length);
+// The file must not be closed while the frame is referenced
+struct Frame* Frame_newFileRange(int fd, uint64_t offset, size_t length, unsigned int segments);
+struct Frame* Frame_ref(struct Frame* frame);
+void Frame_release(struct Frame* frame);
+
+// One outbound deflate stream, whose output can be sent to any number of
+// connections as long as each is sent all of it
+struct Compressor {
+	z_stream stream;
+	enum CompressionStream id;
+	// The next frame compressed starts the stream over
+	bool restart;
+	unsigned char* bfr;
+	// Running totals of the bytes compressed, and what they compressed to
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+};
+bool initCompressor(struct Compressor* compressor, enum CompressionStream id);
+// Has the stream start over with the next frame, so that new readers can
+// join it there
+void Compressor_restart(struct Compressor* compressor);
+// Compresses `frames`, in order, and pushes the frames to send in their place
+// onto `out`: SEGMENT_COMPRESSED frames each carrying as many as fit, and any
+// frame too large to compress as it is, with a new reference
+void Compressor_compress(struct Compressor* compressor, struct Frame** frames, size_t num_frames, struct DynamicArray* out);
+void cleanupCompressor(struct Compressor* compressor);
+
+// What to do when a connection's outbound queue would grow past its limit,
+// which happens when the peer reads slower than it is being sent data.
+enum SlowConsumerPolicy {
+	// Discard the oldest frames that have not started being written
+	SLOW_CONSUMER_DROP_OLDEST,
+	// Give up on the connection
+	SLOW_CONSUMER_DISCONNECT,
+	// Replace every unwritten frame with a single status noting how many
+	// were skipped
+	SLOW_CONSUMER_COALESCE,
+};
+
+// Frames waiting to be written to a connection, oldest first. `head_offset`
+// is how much of the oldest frame has already been written, and `bytes` is
+// the number of bytes still to be written across all queued frames. A `limit`
+// of 0 leaves the queue unbounded.
+struct OutboundQueue {
+	struct Frame** frames;
+	unsigned int head;
+	unsigned int count;
+	unsigned int capacity;
+	size_t head_offset;
+	size_t bytes;
+	// Frames at the head that a write still in flight points into, which
+	// must stay queued until it completes
+	unsigned int pinned;
+	size_t limit;
+	enum SlowConsumerPolicy policy;
+	size_t dropped_frames;
+};
+
+// Large enough to hold any segment SEGMENT_MAX_LENGTH allows,
+// with plenty of room left to batch several segments per `recv`
+#define RECEIVE_BUFFER_SIZE (128 * 1024)
+
+// Tracks the bytes received into a connection's `bfr` that have not been
+// parsed yet, which lie between `start` and `end`. A partial segment left at
+// the end of the buffer is moved back to the front before the next `recv`.
 struct SocketReader {
 	int socket;
-	void* dest;
 	bool closed;
-	ssize_t target_bytes;
-	ssize_t bytes_read;
+	size_t start;
+	size_t end;
 };
 
 
 struct Connection {
 	unsigned char segment_type;
-	void* segment;
+	union {
+		struct Segment_Message message;
+		struct Segment_Status status;
+		struct Segment_History history;
+		struct Segment_Resume resume;
+		struct Segment_Hello hello;
+		// Both SEGMENT_PING and SEGMENT_PONG
+		struct Segment_Ping ping;
+		// Both SEGMENT_JOIN and SEGMENT_LEAVE
+		struct Segment_Room room;
+		struct Segment_RoomMessage room_message;
+		struct Segment_Nick nick;
+		struct Segment_Direct direct;
+	} segment;
 	bool segment_ready;
 	int socket;
 	char* bfr;
 	struct SocketReader reader;
+	// Set once the peer breaks the protocol. Nothing more is parsed, and the
+	// reader is marked closed.
+	bool malformed;
+	// Segments of a SEGMENT_BATCH or SEGMENT_COMPRESSED not yet handed out,
+	// which lie between `batch_pos` and `batch_end`, in `bfr` or `inflated`
+	unsigned char* batch_pos;
+	unsigned char* batch_end;
+	// ProtocolFeature flags in use, as agreed in SEGMENT_HELLO
+	uint32_t features;
+	// Compresses what `sendSegment_*` send, once `enableCompression` is called
+	struct Compressor* compressor;
+	// The peer's compressed streams, started as they first arrive, and the
+	// last piece decompressed
+	z_stream* inflaters[COMPRESSION_STREAM_COUNT];
+	unsigned char* inflated;
+	struct OutboundQueue outbound;
+	// Running totals of the bytes moved over the socket
+	uint64_t bytes_received;
+	uint64_t bytes_sent;
 };
 struct Connection newConnection(int socket);
 void markHandled(struct Connection* connection);
+// Makes the next segment available, if there is one. Segments already
+// buffered are parsed first; the socket is only read once they run out, and
+// is then read until it would block or the buffer is full, so a single call
+// may pull in many segments.
 void updateConnection(struct Connection* connection);
+// For connections whose socket is read by someone else. `receiveBytes`
+// appends as many bytes read from the socket to the buffer as fit, returning
+// how many that was, and `nextSegment` makes the next segment available from
+// what is buffered, never reading the socket itself. A whole segment is only
+// guaranteed to fit once every segment already buffered has been handled.
+size_t receiveBytes(struct Connection* connection, const void* data, size_t length);
+void nextSegment(struct Connection* connection);
 void cleanupConnection(struct Connection* connection);
+// For carrying a connection on in another process. `saveInflater` copies the
+// window of the peer's compressed stream into `window`, which must hold
+// 1 << MAX_WBITS bytes, returning false if the stream has not started, and
+// `restoreInflater` starts the stream again from such a window.
+bool saveInflater(struct Connection* connection, enum CompressionStream id, unsigned char* window, unsigned int* length);
+bool restoreInflater(struct Connection* connection, enum CompressionStream id, const unsigned char* window, unsigned int length);
+
+void setOutboundLimit(struct Connection* connection, size_t limit, enum SlowConsumerPolicy policy);
+// Compresses segments sent with `sendSegment_*` from here on. FEATURE_DEFLATE
+// must have been agreed.
+bool enableCompression(struct Connection* connection);
+// Queues a reference to `frame` behind any output already pending. If that
+// takes the queue past its limit, the queue's slow consumer policy is applied.
+// Returns false if the policy is to disconnect. Connections using
+// FEATURE_DEFLATE are always disconnected, since the peer could not decompress
+// anything sent after frames that were dropped.
+bool queueFrame(struct Connection* connection, struct Frame* frame);
+// Writes as much pending output as the socket accepts without blocking.
+// Returns false if the connection has failed.
+bool flushConnection(struct Connection* connection);
+bool hasPendingOutput(struct Connection* connection);
+// For writing pending output with something other than `flushConnection`.
+// `startWrite` points `iovecs` at queued frames, up to the first file backed
+// one, and pins them in the queue; it returns 0 if the oldest frame is file
+// backed. `finishWrite` unpins them and removes however many bytes were
+// written. Nothing else may write to the connection in between.
+unsigned int startWrite(struct Connection* connection, struct iovec* iovecs, unsigned int max_iovecs);
+void finishWrite(struct Connection* connection, size_t bytes_sent);
+// Also for carrying a connection on in another process. `copyPendingOutput`
+// copies every queued frame, file backed ones included, into `out`, which must
+// hold `outbound.head_offset + outbound.bytes`; it returns false if a file
+// could not be read. `restorePendingOutput` queues what was copied as a
+// single frame, of which the first `written` bytes went out before, whatever
+// the queue's limit. Nothing may be queued on the connection before it.
+bool copyPendingOutput(struct Connection* connection, unsigned char* out);
+void restorePendingOutput(struct Connection* connection, const unsigned char* data, size_t length, size_t written);
 
-void sendSegment_Message(struct Connection* connection, char* sender, char* contents);
-void sendSegment_Status(struct Connection* connection, char* status);
+// Return false, sending nothing, if the text is too long for one segment
+bool sendSegment_Message(struct Connection* connection, char* sender, char* contents);
+bool sendSegment_Status(struct Connection* connection, char* status);
+bool sendSegment_Pong(struct Connection* connection, uint64_t token);
+bool sendSegment_Join(struct Connection* connection, char* room);
+bool sendSegment_Leave(struct Connection* connection, char* room);
+bool sendSegment_RoomMessage(struct Connection* connection, char* room, char* sender, char* contents);
+bool sendSegment_Nick(struct Connection* connection, char* nick);
+bool sendSegment_Direct(struct Connection* connection, char* nick, char* contents);
@@ -0,0 +1,26 @@
+#pragma once
+
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Allows `rate` tokens a second on average, in bursts of up to `burst`.
+// Taking more than is there leaves the bucket in debt, which is paid back
+// before anything more is allowed, so amounts only known after the fact can
+// still be charged. A `rate` of 0 allows everything.
+struct TokenBucket {
+	uint64_t rate;
+	double burst;
+	double tokens;
+	uint64_t refilled_ns;
+};
+
+// Starts the bucket full
+void initTokenBucket(struct TokenBucket* bucket, uint64_t rate, uint64_t burst, uint64_t now_ns);
+// Refills the bucket for the time passed, and returns whether it holds at
+// least `amount` tokens
+bool TokenBucket_has(struct TokenBucket* bucket, uint64_t amount, uint64_t now_ns);
+void TokenBucket_take(struct TokenBucket* bucket, uint64_t amount);
+// Returns how long until the bucket holds `amount` tokens, as of its last
+// refill
+uint64_t TokenBucket_waitNs(const struct TokenBucket* bucket, uint64_t amount);
@@ -0,0 +1,47 @@
+#pragma once
+
+
+#include <stddef.h>
+
+#include "dyn_arr.h"
+
+#include "hash_index.h"
+#include "networking.h"
+
+struct Room;
+
+// One member's place in one room. The member keeps its memberships as the
+// reverse of the room's index, so that leaving, or leaving everything on
+// disconnecting, never searches a room.
+struct Membership {
+	struct Room* room;
+	void* member;
+	// Position in `Room.members`
+	unsigned int index;
+};
+
+// A named room's members, packed so that fanning out to them touches nothing
+// else. Members are kept in no particular order.
+struct Room {
+	char name[ROOM_NAME_MAX];
+	size_t name_len;
+	// struct Membership*
+	struct DynamicArray members;
+};
+
+// Every room with at least one member, by name. A room is created by its
+// first member joining and freed once its last member leaves.
+struct Rooms {
+	struct HashIndex index;
+};
+
+void initRooms(struct Rooms* rooms);
+// Returns NULL if no room goes by the name
+struct Room* Rooms_find(struct Rooms* rooms, const char* name, size_t name_len);
+// The name must be 1 to ROOM_NAME_MAX bytes long. The member must not already
+// be in the room.
+struct Membership* Rooms_join(struct Rooms* rooms, const char* name, size_t name_len, void* member);
+// Frees the membership
+void Rooms_leave(struct Rooms* rooms, struct Membership* membership);
+// Every membership must have been left first
+void cleanupRooms(struct Rooms* rooms);
@@ -0,0 +1,45 @@
+#pragma once
+
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Returns the `n`th newest message, 0 being the newest, and stores its length
+// in `length`. Returns NULL once `n` goes past the oldest message.
+typedef const char* (*MessageSource)(void* context, size_t n, size_t* length);
+
+/* A model of the chat window. The top `height - 2` rows show messages, wrapped
+ * to the terminal width with the newest at the bottom, and the last row is
+ * left to the terminal for echoing input.
+ *
+ * Drawing only updates the model and marks the rows whose contents changed.
+ * `Screen_flush` then emits the escape sequences for just those rows into one
+ * buffer and writes it with a single `write`, so any number of draws between
+ * flushes cost one frame.
+ */
+struct Screen {
+	int fd;
+	unsigned int width;
+	unsigned int height;
+	// Bytes reserved for each row; enough for `width` UTF-8 encoded columns
+	size_t row_capacity;
+	char* rows;
+	size_t* row_lengths;
+	bool* damaged;
+	// The whole terminal must be cleared before the next frame
+	bool cleared;
+	// Byte offsets at which the message being laid out wraps
+	size_t* breaks;
+	size_t breaks_capacity;
+	char* frame;
+	size_t frame_length;
+	size_t frame_capacity;
+};
+
+struct Screen newScreen(int fd);
+// Rereads the terminal size. Everything is redrawn on the next flush.
+void Screen_resize(struct Screen* screen);
+unsigned int Screen_messageRows(const struct Screen* screen);
+void Screen_drawMessages(struct Screen* screen, MessageSource source, void* context);
+void Screen_flush(struct Screen* screen);
+void cleanupScreen(struct Screen* screen);
@@ -0,0 +1,47 @@
+#pragma once
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCROLLBACK_CHUNK_SIZE (64 * 1024)
+// The longest line that can be appended; longer lines are truncated
+#define SCROLLBACK_MAX_LINE (SCROLLBACK_CHUNK_SIZE / 16)
+
+/* Line history packed into a ring of fixed size chunks.
+ *
+ * Lines are copied end to end into the newest chunk, and a line that does not
+ * fit starts the next one. Chunk and line positions are kept as offsets into
+ * a byte stream that only ever grows, so finding a line is one lookup in the
+ * index ring and one in the chunk ring.
+ *
+ * Once either ring is full the oldest chunk is evicted along with every line
+ * in it, and its memory is reused for the new chunk. Appending never
+ * allocates once every chunk has been used.
+ */
+
+struct ScrollbackLine {
+	uint64_t offset;
+	uint32_t length;
+};
+
+struct Scrollback {
+	char** chunks;
+	size_t num_chunks;
+	// Stream offset of the oldest byte still held, always at a chunk start
+	uint64_t start;
+	// Stream offset the next line is written at
+	uint64_t end;
+	struct ScrollbackLine* lines;
+	size_t max_lines;
+	// Index of the oldest line since the scrollback was created
+	uint64_t first_line;
+	size_t num_lines;
+};
+
+struct Scrollback newScrollback(size_t max_lines);
+void Scrollback_append(struct Scrollback* scrollback, const char* line, size_t length);
+// Returns the `n`th newest line, 0 being the newest, or NULL when `n` is not
+// held. Stays valid until the next append.
+const char* Scrollback_get(struct Scrollback* scrollback, size_t n, size_t* length);
+void cleanupScrollback(struct Scrollback* scrollback);
@@ -1,6 +1,55 @@
 #pragma once
 
 
+#include <stddef.h>
 #include <stdint.h>
 
-int server(uint16_t port);
+#include "networking.h"
+
+// How workers wait on their connections
+enum ServerBackend {
+	BACKEND_EPOLL,
+	// Falls back to epoll where io_uring is unavailable. Needs Linux 6.0 or
+	// newer for multishot receives.
+	BACKEND_URING,
+};
+
+struct ServerConfig {
+	uint16_t port;
+	enum ServerBackend backend;
+	// Number of worker threads, each owning a shard of the connections.
+	// 0 selects one worker per online CPU.
+	unsigned int workers;
+	// Bytes of output a connection may have queued before `slow_consumer`
+	// is applied to it. 0 leaves the queues unbounded.
+	size_t queue_limit;
+	enum SlowConsumerPolicy slow_consumer;
+	// Longest time a broadcast may be held back to be written along with
+	// later ones. 0 writes each tick's broadcasts at the end of it.
+	unsigned int coalesce_us;
+	// Segments, and bytes, each connection may send a second, in bursts of up
+	// to a second's worth. 0 leaves them unlimited.
+	unsigned int rate_segments;
+	uint64_t rate_bytes;
+	// Longest a client may stay silent before it is sent a SEGMENT_PING, and
+	// then before it is disconnected for not answering. Clients without
+	// FEATURE_HEARTBEAT are left to TCP keepalive once greeted. 0 disables
+	// both, and the time limit on saying hello.
+	unsigned int heartbeat_ms;
+	// Recent messages each worker keeps to resend to reconnecting clients
+	unsigned int retransmit_window;
+	// Unix socket path that serves a metrics snapshot to each connection made
+	// to it, or NULL for none
+	const char* stats_path;
+	// Unix socket path through which the server hands its listening sockets
+	// and connections over to a newer server started with the same path. A
+	// server started while another is running with it takes over from that
+	// one. NULL for neither.
+	const char* handoff_path;
+	// Directory to journal messages to, or NULL to keep no journal
+	const char* journal_path;
+	// Longest time journaled messages may go without being synced to disk
+	unsigned int fsync_ms;
+};
+
+int server(const struct ServerConfig* config);
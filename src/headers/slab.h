@@ -0,0 +1,44 @@
+#pragma once
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Items per chunk of a slab's storage
+#define SLAB_CHUNK_ITEMS 64
+
+struct SlabSlot {
+	uint32_t generation;
+	// While the slot is in use, its position in `Slab.live`. Otherwise, the
+	// next free slot.
+	uint32_t link;
+};
+
+// A table of equally sized items, each named by an ID that stops matching it
+// once it is removed. Items are allocated a chunk at a time and never move,
+// so pointers to them stay valid until they are removed. An ID pairs a slot
+// with the slot's generation, which is bumped whenever the slot is freed, so
+// a stale ID is caught rather than naming whatever took over its slot. Items
+// in use are kept packed in `live` for iteration, which removal reorders as
+// `DynamicArray_remove` does. Inserting, removing and looking up an item all
+// take constant time.
+struct Slab {
+	size_t item_size;
+	unsigned char** chunks;
+	unsigned int num_chunks;
+	struct SlabSlot* slots;
+	uint32_t free_head;
+	uint32_t* live;
+	unsigned int num_live;
+};
+
+void initSlab(struct Slab* slab, size_t item_size);
+// Returns a zeroed item, and its ID through `id`. IDs are never 0.
+void* Slab_insert(struct Slab* slab, uint64_t* id);
+// Returns NULL if `id` names no item, such as one that has been removed
+void* Slab_get(const struct Slab* slab, uint64_t id);
+void Slab_remove(struct Slab* slab, uint64_t id);
+// Items in use are numbered from 0 up to `Slab_count`
+size_t Slab_count(const struct Slab* slab);
+void* Slab_at(const struct Slab* slab, size_t index);
+void cleanupSlab(struct Slab* slab);
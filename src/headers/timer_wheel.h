@@ -0,0 +1,58 @@
+#pragma once
+
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Timers are kept to ticks of 2^TIMER_TICK_SHIFT nanoseconds, about 65us,
+// and never fire early
+#define TIMER_TICK_SHIFT 16
+#define TIMER_LEVEL_BITS 6
+#define TIMER_LEVEL_SLOTS (1 << TIMER_LEVEL_BITS)
+// Together the levels cover 2^24 ticks, about 18 minutes. Timers set further
+// out than that wait in the last level, and are placed again as they near.
+#define TIMER_LEVELS 4
+
+// A timer to be embedded in whatever it belongs to. `kind` is left to the
+// owner, to tell its timers apart once they fire.
+struct Timer {
+	struct Timer* next;
+	struct Timer** prev_next;
+	uint64_t expires_tick;
+	unsigned int kind;
+	bool armed;
+};
+
+/* A hierarchical timer wheel. Each level is a ring of slots, a slot of one
+ * level spanning the whole ring of the level below it. A timer goes in the
+ * lowest level that reaches out to when it expires, and as time comes up to
+ * each slot of a higher level, the timers in it are placed again further
+ * down. Arming and cancelling a timer take constant time, and so does
+ * advancing past a tick in which nothing happens, whatever the number of
+ * timers armed; bitmaps of the occupied slots let `advance` and `nextNs`
+ * skip over empty stretches entirely.
+ */
+struct TimerWheel {
+	// The last tick advanced past
+	uint64_t now_tick;
+	struct Timer* slots[TIMER_LEVELS][TIMER_LEVEL_SLOTS];
+	uint64_t occupied[TIMER_LEVELS];
+	// Timers that have fired, waiting to be popped
+	struct Timer* expired;
+	struct Timer** expired_tail;
+};
+
+void initTimerWheel(struct TimerWheel* wheel, uint64_t now_ns);
+// Arms `timer` to fire once `expires_ns` has passed, first cancelling it if it
+// is already armed. Times already passed fire on the next advance.
+void TimerWheel_arm(struct TimerWheel* wheel, struct Timer* timer, uint64_t expires_ns);
+// Does nothing if the timer is not armed
+void TimerWheel_cancel(struct TimerWheel* wheel, struct Timer* timer);
+// Fires every timer due by `now_ns`, in the order they expire, to be popped
+void TimerWheel_advance(struct TimerWheel* wheel, uint64_t now_ns);
+// Returns the oldest timer fired and not yet popped, disarmed, or NULL
+struct Timer* TimerWheel_pop(struct TimerWheel* wheel);
+// Returns how long from `now_ns` the wheel next needs advancing, or -1 if no
+// timer is armed. That may be before the next timer is due, when timers
+// further out need placing again.
+int64_t TimerWheel_nextNs(const struct TimerWheel* wheel, uint64_t now_ns);
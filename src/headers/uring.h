@@ -0,0 +1,67 @@
+#pragma once
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/io_uring.h>
+
+// An io_uring instance driven through the raw system calls. Only one thread
+// may use a ring at a time.
+struct Uring {
+	int fd;
+	// Submission queue shared with the kernel. `sq_tail` is advanced locally
+	// as entries are filled in, and published on submit.
+	unsigned int* sq_head;
+	unsigned int* sq_tail_shared;
+	unsigned int sq_tail;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	struct io_uring_sqe* sqes;
+	// Completion queue shared with the kernel
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe* cqes;
+	// The mappings the above point into
+	void* sq_ring;
+	size_t sq_ring_size;
+	void* cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+// Rounds `entries` and `cq_entries` up to powers of two
+bool initUring(struct Uring* ring, unsigned int entries, unsigned int cq_entries);
+// Returns a zeroed submission queue entry. If the queue is full, everything in
+// it is submitted first.
+struct io_uring_sqe* Uring_getSqe(struct Uring* ring);
+// Submits every entry filled in so far, then waits until at least `wait_for`
+// completions are ready, or for at most `timeout_ns` unless it is negative.
+// Returns false on failure, other than being interrupted by a signal or timing
+// out.
+bool Uring_submit(struct Uring* ring, unsigned int wait_for, int64_t timeout_ns);
+// Copies out the oldest ready completion and frees its slot. Returns false if
+// there is none.
+bool Uring_pop(struct Uring* ring, struct io_uring_cqe* cqe);
+void cleanupUring(struct Uring* ring);
+
+// A group of equally sized buffers the kernel picks from for each read that
+// sets IOSQE_BUFFER_SELECT with its `group`. The buffer a read landed in is
+// named by the upper bits of its completion's flags, and must be recycled
+// once its contents have been used.
+struct BufferRing {
+	struct io_uring_buf_ring* ring;
+	unsigned char* data;
+	uint16_t group;
+	unsigned int count;
+	size_t size;
+	uint16_t tail;
+};
+// `count` must be a power of two
+bool initBufferRing(struct BufferRing* buffers, struct Uring* ring, uint16_t group, unsigned int count, size_t size);
+unsigned char* BufferRing_get(struct BufferRing* buffers, uint16_t id);
+void BufferRing_recycle(struct BufferRing* buffers, uint16_t id);
+// The ring the buffers were registered with must be cleaned up first
+void cleanupBufferRing(struct BufferRing* buffers);
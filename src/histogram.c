@@ -0,0 +1,74 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "histogram.h"
+
+#define HALF_SUB_BUCKETS (HISTOGRAM_SUB_BUCKETS / 2)
+
+#define load(value) atomic_load_explicit(&(value), memory_order_relaxed)
+#define store(value, new_value) atomic_store_explicit(&(value), new_value, memory_order_relaxed)
+
+static unsigned int bucketIndex(uint64_t value) {
+	if (value < HISTOGRAM_SUB_BUCKETS) return value;
+
+	unsigned int msb = 63 - __builtin_clzll(value);
+	unsigned int shift = msb - HISTOGRAM_SUB_BUCKET_BITS + 1;
+	return HISTOGRAM_SUB_BUCKETS
+		+ (msb - HISTOGRAM_SUB_BUCKET_BITS) * HALF_SUB_BUCKETS
+		+ ((value >> shift) - HALF_SUB_BUCKETS);
+}
+
+static uint64_t bucketUpperBound(unsigned int index) {
+	if (index < HISTOGRAM_SUB_BUCKETS) return index;
+
+	unsigned int power = (index - HISTOGRAM_SUB_BUCKETS) / HALF_SUB_BUCKETS;
+	unsigned int sub_bucket = (index - HISTOGRAM_SUB_BUCKETS) % HALF_SUB_BUCKETS;
+	unsigned int shift = power + 1;
+	uint64_t lower = (uint64_t)(HALF_SUB_BUCKETS + sub_bucket) << shift;
+	return lower + ((uint64_t)1 << shift) - 1;
+}
+
+void Histogram_record(struct Histogram* histogram, uint64_t value) {
+	unsigned int index = bucketIndex(value);
+	store(histogram->counts[index], load(histogram->counts[index]) + 1);
+	store(histogram->total, load(histogram->total) + 1);
+	if (value > load(histogram->max)) store(histogram->max, value);
+}
+
+void Histogram_merge(struct Histogram* into, const struct Histogram* from) {
+	// Totals are rebuilt from the buckets so they always agree with them
+	uint64_t total = 0;
+	for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		uint64_t count = load(from->counts[i]);
+		store(into->counts[i], load(into->counts[i]) + count);
+		total += count;
+	}
+	store(into->total, load(into->total) + total);
+	uint64_t max = load(from->max);
+	if (max > load(into->max)) store(into->max, max);
+}
+
+void Histogram_clear(struct Histogram* histogram) {
+	memset(histogram, 0, sizeof(struct Histogram));
+}
+
+uint64_t Histogram_percentile(const struct Histogram* histogram, double percentile) {
+	uint64_t total = load(histogram->total);
+	uint64_t max = load(histogram->max);
+	if (total == 0) return 0;
+
+	uint64_t target = (uint64_t)(total * (percentile / 100.0) + 0.5);
+	if (target == 0) target = 1;
+
+	uint64_t seen = 0;
+	for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += load(histogram->counts[i]);
+		if (seen >= target) {
+			uint64_t bound = bucketUpperBound(i);
+			return bound < max ? bound : max;
+		}
+	}
+
+	return max;
+}
@@ -0,0 +1,637 @@
+#define _GNU_SOURCE
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "dyn_arr.h"
+
+#include "logger.h"
+#include "metrics.h"
+#include "mpsc_queue.h"
+#include "networking.h"
+
+#include "journal.h"
+
+#define SEGMENT_NAME_LENGTH 32
+
+#define activeSegment(journal) (((struct JournalSegment**)(journal)->segments.data)[(journal)->segments.num_elements - 1])
+
+static uint64_t wallClockNs() {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void pushPending(struct Journal* journal, struct JournalEntry* entry) {
+	if (journal->num_pending == journal->pending_capacity) {
+		journal->pending_capacity = journal->pending_capacity == 0 ? 64 : journal->pending_capacity * 2;
+		journal->pending = realloc(journal->pending, journal->pending_capacity * sizeof(struct JournalEntry*));
+	}
+
+	struct JournalEntry** heap = journal->pending;
+	size_t i = journal->num_pending++;
+	while (i > 0 && heap[(i-1) / 2]->seq > entry->seq) {
+		heap[i] = heap[(i-1) / 2];
+		i = (i-1) / 2;
+	}
+	heap[i] = entry;
+}
+
+static struct JournalEntry* popPending(struct Journal* journal) {
+	struct JournalEntry** heap = journal->pending;
+	struct JournalEntry* top = heap[0];
+	struct JournalEntry* last = heap[--journal->num_pending];
+
+	size_t i = 0;
+	while (true) {
+		size_t child = i * 2 + 1;
+		if (child >= journal->num_pending) break;
+		if (child + 1 < journal->num_pending && heap[child + 1]->seq < heap[child]->seq) child++;
+		if (last->seq <= heap[child]->seq) break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	if (journal->num_pending > 0) heap[i] = last;
+
+	return top;
+}
+
+// Length of the frame starting at `data`, header included, or 0 if `size`
+// bytes do not hold a whole valid header
+static uint64_t frameLength(const unsigned char* data, size_t size) {
+	unsigned char type;
+	size_t length;
+	int header_length = decodeSegmentHeader(data, size, &type, &length);
+	return header_length > 0 ? header_length + length : 0;
+}
+
+// As frameLength, for the frame at `offset` in a segment file
+static uint64_t readFrameLength(int fd, uint64_t offset) {
+	unsigned char header[SEGMENT_MAX_HEADER];
+	ssize_t header_read = pread(fd, header, SEGMENT_MAX_HEADER, offset);
+	return header_read > 0 ? frameLength(header, header_read) : 0;
+}
+
+// Measures the whole frames at the start of `data`, stopping at a zero type
+// byte, at a frame cut short, or at one that does not match its checksum
+static uint64_t scanFrames(const unsigned char* data, uint64_t size, const uint32_t* sums, uint64_t num_sums, uint64_t* count) {
+	uint64_t offset = 0;
+	*count = 0;
+	while (offset < size && data[offset] != SEGMENT_NONE && *count < num_sums) {
+		uint64_t frame_length = frameLength(data + offset, size - offset);
+		if (frame_length == 0 || offset + frame_length > size) break;
+		if (crc32(0, data + offset, frame_length) != sums[*count]) break;
+		offset += frame_length;
+		(*count)++;
+	}
+	return offset;
+}
+
+static void freeSegment(struct JournalSegment* segment) {
+	if (segment->fd != -1) close(segment->fd);
+	if (segment->index_fd != -1) close(segment->index_fd);
+	if (segment->sum_fd != -1) close(segment->sum_fd);
+	DynamicArray_free(&segment->index);
+	free(segment);
+}
+
+static struct JournalSegment* openSegmentFiles(struct Journal* journal, uint64_t base_seq, int flags) {
+	struct JournalSegment* segment = calloc(1, sizeof(struct JournalSegment));
+	segment->base_seq = base_seq;
+	segment->index = DynamicArray_new(sizeof(struct JournalIndexEntry), 16);
+
+	char name[SEGMENT_NAME_LENGTH];
+	snprintf(name, sizeof(name), "%020lu.log", base_seq);
+	segment->fd = openat(journal->dir_fd, name, O_RDWR | O_CLOEXEC | flags, 0644);
+	snprintf(name, sizeof(name), "%020lu.idx", base_seq);
+	segment->index_fd = openat(journal->dir_fd, name, O_RDWR | O_APPEND | O_CLOEXEC | flags, 0644);
+	snprintf(name, sizeof(name), "%020lu.sum", base_seq);
+	segment->sum_fd = openat(journal->dir_fd, name, O_RDWR | O_APPEND | O_CLOEXEC | flags, 0644);
+
+	if (segment->fd == -1 || segment->index_fd == -1 || segment->sum_fd == -1) {
+		logMessage("Unable to open journal segment %lu: %s\n", base_seq, strerror(errno));
+		freeSegment(segment);
+		return NULL;
+	}
+	return segment;
+}
+
+static bool mapActiveSegment(struct Journal* journal, struct JournalSegment* segment) {
+	if (ftruncate(segment->fd, JOURNAL_SEGMENT_SIZE) != 0) {
+		logMessage("Unable to size journal segment %lu: %s\n", segment->base_seq, strerror(errno));
+		return false;
+	}
+
+	journal->map = mmap(NULL, JOURNAL_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0);
+	if (journal->map == MAP_FAILED) {
+		journal->map = NULL;
+		logMessage("Unable to map journal segment %lu: %s\n", segment->base_seq, strerror(errno));
+		return false;
+	}
+
+	journal->synced_length = segment->length;
+	return true;
+}
+
+static void syncJournal(struct Journal* journal) {
+	journal->last_sync_ns = Metrics_nowNs();
+	if (journal->map == NULL) return;
+
+	struct JournalSegment* segment = activeSegment(journal);
+	if (segment->length == journal->synced_length) return;
+
+	uint64_t page_size = sysconf(_SC_PAGESIZE);
+	uint64_t start = journal->synced_length - journal->synced_length % page_size;
+	msync(journal->map + start, segment->length - start, MS_SYNC);
+	fdatasync(segment->index_fd);
+	fdatasync(segment->sum_fd);
+	journal->synced_length = segment->length;
+}
+
+// Appends the checksums of the frames written since last time to the active
+// segment's `.sum` file
+static void writeSums(struct Journal* journal) {
+	if (journal->sums.num_elements == 0) return;
+	write(activeSegment(journal)->sum_fd, journal->sums.data, journal->sums.num_elements * sizeof(uint32_t));
+	DynamicArray_clear(&journal->sums);
+}
+
+// Syncs and unmaps the active segment, trimming the file to its frames
+static void sealSegment(struct Journal* journal) {
+	if (journal->map == NULL) return;
+
+	writeSums(journal);
+	syncJournal(journal);
+	struct JournalSegment* segment = activeSegment(journal);
+	munmap(journal->map, JOURNAL_SEGMENT_SIZE);
+	journal->map = NULL;
+	ftruncate(segment->fd, segment->length);
+	fsync(segment->fd);
+}
+
+// Readers only wait on `lock` for the new segment to be added, not for its
+// files to be set up
+static bool startSegment(struct Journal* journal, uint64_t base_seq) {
+	struct JournalSegment* segment = openSegmentFiles(journal, base_seq, O_CREAT | O_TRUNC);
+	if (segment == NULL) return false;
+
+	if (!mapActiveSegment(journal, segment)) {
+		freeSegment(segment);
+		return false;
+	}
+	// Makes the new files themselves durable
+	fsync(journal->dir_fd);
+
+	mtx_lock(&journal->lock);
+	DynamicArray_push(&journal->segments, &segment);
+	mtx_unlock(&journal->lock);
+	return true;
+}
+
+static void writeEntry(struct Journal* journal, struct JournalEntry* entry) {
+	struct Frame* frame = entry->frame;
+	struct JournalSegment* segment = journal->segments.num_elements > 0 ? activeSegment(journal) : NULL;
+
+	if (journal->map == NULL || segment->length + frame->length > JOURNAL_SEGMENT_SIZE) {
+		sealSegment(journal);
+		if (!startSegment(journal, entry->seq)) {
+			logMessage("Journal frame %lu lost\n", entry->seq);
+			return;
+		}
+		segment = activeSegment(journal);
+	}
+
+	struct JournalIndexEntry* index = segment->index.data;
+	size_t num_entries = segment->index.num_elements;
+	bool indexed = num_entries == 0 || segment->length / JOURNAL_INDEX_INTERVAL > index[num_entries-1].offset / JOURNAL_INDEX_INTERVAL;
+	struct JournalIndexEntry index_entry = { entry->seq, entry->timestamp, segment->length };
+	if (indexed) write(segment->index_fd, &index_entry, sizeof(index_entry));
+	// Readers stop at `length`, so the frame is copied in before taking `lock`
+	memcpy(journal->map + segment->length, frame->data, frame->length);
+	uint32_t sum = crc32(0, frame->data, frame->length);
+	DynamicArray_push(&journal->sums, &sum);
+
+	mtx_lock(&journal->lock);
+	if (indexed) DynamicArray_push(&segment->index, &index_entry);
+	segment->length += frame->length;
+	segment->count++;
+	mtx_unlock(&journal->lock);
+}
+
+// Writes every queued frame that continues the sequence. Frames that arrive
+// ahead of one still being appended by another thread wait in `pending`.
+static void writeQueued(struct Journal* journal, bool flush_all) {
+	struct MPSCNode* node;
+	while ((node = MPSCQueue_pop(&journal->queue)) != NULL)
+		pushPending(journal, (struct JournalEntry*)node);
+
+	while (journal->num_pending > 0 && (flush_all || journal->pending[0]->seq == journal->write_seq)) {
+		struct JournalEntry* entry = popPending(journal);
+		writeEntry(journal, entry);
+		journal->write_seq = entry->seq + 1;
+		Frame_release(entry->frame);
+		free(entry);
+	}
+	if (journal->map != NULL) writeSums(journal);
+}
+
+static int journalLoop(struct Journal* journal) {
+	while (true) {
+		int timeout = -1;
+		if (journal->map != NULL && activeSegment(journal)->length != journal->synced_length) {
+			uint64_t elapsed_ms = (Metrics_nowNs() - journal->last_sync_ns) / 1000000;
+			timeout = elapsed_ms < journal->fsync_ms ? journal->fsync_ms - elapsed_ms : 0;
+		}
+
+		struct pollfd wake = { journal->wake_fd, POLLIN, 0 };
+		poll(&wake, 1, timeout);
+		if (wake.revents & POLLIN) {
+			uint64_t value;
+			read(journal->wake_fd, &value, sizeof(value));
+			atomic_store_explicit(&journal->wake_pending, false, memory_order_release);
+		}
+
+		bool running = atomic_load(&journal->running);
+		writeQueued(journal, !running);
+		if (!running) break;
+
+		if ((Metrics_nowNs() - journal->last_sync_ns) / 1000000 >= journal->fsync_ms)
+			syncJournal(journal);
+	}
+
+	syncJournal(journal);
+	return 0;
+}
+
+static int compareSeqs(const void* a, const void* b) {
+	uint64_t seq_a = *(const uint64_t*)a;
+	uint64_t seq_b = *(const uint64_t*)b;
+	return (seq_a > seq_b) - (seq_a < seq_b);
+}
+
+static bool loadIndex(struct JournalSegment* segment) {
+	struct stat index_stat;
+	if (fstat(segment->index_fd, &index_stat) != 0) return false;
+
+	size_t num_entries = index_stat.st_size / sizeof(struct JournalIndexEntry);
+	for (size_t i = 0; i < num_entries; i++) {
+		struct JournalIndexEntry entry;
+		if (pread(segment->index_fd, &entry, sizeof(entry), i * sizeof(entry)) != sizeof(entry)) return false;
+		// Entries for frames lost in a crash are dropped
+		if (entry.offset >= segment->length) break;
+		DynamicArray_push(&segment->index, &entry);
+	}
+
+	if (segment->index.num_elements != num_entries)
+		ftruncate(segment->index_fd, segment->index.num_elements * sizeof(struct JournalIndexEntry));
+	return true;
+}
+
+// Opens an existing segment and measures its frames. Any segment but the last
+// is only scanned if it was never trimmed, as happens after a crash.
+static struct JournalSegment* recoverSegment(struct Journal* journal, uint64_t base_seq, bool last) {
+	struct JournalSegment* segment = openSegmentFiles(journal, base_seq, 0);
+	if (segment == NULL) return NULL;
+
+	struct stat segment_stat;
+	if (fstat(segment->fd, &segment_stat) != 0) {
+		freeSegment(segment);
+		return NULL;
+	}
+	uint64_t size = segment_stat.st_size;
+	bool trimmed = size < JOURNAL_SEGMENT_SIZE;
+
+	segment->length = size;
+	if (last || !trimmed) {
+		unsigned char* data = size > 0 ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0) : NULL;
+		if (data == MAP_FAILED) {
+			logMessage("Unable to map journal segment %lu: %s\n", base_seq, strerror(errno));
+			freeSegment(segment);
+			return NULL;
+		}
+
+		struct stat sum_stat;
+		uint64_t num_sums = fstat(segment->sum_fd, &sum_stat) == 0 ? sum_stat.st_size / sizeof(uint32_t) : 0;
+		uint32_t* sums = malloc(num_sums * sizeof(uint32_t) + 1);
+		if (pread(segment->sum_fd, sums, num_sums * sizeof(uint32_t), 0) != (ssize_t)(num_sums * sizeof(uint32_t))) num_sums = 0;
+
+		segment->length = data != NULL ? scanFrames(data, size, sums, num_sums, &segment->count) : 0;
+		free(sums);
+		if (segment->count < num_sums) ftruncate(segment->sum_fd, segment->count * sizeof(uint32_t));
+
+		if (segment->length < size && data[segment->length] != SEGMENT_NONE)
+			logMessage("Journal segment %lu ended in a partial or damaged frame, discarded\n", base_seq);
+		// Clears whatever a crash left past the last good frame of the active
+		// segment, so none of it is taken for frames once writing carries on
+		uint64_t dirty = segment->length;
+		while (last && dirty < size && data[dirty] == 0) dirty++;
+		if (last && dirty < size) memset(data + dirty, 0, size - dirty);
+		if (data != NULL) munmap(data, size);
+		if (!last) ftruncate(segment->fd, segment->length);
+	}
+
+	if (!loadIndex(segment)) {
+		logMessage("Unable to read journal index %lu\n", base_seq);
+		freeSegment(segment);
+		return NULL;
+	}
+
+	// A trimmed segment is counted from its last index entry instead
+	if (!last && trimmed) {
+		struct JournalIndexEntry* index = segment->index.data;
+		size_t num_entries = segment->index.num_elements;
+		uint64_t offset = num_entries > 0 ? index[num_entries-1].offset : 0;
+		segment->count = num_entries > 0 ? index[num_entries-1].seq - base_seq : 0;
+
+		while (offset < segment->length) {
+			uint64_t frame_length = readFrameLength(segment->fd, offset);
+			if (frame_length == 0) break;
+			offset += frame_length;
+			segment->count++;
+		}
+	}
+	return segment;
+}
+
+static bool recoverJournal(struct Journal* journal) {
+	int list_fd = dup(journal->dir_fd);
+	DIR* dir = fdopendir(list_fd);
+	if (dir == NULL) {
+		close(list_fd);
+		return false;
+	}
+
+	struct DynamicArray seqs = DynamicArray_new(sizeof(uint64_t), 16);
+	struct dirent* dirent;
+	while ((dirent = readdir(dir)) != NULL) {
+		uint64_t seq;
+		char extra;
+		if (strlen(dirent->d_name) == 24 && sscanf(dirent->d_name, "%20lu.lo%c", &seq, &extra) == 2 && extra == 'g')
+			DynamicArray_push(&seqs, &seq);
+	}
+	closedir(dir);
+	qsort(seqs.data, seqs.num_elements, sizeof(uint64_t), compareSeqs);
+
+	bool recovered = true;
+	uint64_t* base_seqs = seqs.data;
+	for (size_t i = 0; i < seqs.num_elements; i++) {
+		bool last = i == seqs.num_elements - 1;
+		struct JournalSegment* segment = recoverSegment(journal, base_seqs[i], last);
+		if (segment == NULL) {
+			recovered = false;
+			break;
+		}
+		DynamicArray_push(&journal->segments, &segment);
+		journal->write_seq = segment->base_seq + segment->count;
+
+		// Writing carries on in the last segment unless it is full
+		if (last && segment->length + 1 < JOURNAL_SEGMENT_SIZE && !mapActiveSegment(journal, segment)) {
+			recovered = false;
+			break;
+		}
+	}
+
+	DynamicArray_free(&seqs);
+	if (recovered && journal->segments.num_elements > 0)
+		logMessage("Recovered %u journal segments, resuming at frame %lu\n", journal->segments.num_elements, journal->write_seq);
+	return recovered;
+}
+
+static void freeSegments(struct Journal* journal) {
+	struct JournalSegment** segments = journal->segments.data;
+	for (size_t i = 0; i < journal->segments.num_elements; i++)
+		freeSegment(segments[i]);
+	DynamicArray_free(&journal->segments);
+}
+
+bool Journal_start(struct Journal* journal, const char* path, unsigned int fsync_ms, uint64_t start_seq) {
+	memset(journal, 0, sizeof(struct Journal));
+	journal->dir_fd = -1;
+	journal->fsync_ms = fsync_ms;
+	journal->segments = DynamicArray_new(sizeof(struct JournalSegment*), 16);
+	journal->sums = DynamicArray_new(sizeof(uint32_t), 256);
+	MPSCQueue_init(&journal->queue);
+	mtx_init(&journal->lock, mtx_plain);
+
+	if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+		logMessage("Unable to create journal directory: %s\n", strerror(errno));
+		goto fail;
+	}
+	journal->dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (journal->dir_fd == -1) {
+		logMessage("Unable to open journal directory: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	journal->write_seq = 1;
+	if (!recoverJournal(journal)) goto fail;
+	// Frames before `start_seq` were never written here, so the first one to
+	// be starts a segment of its own
+	if (start_seq > journal->write_seq) {
+		sealSegment(journal);
+		journal->write_seq = start_seq;
+	}
+	journal->first_seq = journal->write_seq;
+	journal->last_sync_ns = Metrics_nowNs();
+
+	journal->wake_fd = eventfd(0, EFD_NONBLOCK);
+	if (journal->wake_fd == -1) goto fail;
+	atomic_init(&journal->wake_pending, false);
+	atomic_init(&journal->running, true);
+	if (thrd_create(&journal->thread, (thrd_start_t)journalLoop, journal) != thrd_success) {
+		close(journal->wake_fd);
+		goto fail;
+	}
+
+	return true;
+
+fail:
+	if (journal->map != NULL) munmap(journal->map, JOURNAL_SEGMENT_SIZE);
+	freeSegments(journal);
+	DynamicArray_free(&journal->sums);
+	if (journal->dir_fd != -1) close(journal->dir_fd);
+	mtx_destroy(&journal->lock);
+	return false;
+}
+
+void Journal_stop(struct Journal* journal) {
+	atomic_store(&journal->running, false);
+	uint64_t value = 1;
+	write(journal->wake_fd, &value, sizeof(value));
+	thrd_join(journal->thread, NULL);
+
+	if (journal->map != NULL) munmap(journal->map, JOURNAL_SEGMENT_SIZE);
+	freeSegments(journal);
+	DynamicArray_free(&journal->sums);
+	free(journal->pending);
+	close(journal->wake_fd);
+	close(journal->dir_fd);
+	mtx_destroy(&journal->lock);
+}
+
+void Journal_append(struct Journal* journal, struct Frame* frame, uint64_t seq) {
+	struct JournalEntry* entry = malloc(sizeof(struct JournalEntry));
+	entry->seq = seq;
+	entry->timestamp = wallClockNs();
+	entry->frame = Frame_ref(frame);
+
+	MPSCQueue_push(&journal->queue, &entry->node);
+	if (!atomic_exchange_explicit(&journal->wake_pending, true, memory_order_acq_rel)) {
+		uint64_t value = 1;
+		write(journal->wake_fd, &value, sizeof(value));
+	}
+}
+
+// The last of the `count` index entries with a seq at or before `seq`, or
+// `count` if there is none
+static size_t lastEntryBySeq(const struct JournalIndexEntry* index, size_t count, uint64_t seq) {
+	size_t low = 0, high = count;
+	while (low < high) {
+		size_t middle = (low + high) / 2;
+		if (index[middle].seq <= seq) low = middle + 1;
+		else high = middle;
+	}
+	return low > 0 ? low - 1 : count;
+}
+
+static size_t lastEntryByOffset(const struct JournalIndexEntry* index, size_t count, uint64_t offset) {
+	size_t low = 0, high = count;
+	while (low < high) {
+		size_t middle = (low + high) / 2;
+		if (index[middle].offset <= offset) low = middle + 1;
+		else high = middle;
+	}
+	return low > 0 ? low - 1 : count;
+}
+
+// The segment holding `seq`. If `seq` is older than the journal or was lost
+// to a failed segment, it is moved forward to the next frame there is.
+static struct JournalSegment* segmentFor(struct Journal* journal, uint64_t* seq) {
+	struct JournalSegment** segments = journal->segments.data;
+	size_t num_segments = journal->segments.num_elements;
+	if (num_segments == 0) return NULL;
+
+	size_t low = 0, high = num_segments;
+	while (high - low > 1) {
+		size_t middle = (low + high) / 2;
+		if (segments[middle]->base_seq <= *seq) low = middle;
+		else high = middle;
+	}
+
+	struct JournalSegment* segment = segments[low];
+	if (*seq < segment->base_seq) *seq = segment->base_seq;
+	if (*seq >= segment->base_seq + segment->count) {
+		if (low + 1 == num_segments) return NULL;
+		segment = segments[low + 1];
+		*seq = segment->base_seq;
+	}
+	return segment;
+}
+
+// The offset of frame `seq` within `segment`, walked to from the index entry
+// before it. Returns UINT64_MAX if the segment cannot be read.
+static uint64_t locateFrame(struct JournalSegment* segment, uint64_t seq) {
+	if (seq == segment->base_seq + segment->count) return segment->length;
+
+	struct JournalIndexEntry* index = segment->index.data;
+	size_t entry = lastEntryBySeq(index, segment->index.num_elements, seq);
+	uint64_t current_seq = entry < segment->index.num_elements ? index[entry].seq : segment->base_seq;
+	uint64_t offset = entry < segment->index.num_elements ? index[entry].offset : 0;
+
+	while (current_seq < seq) {
+		uint64_t frame_length = readFrameLength(segment->fd, offset);
+		if (frame_length == 0) return UINT64_MAX;
+		offset += frame_length;
+		current_seq++;
+	}
+	return offset;
+}
+
+bool Journal_read(struct Journal* journal, uint64_t seq, uint64_t end_seq, uint64_t max_bytes, struct JournalRange* range) {
+	mtx_lock(&journal->lock);
+	struct JournalSegment* segment = segmentFor(journal, &seq);
+	if (segment == NULL || seq >= end_seq) goto none;
+
+	uint64_t start = locateFrame(segment, seq);
+	if (start == UINT64_MAX) goto none;
+
+	uint64_t segment_end_seq = segment->base_seq + segment->count;
+	uint64_t target = end_seq < segment_end_seq ? end_seq : segment_end_seq;
+
+	// Past the byte budget, the range is cut at an index entry so that no
+	// frames need walking to find where it ends
+	struct JournalIndexEntry* index = segment->index.data;
+	size_t num_entries = segment->index.num_elements;
+	size_t target_entry = lastEntryBySeq(index, num_entries, target);
+	uint64_t end_offset;
+	if (target_entry < num_entries && index[target_entry].seq > seq && index[target_entry].offset > start + max_bytes) {
+		size_t entry = lastEntryByOffset(index, num_entries, start + max_bytes);
+		// A single interval larger than the budget is sent whole
+		if (index[entry].seq <= seq) entry++;
+		target = index[entry].seq;
+		end_offset = index[entry].offset;
+	} else {
+		end_offset = locateFrame(segment, target);
+		if (end_offset == UINT64_MAX) goto none;
+	}
+
+	range->seq = seq;
+	range->count = target - seq;
+	range->fd = segment->fd;
+	range->offset = start;
+	range->length = end_offset - start;
+	mtx_unlock(&journal->lock);
+	return true;
+
+none:
+	mtx_unlock(&journal->lock);
+	return false;
+}
+
+uint64_t Journal_findTime(struct Journal* journal, uint64_t timestamp) {
+	mtx_lock(&journal->lock);
+	struct JournalSegment** segments = journal->segments.data;
+	size_t num_segments = journal->segments.num_elements;
+
+	// The last segment whose first frame is no newer than `timestamp`
+	size_t low = 0, high = num_segments;
+	while (low < high) {
+		size_t middle = (low + high) / 2;
+		struct JournalIndexEntry* first = segments[middle]->index.data;
+		if (segments[middle]->index.num_elements > 0 && first->timestamp <= timestamp) low = middle + 1;
+		else high = middle;
+	}
+
+	uint64_t seq = num_segments > 0 ? segments[0]->base_seq : journal->write_seq;
+	if (low > 0) {
+		struct JournalSegment* segment = segments[low - 1];
+		struct JournalIndexEntry* index = segment->index.data;
+		size_t entry_low = 0, entry_high = segment->index.num_elements;
+		while (entry_low < entry_high) {
+			size_t middle = (entry_low + entry_high) / 2;
+			if (index[middle].timestamp <= timestamp) entry_low = middle + 1;
+			else entry_high = middle;
+		}
+		seq = index[entry_low - 1].seq;
+	}
+
+	mtx_unlock(&journal->lock);
+	return seq;
+}
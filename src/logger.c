@@ -0,0 +1,160 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "mpsc_queue.h"
+
+#include "logger.h"
+
+#define LOG_LINE_LENGTH 512
+
+struct LogLine {
+	struct MPSCNode node;
+	size_t length;
+	char text[];
+};
+
+struct Logger {
+	atomic_bool running;
+	atomic_bool wake_pending;
+	int wake_fd;
+	thrd_t thread;
+	struct MPSCQueue queue;
+};
+
+// Token bucket for the calling thread, refilled lazily on each call
+struct LogBudget {
+	double tokens;
+	uint64_t last_refill_ns;
+	unsigned long suppressed;
+};
+
+static struct Logger logger = {0};
+static _Thread_local struct LogBudget budget = { LOG_BURST, 0, 0 };
+
+static void writeAll(const char* text, size_t length) {
+	while (length > 0) {
+		ssize_t written = write(STDOUT_FILENO, text, length);
+		if (written <= 0) return;
+		text += written;
+		length -= written;
+	}
+}
+
+static void drainLines() {
+	struct MPSCNode* node;
+	while ((node = MPSCQueue_pop(&logger.queue)) != NULL) {
+		struct LogLine* line = (struct LogLine*)node;
+		writeAll(line->text, line->length);
+		free(line);
+	}
+}
+
+// Returns false if the logger thread could not be woken
+static bool wakeLogger() {
+	uint64_t value = 1;
+	ssize_t written;
+	do written = write(logger.wake_fd, &value, sizeof(value));
+	while (written == -1 && errno == EINTR);
+	return written == sizeof(value);
+}
+
+static int loggerLoop(void* unused) {
+	(void)unused;
+	while (true) {
+		uint64_t value;
+		ssize_t bytes_read = read(logger.wake_fd, &value, sizeof(value));
+		if (bytes_read == -1 && errno == EINTR) continue;
+		// Whatever is logged from here on waits for Logger_stop
+		if (bytes_read != sizeof(value)) break;
+		atomic_store_explicit(&logger.wake_pending, false, memory_order_release);
+		drainLines();
+
+		if (!atomic_load(&logger.running)) break;
+	}
+
+	drainLines();
+	return 0;
+}
+
+bool Logger_start() {
+	logger.wake_fd = eventfd(0, 0);
+	if (logger.wake_fd == -1) return false;
+
+	MPSCQueue_init(&logger.queue);
+	atomic_store(&logger.wake_pending, false);
+	atomic_store(&logger.running, true);
+	if (thrd_create(&logger.thread, loggerLoop, NULL) != thrd_success) {
+		atomic_store(&logger.running, false);
+		close(logger.wake_fd);
+		return false;
+	}
+
+	return true;
+}
+
+void Logger_stop() {
+	if (!atomic_exchange(&logger.running, false)) return;
+
+	// A thread that cannot be woken is left to end with the process
+	if (!wakeLogger()) return;
+	thrd_join(logger.thread, NULL);
+	close(logger.wake_fd);
+	drainLines();
+}
+
+static bool takeToken() {
+	uint64_t now_ns = Metrics_nowNs();
+	if (budget.last_refill_ns != 0) {
+		budget.tokens += (now_ns - budget.last_refill_ns) * (LOG_RATE / 1e9);
+		if (budget.tokens > LOG_BURST) budget.tokens = LOG_BURST;
+	}
+	budget.last_refill_ns = now_ns;
+
+	if (budget.tokens < 1) {
+		budget.suppressed++;
+		return false;
+	}
+
+	budget.tokens--;
+	return true;
+}
+
+void logMessage(const char* format, ...) {
+	if (!takeToken()) return;
+
+	struct LogLine* line = malloc(sizeof(struct LogLine) + LOG_LINE_LENGTH);
+	size_t length = 0;
+	if (budget.suppressed > 0) {
+		length = snprintf(line->text, LOG_LINE_LENGTH, "(%lu lines suppressed) ", budget.suppressed);
+		budget.suppressed = 0;
+	}
+
+	va_list args;
+	va_start(args, format);
+	length += vsnprintf(line->text + length, LOG_LINE_LENGTH - length, format, args);
+	va_end(args);
+	if (length >= LOG_LINE_LENGTH) length = LOG_LINE_LENGTH - 1;
+	line->length = length;
+
+	if (!atomic_load_explicit(&logger.running, memory_order_acquire)) {
+		writeAll(line->text, line->length);
+		free(line);
+		return;
+	}
+
+	MPSCQueue_push(&logger.queue, &line->node);
+	// The next line tries again if the thread could not be woken
+	if (!atomic_exchange_explicit(&logger.wake_pending, true, memory_order_acq_rel) && !wakeLogger())
+		atomic_store_explicit(&logger.wake_pending, false, memory_order_release);
+}
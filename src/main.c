@@ -24,35 +24,121 @@ int main(int argc, char* argv[]) {
 	if (argc < 2) goto invalid;
 
 	if (strcmp(argv[1], "connect") == 0) {
-		if (argc != 4) goto invalid;
+		if (argc < 4) goto invalid;
 
 		char extra;
 
-		uint32_t ip;
-		if (parseIPv4(argv[2], &ip) != 0) goto invalid;
-		uint16_t port;
-		if (sscanf(argv[3], "%hu%c", &port, &extra) != 1) goto invalid;
+		struct ClientConfig config = {0};
+		config.scrollback = 100000;
+		config.history = 50;
+		if (parseIPv4(argv[2], &config.ip) != 0) goto invalid;
+		if (sscanf(argv[3], "%hu%c", &config.port, &extra) != 1) goto invalid;
 
-		return client(ip, port);
+		for (int i = 4; i < argc; i += 2) {
+			if (i+1 >= argc) goto invalid;
+			char* option = argv[i];
+			char* value = argv[i+1];
+
+			if (strcmp(option, "--scrollback") == 0) {
+				if (sscanf(value, "%zu%c", &config.scrollback, &extra) != 1 || config.scrollback == 0) goto invalid;
+			} else if (strcmp(option, "--history") == 0) {
+				if (sscanf(value, "%u%c", &config.history, &extra) != 1) goto invalid;
+			} else if (strcmp(option, "--compression") == 0) {
+				if (strcmp(value, "on") == 0) config.compression = true;
+				else if (strcmp(value, "off") == 0) config.compression = false;
+				else goto invalid;
+			} else if (strcmp(option, "--nick") == 0) {
+				config.nick = value;
+			} else {
+				goto invalid;
+			}
+		}
+
+		return client(&config);
 	}
 
 	if (strcmp(argv[1], "host") == 0) {
-		if (argc != 3) goto invalid;
+		if (argc < 3) goto invalid;
 
 		char extra;
 
-		uint16_t port;
-		if (sscanf(argv[2], "%hu%c", &port, &extra) != 1) goto invalid;
+		struct ServerConfig config = {0};
+		config.queue_limit = 1 << 20;
+		config.slow_consumer = SLOW_CONSUMER_COALESCE;
+		config.fsync_ms = 50;
+		config.retransmit_window = 4096;
+		config.heartbeat_ms = 30000;
+		if (sscanf(argv[2], "%hu%c", &config.port, &extra) != 1) goto invalid;
+
+		for (int i = 3; i < argc; i += 2) {
+			if (i+1 >= argc) goto invalid;
+			char* option = argv[i];
+			char* value = argv[i+1];
+
+			if (strcmp(option, "--workers") == 0) {
+				if (sscanf(value, "%u%c", &config.workers, &extra) != 1) goto invalid;
+			} else if (strcmp(option, "--queue-limit") == 0) {
+				if (sscanf(value, "%zu%c", &config.queue_limit, &extra) != 1) goto invalid;
+			} else if (strcmp(option, "--coalesce-us") == 0) {
+				if (sscanf(value, "%u%c", &config.coalesce_us, &extra) != 1) goto invalid;
+			} else if (strcmp(option, "--rate-segments") == 0) {
+				if (sscanf(value, "%u%c", &config.rate_segments, &extra) != 1) goto invalid;
+			} else if (strcmp(option, "--rate-bytes") == 0) {
+				if (sscanf(value, "%lu%c", &config.rate_bytes, &extra) != 1) goto invalid;
+			} else if (strcmp(option, "--heartbeat-ms") == 0) {
+				if (sscanf(value, "%u%c", &config.heartbeat_ms, &extra) != 1) goto invalid;
+			} else if (strcmp(option, "--stats") == 0) {
+				config.stats_path = value;
+			} else if (strcmp(option, "--handoff") == 0) {
+				config.handoff_path = value;
+			} else if (strcmp(option, "--retransmit-window") == 0) {
+				if (sscanf(value, "%u%c", &config.retransmit_window, &extra) != 1) goto invalid;
+			} else if (strcmp(option, "--journal") == 0) {
+				config.journal_path = value;
+			} else if (strcmp(option, "--fsync-ms") == 0) {
+				if (sscanf(value, "%u%c", &config.fsync_ms, &extra) != 1) goto invalid;
+			} else if (strcmp(option, "--slow-consumer") == 0) {
+				if (strcmp(value, "drop") == 0) config.slow_consumer = SLOW_CONSUMER_DROP_OLDEST;
+				else if (strcmp(value, "disconnect") == 0) config.slow_consumer = SLOW_CONSUMER_DISCONNECT;
+				else if (strcmp(value, "coalesce") == 0) config.slow_consumer = SLOW_CONSUMER_COALESCE;
+				else goto invalid;
+			} else if (strcmp(option, "--backend") == 0) {
+				if (strcmp(value, "epoll") == 0) config.backend = BACKEND_EPOLL;
+				else if (strcmp(value, "io_uring") == 0) config.backend = BACKEND_URING;
+				else goto invalid;
+			} else {
+				goto invalid;
+			}
+		}
 
-		return server(port);
+		return server(&config);
 	}
 
 invalid:
 	printf("Invalid usage. Correct usages as follows:\n");
-	printf("\t%s connect IP PORT\n", argv[0]);
-	printf("\t%s host PORT\n", argv[0]);
+	printf("\t%s connect IP PORT [OPTIONS]\n", argv[0]);
+	printf("\t%s host PORT [OPTIONS]\n", argv[0]);
 	printf("Where:\n");
 	printf("\tIP is an IPv4 address formatted as X.X.X.X, where each X is a value in the range 0-255\n");
 	printf("\tPORT is a number in the range of 0-65535 to host on or connect to\n");
+	printf("Connect OPTIONS:\n");
+	printf("\t--scrollback LINES\tlines of history kept for scrolling back with /pgup, /pgdn and /bottom (default 100000)\n");
+	printf("\t--history N\tmessages from before joining to replay, 0 for none (default 50)\n");
+	printf("\t--compression on|off\tcompress traffic to and from the server (default off)\n");
+	printf("\t--nick NAME\tnickname to send messages under, which can be changed with /nick (default none)\n");
+	printf("Host OPTIONS:\n");
+	printf("\t--workers N\tnumber of worker threads, 0 for one per CPU (default 0)\n");
+	printf("\t--backend BACKEND\tone of epoll or io_uring (default epoll)\n");
+	printf("\t--queue-limit BYTES\toutput a client may have queued before it is treated as slow, 0 for no limit (default 1048576)\n");
+	printf("\t--slow-consumer POLICY\tone of drop, disconnect or coalesce (default coalesce)\n");
+	printf("\t--coalesce-us N\tlongest time a broadcast may wait to be written with later ones (default 0)\n");
+	printf("\t--rate-segments N\tsegments a client may send a second, 0 for no limit (default 0)\n");
+	printf("\t--rate-bytes N\tbytes a client may send a second, 0 for no limit (default 0)\n");
+	printf("\t--heartbeat-ms N\tsilence after which a client is pinged, then disconnected, 0 to never (default 30000)\n");
+	printf("\t--stats PATH\tserve metrics to each connection made to a Unix socket at PATH\n");
+	printf("\t--handoff PATH\ttake over from a server already running with the same PATH, and hand over to the next one through a Unix socket at PATH\n");
+	printf("\t--retransmit-window N\trecent messages kept to resend to reconnecting clients (default 4096)\n");
+	printf("\t--journal DIR\tappend every message to a journal kept in DIR\n");
+	printf("\t--fsync-ms N\tlongest time journaled messages may go unsynced, 0 to sync every batch (default 50)\n");
 	return 1;
 }
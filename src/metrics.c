@@ -0,0 +1,97 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "metrics.h"
+
+#define load(value) atomic_load_explicit(&(value), memory_order_relaxed)
+#define store(value, new_value) atomic_store_explicit(&(value), new_value, memory_order_relaxed)
+// The destination and space arguments for appending to `bfr` with snprintf,
+// once `written` bytes have been produced, without overrunning `size`
+#define remaining(bfr, written, size) (bfr) + ((written) < (size) ? (written) : (size)), (written) < (size) ? (size) - (written) : 0
+
+static const char* counter_names[COUNTER_COUNT] = {
+	[COUNTER_ACCEPTS] = "chat_accepts_total",
+	[COUNTER_DISCONNECTS] = "chat_disconnects_total",
+	[COUNTER_BYTES_IN] = "chat_bytes_in_total",
+	[COUNTER_BYTES_OUT] = "chat_bytes_out_total",
+	[COUNTER_DROPPED_FRAMES] = "chat_dropped_frames_total",
+	[COUNTER_COMPRESSOR_IN] = "chat_compressor_in_bytes_total",
+	[COUNTER_COMPRESSOR_OUT] = "chat_compressor_out_bytes_total",
+	[COUNTER_SEGMENT_THROTTLES] = "chat_segment_throttles_total",
+	[COUNTER_BYTE_THROTTLES] = "chat_byte_throttles_total",
+	[COUNTER_DEFERRED_READS] = "chat_deferred_reads_total",
+};
+
+static const char* gauge_names[GAUGE_COUNT] = {
+	[GAUGE_CONNECTIONS] = "chat_connections",
+	[GAUGE_QUEUED_BYTES] = "chat_queued_bytes",
+};
+
+uint64_t Metrics_nowNs() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void Metrics_count(struct Metrics* metrics, enum Counter counter, uint64_t amount) {
+	store(metrics->counters[counter], load(metrics->counters[counter]) + amount);
+}
+
+void Metrics_adjust(struct Metrics* metrics, enum Gauge gauge, int64_t amount) {
+	store(metrics->gauges[gauge], load(metrics->gauges[gauge]) + amount);
+}
+
+void Metrics_countSegmentIn(struct Metrics* metrics, unsigned char type) {
+	if (type >= SEGMENT_TYPE_COUNT) type = SEGMENT_NONE;
+	store(metrics->segments_in[type], load(metrics->segments_in[type]) + 1);
+}
+
+void Metrics_countSegmentOut(struct Metrics* metrics, unsigned char type, uint64_t amount) {
+	if (type >= SEGMENT_TYPE_COUNT) type = SEGMENT_NONE;
+	store(metrics->segments_out[type], load(metrics->segments_out[type]) + amount);
+}
+
+void Metrics_merge(struct Metrics* into, const struct Metrics* from) {
+	for (int i = 0; i < COUNTER_COUNT; i++)
+		store(into->counters[i], load(into->counters[i]) + load(from->counters[i]));
+	for (int i = 0; i < GAUGE_COUNT; i++)
+		store(into->gauges[i], load(into->gauges[i]) + load(from->gauges[i]));
+	for (int i = 0; i < SEGMENT_TYPE_COUNT; i++) {
+		store(into->segments_in[i], load(into->segments_in[i]) + load(from->segments_in[i]));
+		store(into->segments_out[i], load(into->segments_out[i]) + load(from->segments_out[i]));
+	}
+	Histogram_merge(&into->loop_time, &from->loop_time);
+	Histogram_merge(&into->fanout_time, &from->fanout_time);
+}
+
+static size_t formatHistogram(const struct Histogram* histogram, const char* name, char* bfr, size_t size) {
+	static const double quantiles[] = { 50, 90, 99, 99.9, 100 };
+
+	size_t written = 0;
+	for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+		written += snprintf(remaining(bfr, written, size), "%s{quantile=\"%g\"} %lu\n",
+			name, quantiles[i] / 100, Histogram_percentile(histogram, quantiles[i]));
+	}
+	written += snprintf(remaining(bfr, written, size), "%s_count %lu\n", name, load(histogram->total));
+	return written;
+}
+
+size_t Metrics_format(const struct Metrics* metrics, char* bfr, size_t size) {
+	size_t written = 0;
+
+	for (int i = 0; i < COUNTER_COUNT; i++)
+		written += snprintf(remaining(bfr, written, size), "%s %lu\n", counter_names[i], load(metrics->counters[i]));
+	for (int i = 0; i < GAUGE_COUNT; i++)
+		written += snprintf(remaining(bfr, written, size), "%s %ld\n", gauge_names[i], load(metrics->gauges[i]));
+	for (int i = 0; i < SEGMENT_TYPE_COUNT; i++) {
+		written += snprintf(remaining(bfr, written, size), "chat_segments_in_total{type=\"%s\"} %lu\n",
+			segmentTypeName(i), load(metrics->segments_in[i]));
+		written += snprintf(remaining(bfr, written, size), "chat_segments_out_total{type=\"%s\"} %lu\n",
+			segmentTypeName(i), load(metrics->segments_out[i]));
+	}
+	written += formatHistogram(&metrics->loop_time, "chat_loop_time_ns", remaining(bfr, written, size));
+	written += formatHistogram(&metrics->fanout_time, "chat_fanout_time_ns", remaining(bfr, written, size));
+	return written;
+}
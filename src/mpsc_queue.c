@@ -0,0 +1,46 @@
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "mpsc_queue.h"
+
+void MPSCQueue_init(struct MPSCQueue* queue) {
+	atomic_store_explicit(&queue->stub.next, NULL, memory_order_relaxed);
+	atomic_store_explicit(&queue->head, &queue->stub, memory_order_relaxed);
+	queue->tail = &queue->stub;
+}
+
+void MPSCQueue_push(struct MPSCQueue* queue, struct MPSCNode* node) {
+	atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+	struct MPSCNode* prev = atomic_exchange_explicit(&queue->head, node, memory_order_acq_rel);
+	atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+struct MPSCNode* MPSCQueue_pop(struct MPSCQueue* queue) {
+	struct MPSCNode* tail = queue->tail;
+	struct MPSCNode* next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+	if (tail == &queue->stub) {
+		if (next == NULL) return NULL;
+		queue->tail = next;
+		tail = next;
+		next = atomic_load_explicit(&next->next, memory_order_acquire);
+	}
+
+	if (next != NULL) {
+		queue->tail = next;
+		return tail;
+	}
+
+	struct MPSCNode* head = atomic_load_explicit(&queue->head, memory_order_acquire);
+	if (tail != head) return NULL;
+
+	// `tail` is the last node; put the stub back behind it so it can be handed out
+	MPSCQueue_push(queue, &queue->stub);
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if (next != NULL) {
+		queue->tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
@@ -1,198 +1,1031 @@
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include <arpa/inet.h>
 #include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "networking.h"
 
 #define isConnectionClosed(bytes_read) (bytes_read == 0 || (bytes_read == -1 && errno != EWOULDBLOCK))
 
-static bool fragmentedRead(struct SocketReader* read_args) {
-	void* destination = read_args->dest + read_args->bytes_read;
-	ssize_t bytes_remaining = read_args->target_bytes - read_args->bytes_read;
+// Varints never need more bytes than it takes to describe SEGMENT_MAX_LENGTH
+#define VARINT_MAX_BYTES (SEGMENT_MAX_HEADER - 1)
 
-	if (bytes_remaining == 0) return false;
+const char* segmentTypeName(unsigned char type) {
+	switch (type) {
+		case SEGMENT_NONE: return "none";
+		case SEGMENT_MESSAGE: return "message";
+		case SEGMENT_STATUS: return "status";
+		case SEGMENT_HISTORY: return "history";
+		case SEGMENT_RESUME: return "resume";
+		case SEGMENT_HELLO: return "hello";
+		case SEGMENT_BATCH: return "batch";
+		case SEGMENT_COMPRESSED: return "compressed";
+		case SEGMENT_PING: return "ping";
+		case SEGMENT_PONG: return "pong";
+		case SEGMENT_JOIN: return "join";
+		case SEGMENT_LEAVE: return "leave";
+		case SEGMENT_ROOM_MESSAGE: return "room_message";
+		case SEGMENT_NICK: return "nick";
+		case SEGMENT_DIRECT: return "direct";
+		default: return "unknown";
+	}
+}
+
+// Returns the number of bytes the varint at the start of `data` takes, 0 if
+// it is not all there yet, or -1 if it is invalid
+static int decodeVarint(const unsigned char* data, size_t size, uint64_t* value) {
+	*value = 0;
+	for (int i = 0; i < VARINT_MAX_BYTES; i++) {
+		if ((size_t)i >= size) return 0;
+		*value |= (uint64_t)(data[i] & 0x7F) << (7 * i);
+		if (data[i] & 0x80) continue;
+
+		// A trailing zero group means more bytes were used than needed
+		if (i > 0 && data[i] == 0) return -1;
+		return i + 1;
+	}
+	return -1;
+}
+
+static size_t varintLength(uint64_t value) {
+	size_t length = 1;
+	while (value >= 0x80) {
+		value >>= 7;
+		length++;
+	}
+	return length;
+}
 
-	ssize_t bytes_received = recv(read_args->socket, destination, bytes_remaining, 0b0);
-	read_args->closed = isConnectionClosed(bytes_received);
-	if (read_args->closed) return false;
+int decodeSegmentHeader(const unsigned char* data, size_t size, unsigned char* type, size_t* length) {
+	if (size == 0) return 0;
 
-	if (bytes_received > 0) read_args->bytes_read += bytes_received;
+	uint64_t value;
+	int varint_length = decodeVarint(data + 1, size - 1, &value);
+	if (varint_length <= 0) return varint_length;
+	if (value > SEGMENT_MAX_LENGTH) return -1;
 
-	return read_args->bytes_read == read_args->target_bytes;
+	*type = data[0];
+	*length = value;
+	return 1 + varint_length;
 }
 
 struct Connection newConnection(int socket) {
 	struct Connection new = {0};
 
 	new.socket = socket;
-	new.bfr = malloc(SEGMENT_MAX_LENGTH);
+	new.bfr = malloc(RECEIVE_BUFFER_SIZE);
 	new.reader = (struct SocketReader) {0};
 	new.reader.socket = socket;
-	new.reader.target_bytes = 3;
-	new.reader.dest = new.bfr;
 
 	return new;
 }
 
 void markHandled(struct Connection* connection) {
-	switch (connection->segment_type) {
+	connection->segment_ready = false;
+	connection->segment_type = SEGMENT_NONE;
+}
+
+static void compactBuffer(struct SocketReader* reader, char* bfr) {
+	if (reader->start == 0) return;
+	memmove(bfr, bfr + reader->start, reader->end - reader->start);
+	reader->end -= reader->start;
+	reader->start = 0;
+}
+
+static void fillBuffer(struct Connection* connection) {
+	struct SocketReader* reader = &connection->reader;
+	compactBuffer(reader, connection->bfr);
+
+	while (!reader->closed && reader->end < RECEIVE_BUFFER_SIZE) {
+		size_t space = RECEIVE_BUFFER_SIZE - reader->end;
+		ssize_t bytes_received = recv(reader->socket, connection->bfr + reader->end, space, 0b0);
+		if (bytes_received == -1 && errno == EINTR) continue;
+		reader->closed = isConnectionClosed(bytes_received);
+		if (bytes_received <= 0) break;
+
+		reader->end += bytes_received;
+		connection->bytes_received += bytes_received;
+		// A short read means the socket has been drained for now
+		if ((size_t)bytes_received < space) break;
+	}
+}
+
+// Reads the fields of one segment body, never past its end. A read that
+// would go past it fails, as does every read after it.
+struct FieldReader {
+	unsigned char* pos;
+	unsigned char* end;
+	bool failed;
+};
+
+static bool fieldsLeft(struct FieldReader* fields, size_t size) {
+	if (!fields->failed && (size_t)(fields->end - fields->pos) < size) fields->failed = true;
+	return !fields->failed;
+}
+
+static uint64_t readUint(struct FieldReader* fields, size_t size) {
+	if (!fieldsLeft(fields, size)) return 0;
+
+	uint64_t value = 0;
+	for (size_t i = 0; i < size; i++)
+		value = (value << 8) | fields->pos[i];
+	fields->pos += size;
+	return value;
+}
+
+static char* readString(struct FieldReader* fields, uint32_t* length) {
+	*length = 0;
+	if (fields->failed) return NULL;
+
+	uint64_t value;
+	int varint_length = decodeVarint(fields->pos, fields->end - fields->pos, &value);
+	if (varint_length <= 0) {
+		fields->failed = true;
+		return NULL;
+	}
+	fields->pos += varint_length;
+	if (!fieldsLeft(fields, value)) return NULL;
+
+	char* string = (char*)fields->pos;
+	*length = value;
+	fields->pos += value;
+	return string;
+}
+
+// Decodes a segment body into `connection->segment`. Returns false if the
+// body is malformed. Types this side does not know are accepted as they are.
+static bool decodeSegment(struct Connection* connection, unsigned char type, unsigned char* body, size_t length) {
+	struct FieldReader fields = { body, body + length, false };
+
+	switch (type) {
 		case SEGMENT_STATUS: {
-			struct Segment_Status* segment = connection->segment;
-			free(segment->status);
+			struct Segment_Status* segment = &connection->segment.status;
+			segment->status = readString(&fields, &segment->status_len);
 			break;
 		}
 		case SEGMENT_MESSAGE: {
-			struct Segment_Message* segment = connection->segment;
-			free(segment->sender);
-			free(segment->contents);
+			struct Segment_Message* segment = &connection->segment.message;
+			segment->seq = readUint(&fields, sizeof(uint64_t));
+			segment->sender = readString(&fields, &segment->sender_len);
+			segment->contents = readString(&fields, &segment->contents_len);
+			break;
+		}
+		case SEGMENT_HISTORY: {
+			struct Segment_History* segment = &connection->segment.history;
+			segment->count = readUint(&fields, sizeof(uint32_t));
+			segment->since = readUint(&fields, sizeof(uint64_t));
+			break;
+		}
+		case SEGMENT_RESUME: {
+			connection->segment.resume.seq = readUint(&fields, sizeof(uint64_t));
+			break;
+		}
+		case SEGMENT_HELLO: {
+			struct Segment_Hello* segment = &connection->segment.hello;
+			segment->version = readUint(&fields, sizeof(uint16_t));
+			segment->features = readUint(&fields, sizeof(uint32_t));
+			break;
+		}
+		case SEGMENT_PING:
+		case SEGMENT_PONG: {
+			connection->segment.ping.token = readUint(&fields, sizeof(uint64_t));
+			break;
+		}
+		case SEGMENT_JOIN:
+		case SEGMENT_LEAVE: {
+			struct Segment_Room* segment = &connection->segment.room;
+			segment->room = readString(&fields, &segment->room_len);
+			break;
+		}
+		case SEGMENT_ROOM_MESSAGE: {
+			struct Segment_RoomMessage* segment = &connection->segment.room_message;
+			segment->room = readString(&fields, &segment->room_len);
+			segment->sender = readString(&fields, &segment->sender_len);
+			segment->contents = readString(&fields, &segment->contents_len);
+			break;
+		}
+		case SEGMENT_NICK: {
+			struct Segment_Nick* segment = &connection->segment.nick;
+			segment->nick = readString(&fields, &segment->nick_len);
+			break;
+		}
+		case SEGMENT_DIRECT: {
+			struct Segment_Direct* segment = &connection->segment.direct;
+			segment->nick = readString(&fields, &segment->nick_len);
+			segment->contents = readString(&fields, &segment->contents_len);
 			break;
 		}
 	}
 
-	free(connection->segment);
-	connection->segment = NULL;
-	connection->segment_ready = false;
+	return !fields.failed;
+}
+
+static bool isKnownType(unsigned char type) {
+	return type != SEGMENT_NONE && type < SEGMENT_TYPE_COUNT;
+}
+
+static void markMalformed(struct Connection* connection) {
+	connection->malformed = true;
 	connection->segment_type = SEGMENT_NONE;
-	connection->reader.bytes_read = 0;
-	connection->reader.target_bytes = 3;
+	connection->reader.closed = true;
+	connection->reader.start = 0;
+	connection->reader.end = 0;
+	connection->batch_pos = NULL;
+	connection->batch_end = NULL;
 }
 
-// TODO: There lacks data sanitation and sanity checks
-void updateConnection(struct Connection* connection) {
-	if (connection->segment_ready) return;
-
-	while (fragmentedRead(&connection->reader)) {
-		switch(connection->segment_type) {
-			case SEGMENT_NONE:
-				connection->segment_type = connection->bfr[0];
-				connection->reader.bytes_read = 0;
-				connection->reader.target_bytes = ntohs(*(uint16_t*)&(connection->bfr[1]));
-				break;
-			case SEGMENT_STATUS: {
-				connection->segment = calloc(1, sizeof(struct Segment_Status));
-				struct Segment_Status* segment = connection->segment;
-				void* read_loc = connection->bfr;
-
-				segment->status_len = ntohs(*(uint16_t*)read_loc);
-				read_loc += sizeof(uint16_t);
-
-				segment->status = malloc(segment->status_len+1);
-				char* status = segment->status;
-				status[segment->status_len] = '\0';
-				memcpy(status, read_loc, segment->status_len);
-
-				connection->segment_ready = true;
-				break;
+// Checks every segment in a batch before any of them is handed out, so a
+// batch is either delivered whole or not at all
+static bool validateBatch(struct Connection* connection, unsigned char* start, unsigned char* end) {
+	while (start < end) {
+		unsigned char type;
+		size_t length;
+		int header_length = decodeSegmentHeader(start, end - start, &type, &length);
+		if (header_length <= 0 || length > (size_t)(end - start) - header_length) return false;
+		if (type == SEGMENT_HELLO || type == SEGMENT_BATCH || type == SEGMENT_COMPRESSED) return false;
+		if (isKnownType(type) && !decodeSegment(connection, type, start + header_length, length)) return false;
+		start += header_length + length;
+	}
+
+	return true;
+}
+
+// Decompresses the body of a SEGMENT_COMPRESSED into `inflated`. Returns
+// false if it is malformed, which leaves its stream unusable.
+static bool inflateSegment(struct Connection* connection, unsigned char* body, size_t length) {
+	if (!(connection->features & FEATURE_DEFLATE) || length < 1) return false;
+	unsigned char id = body[0] & ~COMPRESSION_RESTART;
+	bool restart = body[0] & COMPRESSION_RESTART;
+	if (id >= COMPRESSION_STREAM_COUNT) return false;
+
+	z_stream* stream = connection->inflaters[id];
+	if (stream == NULL) {
+		// A stream can only be joined where it starts over
+		if (!restart) return false;
+		stream = calloc(1, sizeof(z_stream));
+		if (inflateInit2(stream, -MAX_WBITS) != Z_OK) {
+			free(stream);
+			return false;
+		}
+		connection->inflaters[id] = stream;
+	} else if (restart) {
+		inflateReset(stream);
+	}
+
+	// One byte over the limit, so that filling it means the limit was passed
+	if (connection->inflated == NULL) connection->inflated = malloc(COMPRESSED_MAX_INFLATED + 1);
+	stream->next_out = connection->inflated;
+	stream->avail_out = COMPRESSED_MAX_INFLATED + 1;
+
+	unsigned char sync_tail[] = { 0x00, 0x00, 0xFF, 0xFF };
+	unsigned char* inputs[] = { body + 1, sync_tail };
+	size_t input_lengths[] = { length - 1, sizeof(sync_tail) };
+	for (int i = 0; i < 2; i++) {
+		stream->next_in = inputs[i];
+		stream->avail_in = input_lengths[i];
+		int result = inflate(stream, Z_SYNC_FLUSH);
+		if ((result != Z_OK && result != Z_BUF_ERROR) || stream->avail_in > 0 || stream->avail_out == 0) return false;
+	}
+
+	connection->batch_pos = connection->inflated;
+	connection->batch_end = stream->next_out;
+	return true;
+}
+
+static bool parseSegment(struct Connection* connection) {
+	struct SocketReader* reader = &connection->reader;
+	unsigned char* bfr = (unsigned char*)connection->bfr;
+
+	while (!connection->malformed) {
+		unsigned char type;
+		size_t length;
+		unsigned char* body;
+
+		if (connection->batch_pos < connection->batch_end) {
+			// Already validated as a whole
+			int header_length = decodeSegmentHeader(connection->batch_pos, connection->batch_end - connection->batch_pos, &type, &length);
+			body = connection->batch_pos + header_length;
+			connection->batch_pos = body + length;
+		} else {
+			int header_length = decodeSegmentHeader(bfr + reader->start, reader->end - reader->start, &type, &length);
+			if (header_length == -1) {
+				markMalformed(connection);
+				return false;
 			}
-			case SEGMENT_MESSAGE: {
-				connection->segment = calloc(1, sizeof(struct Segment_Message));
-				struct Segment_Message* segment = connection->segment;
-				void* read_loc = connection->bfr;
-
-				segment->sender_len = ntohs(*(uint16_t*)read_loc);
-				read_loc += sizeof(uint16_t);
-
-				segment->sender = malloc(segment->sender_len+1);
-				char* sender = segment->sender;
-				sender[segment->sender_len] = '\0';
-				memcpy(sender, read_loc, segment->sender_len);
-				read_loc += segment->sender_len;
-
-				segment->contents_len = ntohs(*(uint16_t*)read_loc);
-				read_loc += sizeof(uint16_t);
-
-				segment->contents = malloc(segment->contents_len+1);
-				char* contents = segment->contents;
-				contents[segment->contents_len] = '\0';
-				memcpy(contents, read_loc, segment->contents_len);
-
-				connection->segment_ready = true;
-				break;
+			if (header_length == 0 || reader->end - reader->start < (size_t)header_length + length) return false;
+
+			body = bfr + reader->start + header_length;
+			// Views into the buffer stay valid, as nothing is moved, or
+			// written over, until it is compacted once they are done with
+			reader->start += header_length + length;
+
+			if (type == SEGMENT_BATCH || type == SEGMENT_COMPRESSED) {
+				if (type == SEGMENT_BATCH) {
+					connection->batch_pos = body;
+					connection->batch_end = body + length;
+				} else if (!inflateSegment(connection, body, length)) {
+					markMalformed(connection);
+					return false;
+				}
+
+				if (!validateBatch(connection, connection->batch_pos, connection->batch_end)) {
+					markMalformed(connection);
+					return false;
+				}
+				continue;
 			}
-			default:
-				break;
 		}
+
+		// Skip segments this side does not understand
+		if (!isKnownType(type)) continue;
+
+		if (!decodeSegment(connection, type, body, length)) {
+			markMalformed(connection);
+			return false;
+		}
+		connection->segment_type = type;
+		connection->segment_ready = true;
+		return true;
+	}
+
+	return false;
+}
+
+void nextSegment(struct Connection* connection) {
+	if (connection->segment_ready || connection->malformed) return;
+	parseSegment(connection);
+}
+
+void updateConnection(struct Connection* connection) {
+	if (connection->segment_ready || connection->malformed) return;
+	if (parseSegment(connection)) return;
+	if (connection->malformed) return;
+
+	fillBuffer(connection);
+	parseSegment(connection);
+}
+
+size_t receiveBytes(struct Connection* connection, const void* data, size_t length) {
+	struct SocketReader* reader = &connection->reader;
+	// The segment ready to be handled, and those of a batch still being
+	// handed out, point into the buffer
+	if (!connection->segment_ready && connection->batch_pos >= connection->batch_end)
+		compactBuffer(reader, connection->bfr);
+	if (length > RECEIVE_BUFFER_SIZE - reader->end) length = RECEIVE_BUFFER_SIZE - reader->end;
+
+	memcpy(connection->bfr + reader->end, data, length);
+	reader->end += length;
+	connection->bytes_received += length;
+	return length;
+}
+
+#define FLUSH_MAX_IOVECS 64
+
+static struct Frame* allocFrame(size_t data_length) {
+	struct Frame* frame = malloc(sizeof(struct Frame) + data_length);
+	atomic_init(&frame->refs, 1);
+	frame->length = data_length;
+	frame->fd = -1;
+	frame->file_offset = 0;
+	frame->segments = 1;
+	return frame;
+}
+
+static void* writeVarint(void* write_pos, uint64_t value) {
+	unsigned char* bytes = write_pos;
+	while (value >= 0x80) {
+		*bytes++ = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	*bytes++ = value;
+	return bytes;
+}
+
+static size_t segmentLength(size_t body_length) {
+	return sizeof(unsigned char) + varintLength(body_length) + body_length;
+}
+
+// Returns the new frame and, through `body`, where its body starts
+static struct Frame* newFrame(enum SegmentType type, size_t body_length, void** body) {
+	struct Frame* frame = allocFrame(segmentLength(body_length));
+	frame->data[0] = (unsigned char)type;
+	*body = writeVarint(&frame->data[1], body_length);
+	return frame;
+}
+
+static void* writeString(void* write_pos, char* string, size_t length) {
+	write_pos = writeVarint(write_pos, length);
+	memcpy(write_pos, string, length);
+	return write_pos + length;
+}
+
+static void* writeUint(void* write_pos, uint64_t value, size_t size) {
+	unsigned char* bytes = write_pos;
+	for (size_t i = size; i > 0; i--) {
+		bytes[i-1] = value & 0xFF;
+		value >>= 8;
 	}
+	return write_pos + size;
+}
+
+static size_t stringLength(size_t length) {
+	return varintLength(length) + length;
+}
+
+struct Frame* Frame_newStatus(char* status, size_t status_len) {
+	size_t body_length = stringLength(status_len);
+	if (body_length > SEGMENT_MAX_LENGTH) return NULL;
+
+	void* write_pos;
+	struct Frame* frame = newFrame(SEGMENT_STATUS, body_length, &write_pos);
+	writeString(write_pos, status, status_len);
+
+	return frame;
+}
+
+static size_t messageBodyLength(size_t sender_len, size_t contents_len) {
+	return
+		sizeof(uint64_t) // Sequence number
+		+ stringLength(sender_len) // Sender name
+		+ stringLength(contents_len) // Contents
+	;
+}
+
+size_t Frame_messageLength(size_t sender_len, size_t contents_len) {
+	return segmentLength(messageBodyLength(sender_len, contents_len));
+}
+
+struct Frame* Frame_newMessage(uint64_t seq, char* sender, size_t sender_len, char* contents, size_t contents_len) {
+	size_t body_length = messageBodyLength(sender_len, contents_len);
+	if (body_length > SEGMENT_MAX_LENGTH) return NULL;
+
+	void* write_pos;
+	struct Frame* frame = newFrame(SEGMENT_MESSAGE, body_length, &write_pos);
+	write_pos = writeUint(write_pos, seq, sizeof(uint64_t));
+	write_pos = writeString(write_pos, sender, sender_len);
+	writeString(write_pos, contents, contents_len);
+
+	return frame;
+}
+
+struct Frame* Frame_newHistory(uint32_t count, uint64_t since) {
+	void* write_pos;
+	struct Frame* frame = newFrame(SEGMENT_HISTORY, sizeof(uint32_t) + sizeof(uint64_t), &write_pos);
+	write_pos = writeUint(write_pos, count, sizeof(uint32_t));
+	writeUint(write_pos, since, sizeof(uint64_t));
+
+	return frame;
+}
+
+struct Frame* Frame_newResume(uint64_t seq) {
+	void* write_pos;
+	struct Frame* frame = newFrame(SEGMENT_RESUME, sizeof(uint64_t), &write_pos);
+	writeUint(write_pos, seq, sizeof(uint64_t));
+	return frame;
+}
+
+struct Frame* Frame_newHello(uint16_t version, uint32_t features) {
+	void* write_pos;
+	struct Frame* frame = newFrame(SEGMENT_HELLO, sizeof(uint16_t) + sizeof(uint32_t), &write_pos);
+	write_pos = writeUint(write_pos, version, sizeof(uint16_t));
+	writeUint(write_pos, features, sizeof(uint32_t));
+	return frame;
+}
+
+static struct Frame* newPingFrame(enum SegmentType type, uint64_t token) {
+	void* write_pos;
+	struct Frame* frame = newFrame(type, sizeof(uint64_t), &write_pos);
+	writeUint(write_pos, token, sizeof(uint64_t));
+	return frame;
+}
+
+struct Frame* Frame_newPing(uint64_t token) {
+	return newPingFrame(SEGMENT_PING, token);
+}
+
+struct Frame* Frame_newPong(uint64_t token) {
+	return newPingFrame(SEGMENT_PONG, token);
+}
+
+struct Frame* Frame_newRoom(enum SegmentType type, char* room, size_t room_len) {
+	void* write_pos;
+	struct Frame* frame = newFrame(type, stringLength(room_len), &write_pos);
+	writeString(write_pos, room, room_len);
+	return frame;
+}
+
+struct Frame* Frame_newRoomMessage(char* room, size_t room_len, char* sender, size_t sender_len, char* contents, size_t contents_len) {
+	size_t body_length = stringLength(room_len) + stringLength(sender_len) + stringLength(contents_len);
+	if (body_length > SEGMENT_MAX_LENGTH) return NULL;
+
+	void* write_pos;
+	struct Frame* frame = newFrame(SEGMENT_ROOM_MESSAGE, body_length, &write_pos);
+	write_pos = writeString(write_pos, room, room_len);
+	write_pos = writeString(write_pos, sender, sender_len);
+	writeString(write_pos, contents, contents_len);
+
+	return frame;
+}
+
+struct Frame* Frame_newNick(char* nick, size_t nick_len) {
+	void* write_pos;
+	struct Frame* frame = newFrame(SEGMENT_NICK, stringLength(nick_len), &write_pos);
+	writeString(write_pos, nick, nick_len);
+	return frame;
+}
+
+struct Frame* Frame_newDirect(char* nick, size_t nick_len, char* contents, size_t contents_len) {
+	size_t body_length = stringLength(nick_len) + stringLength(contents_len);
+	if (body_length > SEGMENT_MAX_LENGTH) return NULL;
+
+	void* write_pos;
+	struct Frame* frame = newFrame(SEGMENT_DIRECT, body_length, &write_pos);
+	write_pos = writeString(write_pos, nick, nick_len);
+	writeString(write_pos, contents, contents_len);
+
+	return frame;
+}
+
+struct Frame* Frame_newBatch(struct Frame** frames, size_t num_frames, size_t* packed) {
+	size_t body_length = 0;
+	size_t count = 0;
+	while (count < num_frames && body_length + frames[count]->length <= SEGMENT_MAX_LENGTH) {
+		body_length += frames[count]->length;
+		count++;
+	}
+
+	if (count <= 1) {
+		*packed = 1;
+		return Frame_ref(frames[0]);
+	}
+
+	void* write_pos;
+	struct Frame* batch = newFrame(SEGMENT_BATCH, body_length, &write_pos);
+	batch->segments = 0;
+	for (size_t i = 0; i < count; i++) {
+		memcpy(write_pos, frames[i]->data, frames[i]->length);
+		write_pos += frames[i]->length;
+		batch->segments += frames[i]->segments;
+	}
+
+	*packed = count;
+	return batch;
+}
+
+struct Frame* Frame_newLegacyStatus(char* status, uint16_t status_len) {
+	if (status_len > UINT16_MAX - sizeof(uint16_t)) status_len = UINT16_MAX - sizeof(uint16_t);
+	uint16_t body_length = sizeof(uint16_t) + status_len;
+
+	struct Frame* frame = allocFrame(sizeof(unsigned char) + sizeof(uint16_t) + body_length);
+	frame->data[0] = SEGMENT_STATUS;
+	void* write_pos = writeUint(&frame->data[1], body_length, sizeof(uint16_t));
+	write_pos = writeUint(write_pos, status_len, sizeof(uint16_t));
+	memcpy(write_pos, status, status_len);
+
+	return frame;
+}
+
+struct Frame* Frame_copy(const void* data, size_t length) {
+	struct Frame* frame = allocFrame(length);
+	memcpy(frame->data, data, length);
+	return frame;
+}
+
+struct Frame* Frame_newFileRange(int fd, uint64_t offset, size_t length, unsigned int segments) {
+	struct Frame* frame = allocFrame(0);
+	frame->length = length;
+	frame->fd = fd;
+	frame->file_offset = offset;
+	frame->segments = segments;
+	return frame;
+}
+
+struct Frame* Frame_ref(struct Frame* frame) {
+	atomic_fetch_add_explicit(&frame->refs, 1, memory_order_relaxed);
+	return frame;
+}
+
+void Frame_release(struct Frame* frame) {
+	if (atomic_fetch_sub_explicit(&frame->refs, 1, memory_order_acq_rel) == 1)
+		free(frame);
+}
+
+// Frames are compressed in pieces of at most this much, which stay well
+// within SEGMENT_MAX_LENGTH even if they do not compress at all
+#define COMPRESS_PIECE_SIZE (48 * 1024)
+// Every sync flush ends in the same 4 bytes, which are left for the receiver
+// to put back
+#define SYNC_TAIL_LENGTH 4
+
+bool initCompressor(struct Compressor* compressor, enum CompressionStream id) {
+	memset(compressor, 0, sizeof(struct Compressor));
+	compressor->id = id;
+	compressor->restart = true;
+	if (deflateInit2(&compressor->stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return false;
+
+	compressor->bfr = malloc(SEGMENT_MAX_LENGTH);
+	return true;
+}
+
+void Compressor_restart(struct Compressor* compressor) {
+	compressor->restart = true;
+}
+
+static void startPiece(struct Compressor* compressor) {
+	compressor->bfr[0] = compressor->id;
+	if (compressor->restart) {
+		deflateReset(&compressor->stream);
+		compressor->bfr[0] |= COMPRESSION_RESTART;
+		compressor->restart = false;
+	}
+
+	compressor->stream.next_out = compressor->bfr + 1;
+	compressor->stream.avail_out = SEGMENT_MAX_LENGTH - 1;
+}
+
+static void finishPiece(struct Compressor* compressor, struct DynamicArray* out) {
+	z_stream* stream = &compressor->stream;
+	stream->next_in = NULL;
+	stream->avail_in = 0;
+	deflate(stream, Z_SYNC_FLUSH);
+
+	size_t body_length = stream->next_out - compressor->bfr - SYNC_TAIL_LENGTH;
+	void* write_pos;
+	struct Frame* frame = newFrame(SEGMENT_COMPRESSED, body_length, &write_pos);
+	memcpy(write_pos, compressor->bfr, body_length);
+	compressor->bytes_out += frame->length;
+	DynamicArray_push(out, &frame);
+}
+
+void Compressor_compress(struct Compressor* compressor, struct Frame** frames, size_t num_frames, struct DynamicArray* out) {
+	size_t piece_length = 0;
+
+	for (size_t i = 0; i < num_frames; i++) {
+		struct Frame* frame = frames[i];
+		bool fits = frame->fd == -1 && frame->length <= COMPRESS_PIECE_SIZE;
+		if (piece_length > 0 && (!fits || piece_length + frame->length > COMPRESS_PIECE_SIZE)) {
+			finishPiece(compressor, out);
+			piece_length = 0;
+		}
+		if (!fits) {
+			Frame_ref(frame);
+			DynamicArray_push(out, &frame);
+			continue;
+		}
+
+		if (piece_length == 0) startPiece(compressor);
+		compressor->stream.next_in = frame->data;
+		compressor->stream.avail_in = frame->length;
+		deflate(&compressor->stream, Z_NO_FLUSH);
+		piece_length += frame->length;
+		compressor->bytes_in += frame->length;
+	}
+
+	if (piece_length > 0) finishPiece(compressor, out);
+}
+
+void cleanupCompressor(struct Compressor* compressor) {
+	deflateEnd(&compressor->stream);
+	free(compressor->bfr);
+}
+
+void setOutboundLimit(struct Connection* connection, size_t limit, enum SlowConsumerPolicy policy) {
+	connection->outbound.limit = limit;
+	connection->outbound.policy = policy;
+}
+
+static void pushFrame(struct OutboundQueue* queue, struct Frame* frame) {
+	if (queue->count == queue->capacity) {
+		unsigned int new_capacity = queue->capacity == 0 ? 8 : queue->capacity * 2;
+		struct Frame** frames = malloc(new_capacity * sizeof(struct Frame*));
+		for (unsigned int i = 0; i < queue->count; i++)
+			frames[i] = queue->frames[(queue->head + i) % queue->capacity];
+		free(queue->frames);
+		queue->frames = frames;
+		queue->head = 0;
+		queue->capacity = new_capacity;
+	}
+
+	queue->frames[(queue->head + queue->count) % queue->capacity] = Frame_ref(frame);
+	queue->count++;
+	queue->bytes += frame->length;
+}
+
+static void popFrame(struct OutboundQueue* queue) {
+	Frame_release(queue->frames[queue->head]);
+	queue->head = (queue->head + 1) % queue->capacity;
+	queue->count--;
+	queue->head_offset = 0;
+}
+
+// Discards the oldest frame that has not been partially written, since
+// cutting one short would corrupt the stream, and is not pinned by a write in
+// flight. Returns false if there is none.
+static bool dropOldestUnsent(struct OutboundQueue* queue) {
+	unsigned int victim = queue->head_offset > 0 ? 1 : 0;
+	if (queue->pinned > victim) victim = queue->pinned;
+	if (victim >= queue->count) return false;
+
+	unsigned int victim_slot = (queue->head + victim) % queue->capacity;
+	struct Frame* frame = queue->frames[victim_slot];
+	queue->bytes -= frame->length;
+	queue->dropped_frames += frame->segments;
+	Frame_release(frame);
+
+	// Slide the frames being written into the freed slot
+	for (unsigned int i = victim; i > 0; i--)
+		queue->frames[(queue->head + i) % queue->capacity] = queue->frames[(queue->head + i - 1) % queue->capacity];
+	queue->head = (queue->head + 1) % queue->capacity;
+	queue->count--;
+
+	return true;
+}
+
+bool queueFrame(struct Connection* connection, struct Frame* frame) {
+	struct OutboundQueue* queue = &connection->outbound;
+
+	if (queue->limit == 0 || queue->bytes + frame->length <= queue->limit) {
+		pushFrame(queue, frame);
+		return true;
+	}
+	if (connection->features & FEATURE_DEFLATE) return false;
+
+	switch (queue->policy) {
+		case SLOW_CONSUMER_DISCONNECT:
+			return false;
+		case SLOW_CONSUMER_DROP_OLDEST:
+			while (queue->bytes + frame->length > queue->limit && dropOldestUnsent(queue));
+			break;
+		case SLOW_CONSUMER_COALESCE: {
+			size_t dropped_before = queue->dropped_frames;
+			while (dropOldestUnsent(queue));
+			size_t skipped = queue->dropped_frames - dropped_before;
+
+			char notice[64];
+			int notice_len = snprintf(notice, sizeof(notice), "%zu messages were skipped.", skipped);
+			struct Frame* notice_frame = Frame_newStatus(notice, notice_len);
+			pushFrame(queue, notice_frame);
+			Frame_release(notice_frame);
+			break;
+		}
+	}
+
+	pushFrame(queue, frame);
+	return true;
+}
+
+bool enableCompression(struct Connection* connection) {
+	if (connection->compressor != NULL) return true;
+
+	struct Compressor* compressor = malloc(sizeof(struct Compressor));
+	if (!initCompressor(compressor, COMPRESSION_PRIVATE)) {
+		free(compressor);
+		return false;
+	}
+	connection->compressor = compressor;
+	return true;
 }
 
 void cleanupConnection(struct Connection* connection) {
 	if (connection->segment_ready) markHandled(connection);
+	if (connection->compressor != NULL) {
+		cleanupCompressor(connection->compressor);
+		free(connection->compressor);
+	}
+	for (int i = 0; i < COMPRESSION_STREAM_COUNT; i++) {
+		if (connection->inflaters[i] == NULL) continue;
+		inflateEnd(connection->inflaters[i]);
+		free(connection->inflaters[i]);
+	}
+	free(connection->inflated);
+	while (connection->outbound.count > 0) popFrame(&connection->outbound);
+	free(connection->outbound.frames);
 	free(connection->bfr);
 	close(connection->socket);
 }
 
-static bool sendBulk(struct Connection* connection, void* data, size_t bytes) {
-	size_t total_sent = 0;
-	while (total_sent < bytes) {
-		ssize_t bytes_sent = send(connection->socket, data+total_sent, bytes-total_sent, 0b0);
-		if (bytes_sent == -1) return false;
-		total_sent += bytes_sent;
+bool saveInflater(struct Connection* connection, enum CompressionStream id, unsigned char* window, unsigned int* length) {
+	z_stream* stream = connection->inflaters[id];
+	if (stream == NULL) return false;
+	return inflateGetDictionary(stream, window, length) == Z_OK;
+}
+
+bool restoreInflater(struct Connection* connection, enum CompressionStream id, const unsigned char* window, unsigned int length) {
+	z_stream* stream = calloc(1, sizeof(z_stream));
+	if (inflateInit2(stream, -MAX_WBITS) != Z_OK) {
+		free(stream);
+		return false;
+	}
+	if (length > 0 && inflateSetDictionary(stream, window, length) != Z_OK) {
+		inflateEnd(stream);
+		free(stream);
+		return false;
 	}
+	connection->inflaters[id] = stream;
+	return true;
+}
 
+bool copyPendingOutput(struct Connection* connection, unsigned char* out) {
+	struct OutboundQueue* queue = &connection->outbound;
+	for (unsigned int i = 0; i < queue->count; i++) {
+		struct Frame* frame = queue->frames[(queue->head + i) % queue->capacity];
+		if (frame->fd == -1) {
+			memcpy(out, frame->data, frame->length);
+		} else {
+			for (size_t copied = 0; copied < frame->length;) {
+				ssize_t bytes_read = pread(frame->fd, out + copied, frame->length - copied, frame->file_offset + copied);
+				if (bytes_read == -1 && errno == EINTR) continue;
+				if (bytes_read <= 0) return false;
+				copied += bytes_read;
+			}
+		}
+		out += frame->length;
+	}
 	return true;
 }
 
-void sendSegment_Status(struct Connection* connection, char* status) {
-	char bfr[SEGMENT_MAX_LENGTH + sizeof(unsigned char) + sizeof(uint16_t)];
-	void* write_pos = bfr;
-	*(unsigned char*)write_pos = (unsigned char)SEGMENT_STATUS;
-	write_pos += 1;
+void restorePendingOutput(struct Connection* connection, const unsigned char* data, size_t length, size_t written) {
+	if (length == 0) return;
+	struct Frame* frame = Frame_copy(data, length);
+	pushFrame(&connection->outbound, frame);
+	Frame_release(frame);
+	connection->outbound.head_offset = written;
+	connection->outbound.bytes -= written;
+}
 
-	uint16_t status_len = strlen(status);
-	uint16_t segment_size =
-		sizeof(uint16_t) // Component size indicators
-		+ status_len // Status data
-	;
+bool hasPendingOutput(struct Connection* connection) {
+	return connection->outbound.count > 0;
+}
 
-	*(uint16_t*)write_pos = htons(segment_size);
-	write_pos += sizeof(uint16_t);
+// Sends the bytes of a file backed frame at the head of the queue
+static ssize_t sendFileRange(struct Connection* connection) {
+	struct OutboundQueue* queue = &connection->outbound;
+	struct Frame* frame = queue->frames[queue->head];
 
-	*(uint16_t*)write_pos = htons(status_len);
-	write_pos += sizeof(uint16_t);
+	off_t offset = frame->file_offset + queue->head_offset;
+	ssize_t bytes_sent = sendfile(connection->socket, frame->fd, &offset, frame->length - queue->head_offset);
+	// The file ending early would leave the stream cut mid-segment
+	if (bytes_sent == 0) {
+		errno = EIO;
+		return -1;
+	}
+	return bytes_sent;
+}
 
-	memcpy(write_pos, status, status_len);
-	write_pos += status_len;
+// Points `iovecs` at the unwritten part of the queued frames, up to the first
+// file backed one
+static unsigned int gatherFrames(struct OutboundQueue* queue, struct iovec* iovecs, unsigned int max_iovecs) {
+	unsigned int num_iovecs = 0;
+	while (num_iovecs < queue->count && num_iovecs < max_iovecs) {
+		struct Frame* frame = queue->frames[(queue->head + num_iovecs) % queue->capacity];
+		if (frame->fd != -1) break;
 
-	size_t total_bytes = write_pos - (void*)bfr;
+		size_t offset = num_iovecs == 0 ? queue->head_offset : 0;
+		iovecs[num_iovecs].iov_base = frame->data + offset;
+		iovecs[num_iovecs].iov_len = frame->length - offset;
+		num_iovecs++;
+	}
+	return num_iovecs;
+}
 
-	sendBulk(connection, bfr, total_bytes);
+// Gathers queued frames up to the first file backed one into a single send.
+// If frames are left over, the send is marked as having more to follow, so its
+// tail is not pushed out as a small packet of its own.
+static ssize_t sendFrames(struct Connection* connection) {
+	struct iovec iovecs[FLUSH_MAX_IOVECS];
+	struct msghdr message = {0};
+	message.msg_iov = iovecs;
+	message.msg_iovlen = gatherFrames(&connection->outbound, iovecs, FLUSH_MAX_IOVECS);
+	int flags = MSG_NOSIGNAL;
+	if (message.msg_iovlen < connection->outbound.count) flags |= MSG_MORE;
+	return sendmsg(connection->socket, &message, flags);
 }
 
-void sendSegment_Message(struct Connection* connection, char* sender, char* contents) {
-	char bfr[SEGMENT_MAX_LENGTH + sizeof(unsigned char) + sizeof(uint16_t)];
-	void* write_pos = bfr;
-	*(unsigned char*)write_pos = (unsigned char)SEGMENT_MESSAGE;
-	write_pos += 1;
+static void setCork(int socket, bool corked) {
+	int value = corked;
+	setsockopt(socket, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+}
 
-	uint16_t sender_len = strlen(sender);
-	uint16_t contents_len = strlen(contents);
-	uint16_t segment_size =
-		sizeof(uint16_t) * 2 // Component size indicators
-		+ sender_len // Sender name data
-		+ contents_len // Contents data
-	;
+// Removes what has been written from the front of the queue
+static void consumeOutput(struct Connection* connection, size_t bytes_sent) {
+	struct OutboundQueue* queue = &connection->outbound;
+	queue->bytes -= bytes_sent;
+	connection->bytes_sent += bytes_sent;
 
-	*(uint16_t*)write_pos = htons(segment_size);
-	write_pos += sizeof(uint16_t);
+	while (bytes_sent > 0) {
+		struct Frame* frame = queue->frames[queue->head];
+		size_t remaining = frame->length - queue->head_offset;
+		if (bytes_sent < remaining) {
+			queue->head_offset += bytes_sent;
+			return;
+		}
+		bytes_sent -= remaining;
+		popFrame(queue);
+	}
+}
 
-	*(uint16_t*)write_pos = htons(sender_len);
-	write_pos += sizeof(uint16_t);
+bool flushConnection(struct Connection* connection) {
+	struct OutboundQueue* queue = &connection->outbound;
+	bool alive = true;
+	bool corked = false;
 
-	memcpy(write_pos, sender, sender_len);
-	write_pos += sender_len;
+	while (queue->count > 0) {
+		bool file_backed = queue->frames[queue->head]->fd != -1;
+		// sendfile has no MSG_MORE, so the socket is corked instead while
+		// there is more to follow it
+		if (file_backed && !corked && queue->count > 1) {
+			setCork(connection->socket, true);
+			corked = true;
+		}
 
-	*(uint16_t*)write_pos = htons(contents_len);
-	write_pos += sizeof(uint16_t);
+		ssize_t bytes_sent = file_backed ? sendFileRange(connection) : sendFrames(connection);
+		if (bytes_sent == -1) {
+			if (errno == EINTR) continue;
+			alive = errno == EAGAIN || errno == EWOULDBLOCK;
+			break;
+		}
+
+		consumeOutput(connection, bytes_sent);
+		// A short write means the socket is full for now
+		if (queue->head_offset > 0) break;
+	}
 
-	memcpy(write_pos, contents, contents_len);
-	write_pos += contents_len;
+	if (corked) setCork(connection->socket, false);
+	return alive;
+}
+
+unsigned int startWrite(struct Connection* connection, struct iovec* iovecs, unsigned int max_iovecs) {
+	unsigned int num_iovecs = gatherFrames(&connection->outbound, iovecs, max_iovecs);
+	connection->outbound.pinned = num_iovecs;
+	return num_iovecs;
+}
+
+void finishWrite(struct Connection* connection, size_t bytes_sent) {
+	connection->outbound.pinned = 0;
+	consumeOutput(connection, bytes_sent);
+}
+
+// Queues and flushes a segment built for one of the `sendSegment_*`, passing
+// it through the connection's compressor if it has one
+static bool sendFrame(struct Connection* connection, struct Frame* frame) {
+	if (frame == NULL) return false;
+
+	if (connection->compressor != NULL) {
+		struct DynamicArray compressed = DynamicArray_new(sizeof(struct Frame*), 1);
+		Compressor_compress(connection->compressor, &frame, 1, &compressed);
+		struct Frame** frames = compressed.data;
+		for (size_t i = 0; i < compressed.num_elements; i++) {
+			queueFrame(connection, frames[i]);
+			Frame_release(frames[i]);
+		}
+		DynamicArray_free(&compressed);
+	} else {
+		queueFrame(connection, frame);
+	}
 
-	size_t total_bytes = write_pos - (void*)bfr;
+	Frame_release(frame);
+	flushConnection(connection);
+	return true;
+}
+
+bool sendSegment_Status(struct Connection* connection, char* status) {
+	return sendFrame(connection, Frame_newStatus(status, strlen(status)));
+}
+
+bool sendSegment_Message(struct Connection* connection, char* sender, char* contents) {
+	return sendFrame(connection, Frame_newMessage(0, sender, strlen(sender), contents, strlen(contents)));
+}
+
+bool sendSegment_Pong(struct Connection* connection, uint64_t token) {
+	return sendFrame(connection, Frame_newPong(token));
+}
+
+bool sendSegment_Join(struct Connection* connection, char* room) {
+	return sendFrame(connection, Frame_newRoom(SEGMENT_JOIN, room, strlen(room)));
+}
+
+bool sendSegment_Leave(struct Connection* connection, char* room) {
+	return sendFrame(connection, Frame_newRoom(SEGMENT_LEAVE, room, strlen(room)));
+}
+
+bool sendSegment_RoomMessage(struct Connection* connection, char* room, char* sender, char* contents) {
+	return sendFrame(connection, Frame_newRoomMessage(room, strlen(room), sender, strlen(sender), contents, strlen(contents)));
+}
+
+bool sendSegment_Nick(struct Connection* connection, char* nick) {
+	return sendFrame(connection, Frame_newNick(nick, strlen(nick)));
+}
 
-	sendBulk(connection, bfr, total_bytes);
+bool sendSegment_Direct(struct Connection* connection, char* nick, char* contents) {
+	return sendFrame(connection, Frame_newDirect(nick, strlen(nick), contents, strlen(contents)));
 }
@@ -0,0 +1,33 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ratelimit.h"
+
+void initTokenBucket(struct TokenBucket* bucket, uint64_t rate, uint64_t burst, uint64_t now_ns) {
+	bucket->rate = rate;
+	bucket->burst = burst;
+	bucket->tokens = burst;
+	bucket->refilled_ns = now_ns;
+}
+
+bool TokenBucket_has(struct TokenBucket* bucket, uint64_t amount, uint64_t now_ns) {
+	if (bucket->rate == 0) return true;
+
+	if (now_ns > bucket->refilled_ns) {
+		bucket->tokens += (double)(now_ns - bucket->refilled_ns) * bucket->rate / 1e9;
+		if (bucket->tokens > bucket->burst) bucket->tokens = bucket->burst;
+		bucket->refilled_ns = now_ns;
+	}
+	return bucket->tokens >= amount;
+}
+
+void TokenBucket_take(struct TokenBucket* bucket, uint64_t amount) {
+	if (bucket->rate == 0) return;
+	bucket->tokens -= amount;
+}
+
+uint64_t TokenBucket_waitNs(const struct TokenBucket* bucket, uint64_t amount) {
+	if (bucket->rate == 0 || bucket->tokens >= amount) return 0;
+	// Rounded up, so that the wait is never cut short
+	return (uint64_t)((amount - bucket->tokens) * 1e9 / bucket->rate) + 1;
+}
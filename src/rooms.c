@@ -0,0 +1,53 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "rooms.h"
+
+void initRooms(struct Rooms* rooms) {
+	initHashIndex(&rooms->index);
+}
+
+struct Room* Rooms_find(struct Rooms* rooms, const char* name, size_t name_len) {
+	return HashIndex_get(&rooms->index, name, name_len);
+}
+
+struct Membership* Rooms_join(struct Rooms* rooms, const char* name, size_t name_len, void* member) {
+	struct Room* room = Rooms_find(rooms, name, name_len);
+	if (room == NULL) {
+		room = malloc(sizeof(struct Room));
+		memcpy(room->name, name, name_len);
+		room->name_len = name_len;
+		room->members = DynamicArray_new(sizeof(struct Membership*), 4);
+		HashIndex_insert(&rooms->index, room->name, room->name_len, room);
+	}
+
+	struct Membership* membership = malloc(sizeof(struct Membership));
+	membership->room = room;
+	membership->member = member;
+	membership->index = room->members.num_elements;
+	DynamicArray_push(&room->members, &membership);
+	return membership;
+}
+
+void Rooms_leave(struct Rooms* rooms, struct Membership* membership) {
+	struct Room* room = membership->room;
+	unsigned int index = membership->index;
+	free(membership);
+
+	// The last member fills the gap
+	DynamicArray_remove(&room->members, index);
+	if (index < room->members.num_elements) {
+		struct Membership** members = room->members.data;
+		members[index]->index = index;
+	}
+
+	if (room->members.num_elements == 0) {
+		HashIndex_remove(&rooms->index, room->name, room->name_len);
+		DynamicArray_free(&room->members);
+		free(room);
+	}
+}
+
+void cleanupRooms(struct Rooms* rooms) {
+	cleanupHashIndex(&rooms->index);
+}
@@ -0,0 +1,175 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "screen.h"
+
+#define DEFAULT_WIDTH 80
+#define DEFAULT_HEIGHT 15
+#define MAX_ESCAPE_LENGTH 32
+
+#define messageRows(screen) ((screen)->height > 2 ? (screen)->height - 2 : 1)
+
+static void appendFrame(struct Screen* screen, const char* data, size_t length) {
+	if (screen->frame_length + length > screen->frame_capacity) {
+		size_t new_capacity = screen->frame_capacity == 0 ? 4096 : screen->frame_capacity;
+		while (new_capacity < screen->frame_length + length) new_capacity *= 2;
+		screen->frame = realloc(screen->frame, new_capacity);
+		screen->frame_capacity = new_capacity;
+	}
+
+	memcpy(screen->frame + screen->frame_length, data, length);
+	screen->frame_length += length;
+}
+
+static void appendEscape(struct Screen* screen, const char* format, unsigned int argument) {
+	char escape[MAX_ESCAPE_LENGTH];
+	int length = snprintf(escape, sizeof(escape), format, argument);
+	appendFrame(screen, escape, length);
+}
+
+static void allocateRows(struct Screen* screen) {
+	unsigned int rows = messageRows(screen);
+	screen->row_capacity = screen->width * 4;
+	screen->rows = realloc(screen->rows, rows * screen->row_capacity);
+	screen->row_lengths = realloc(screen->row_lengths, rows * sizeof(size_t));
+	screen->damaged = realloc(screen->damaged, rows * sizeof(bool));
+
+	for (unsigned int i = 0; i < rows; i++) {
+		screen->row_lengths[i] = 0;
+		screen->damaged[i] = true;
+	}
+	screen->cleared = true;
+}
+
+struct Screen newScreen(int fd) {
+	struct Screen new = {0};
+	new.fd = fd;
+	Screen_resize(&new);
+	return new;
+}
+
+void Screen_resize(struct Screen* screen) {
+	struct winsize size;
+	if (ioctl(screen->fd, TIOCGWINSZ, &size) == 0 && size.ws_col > 0 && size.ws_row > 0) {
+		screen->width = size.ws_col;
+		screen->height = size.ws_row;
+	} else {
+		screen->width = DEFAULT_WIDTH;
+		screen->height = DEFAULT_HEIGHT;
+	}
+
+	allocateRows(screen);
+}
+
+unsigned int Screen_messageRows(const struct Screen* screen) {
+	return messageRows(screen);
+}
+
+// Finds where `message` wraps, counting UTF-8 continuation bytes as part of
+// the column they continue. No character is more than 4 bytes long, so a
+// continuation byte past the third in a row, or one that would start a row,
+// takes a column of its own; that keeps every row within `row_capacity`
+// whatever bytes the message holds. Returns the number of rows it occupies.
+static size_t wrapMessage(struct Screen* screen, const char* message, size_t length) {
+	size_t num_breaks = 0;
+	size_t column = 0;
+	unsigned int continued = 0;
+	for (size_t i = 0; i <= length; i++) {
+		bool continuation = i < length && (message[i] & 0xC0) == 0x80;
+		bool starts_column = i < length && (!continuation || continued == 3 || column == 0);
+		if (i == 0 || (starts_column && column == screen->width)) {
+			if (num_breaks == screen->breaks_capacity) {
+				screen->breaks_capacity = screen->breaks_capacity == 0 ? 16 : screen->breaks_capacity * 2;
+				screen->breaks = realloc(screen->breaks, screen->breaks_capacity * sizeof(size_t));
+			}
+			screen->breaks[num_breaks++] = i;
+			column = 0;
+		}
+		if (starts_column) {
+			column++;
+			continued = 0;
+		} else {
+			continued++;
+		}
+	}
+
+	return num_breaks;
+}
+
+static void setRow(struct Screen* screen, unsigned int row, const char* data, size_t length) {
+	char* current = screen->rows + row * screen->row_capacity;
+	if (screen->row_lengths[row] == length && memcmp(current, data, length) == 0) return;
+
+	memcpy(current, data, length);
+	screen->row_lengths[row] = length;
+	screen->damaged[row] = true;
+}
+
+void Screen_drawMessages(struct Screen* screen, MessageSource source, void* context) {
+	unsigned int rows = messageRows(screen);
+	unsigned int row = rows;
+	const char* message;
+	size_t length;
+
+	for (size_t n = 0; row > 0 && (message = source(context, n, &length)) != NULL; n++) {
+		size_t num_breaks = wrapMessage(screen, message, length);
+		for (size_t i = num_breaks; i > 0 && row > 0; i--) {
+			size_t start = screen->breaks[i-1];
+			size_t end = i < num_breaks ? screen->breaks[i] : length;
+			setRow(screen, --row, message + start, end - start);
+		}
+	}
+
+	while (row > 0)
+		setRow(screen, --row, NULL, 0);
+}
+
+void Screen_flush(struct Screen* screen) {
+	unsigned int rows = messageRows(screen);
+	screen->frame_length = 0;
+
+	if (screen->cleared) {
+		appendFrame(screen, "\x1b[2J", 4);
+	} else {
+		// Keep the cursor where the user is typing
+		appendFrame(screen, "\x1b" "7", 2);
+	}
+
+	for (unsigned int row = 0; row < rows; row++) {
+		if (!screen->damaged[row]) continue;
+		appendEscape(screen, "\x1b[%u;1H", row + 1);
+		appendFrame(screen, screen->rows + row * screen->row_capacity, screen->row_lengths[row]);
+		appendFrame(screen, "\x1b[K", 3);
+		screen->damaged[row] = false;
+	}
+
+	if (screen->cleared) {
+		appendEscape(screen, "\x1b[%u;1H", screen->height);
+		screen->cleared = false;
+	} else {
+		appendFrame(screen, "\x1b" "8", 2);
+	}
+
+	// Nothing but the cursor save and restore means nothing changed
+	if (screen->frame_length == 4) return;
+
+	size_t total_written = 0;
+	while (total_written < screen->frame_length) {
+		ssize_t written = write(screen->fd, screen->frame + total_written, screen->frame_length - total_written);
+		if (written <= 0) break;
+		total_written += written;
+	}
+}
+
+void cleanupScreen(struct Screen* screen) {
+	free(screen->rows);
+	free(screen->row_lengths);
+	free(screen->damaged);
+	free(screen->breaks);
+	free(screen->frame);
+}
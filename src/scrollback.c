@@ -0,0 +1,79 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scrollback.h"
+
+// Bytes kept per line on average when sizing the chunk ring
+#define EXPECTED_LINE_LENGTH 64
+
+#define chunkOf(scrollback, offset) ((scrollback)->chunks[((offset) / SCROLLBACK_CHUNK_SIZE) % (scrollback)->num_chunks])
+#define lineAt(scrollback, index) (&(scrollback)->lines[(index) % (scrollback)->max_lines])
+
+struct Scrollback newScrollback(size_t max_lines) {
+	struct Scrollback new = {0};
+	if (max_lines == 0) max_lines = 1;
+
+	new.max_lines = max_lines;
+	new.lines = malloc(max_lines * sizeof(struct ScrollbackLine));
+
+	new.num_chunks = (max_lines * EXPECTED_LINE_LENGTH + SCROLLBACK_CHUNK_SIZE - 1) / SCROLLBACK_CHUNK_SIZE;
+	if (new.num_chunks < 2) new.num_chunks = 2;
+	// Chunks are only allocated when first written to
+	new.chunks = calloc(new.num_chunks, sizeof(char*));
+
+	return new;
+}
+
+// Drops the oldest chunk and every line starting in it
+static void evictChunk(struct Scrollback* scrollback) {
+	scrollback->start += SCROLLBACK_CHUNK_SIZE;
+	while (scrollback->num_lines > 0 && lineAt(scrollback, scrollback->first_line)->offset < scrollback->start) {
+		scrollback->first_line++;
+		scrollback->num_lines--;
+	}
+}
+
+void Scrollback_append(struct Scrollback* scrollback, const char* line, size_t length) {
+	if (length > SCROLLBACK_MAX_LINE) length = SCROLLBACK_MAX_LINE;
+
+	uint64_t offset = scrollback->end;
+	size_t chunk_used = offset % SCROLLBACK_CHUNK_SIZE;
+	if (chunk_used + length > SCROLLBACK_CHUNK_SIZE)
+		offset += SCROLLBACK_CHUNK_SIZE - chunk_used;
+
+	uint64_t limit = scrollback->start + (uint64_t)scrollback->num_chunks * SCROLLBACK_CHUNK_SIZE;
+	while (offset + length > limit) {
+		evictChunk(scrollback);
+		limit += SCROLLBACK_CHUNK_SIZE;
+	}
+	if (scrollback->num_lines == scrollback->max_lines)
+		evictChunk(scrollback);
+	// Line eviction can leave the start behind the line being written
+	if (scrollback->num_lines == 0) scrollback->start = offset - offset % SCROLLBACK_CHUNK_SIZE;
+
+	char** chunk = &chunkOf(scrollback, offset);
+	if (*chunk == NULL) *chunk = malloc(SCROLLBACK_CHUNK_SIZE);
+	memcpy(*chunk + offset % SCROLLBACK_CHUNK_SIZE, line, length);
+
+	struct ScrollbackLine* entry = lineAt(scrollback, scrollback->first_line + scrollback->num_lines);
+	entry->offset = offset;
+	entry->length = length;
+	scrollback->num_lines++;
+	scrollback->end = offset + length;
+}
+
+const char* Scrollback_get(struct Scrollback* scrollback, size_t n, size_t* length) {
+	if (n >= scrollback->num_lines) return NULL;
+
+	struct ScrollbackLine* entry = lineAt(scrollback, scrollback->first_line + scrollback->num_lines - 1 - n);
+	*length = entry->length;
+	return chunkOf(scrollback, entry->offset) + entry->offset % SCROLLBACK_CHUNK_SIZE;
+}
+
+void cleanupScrollback(struct Scrollback* scrollback) {
+	for (size_t i = 0; i < scrollback->num_chunks; i++)
+		free(scrollback->chunks[i]);
+	free(scrollback->chunks);
+	free(scrollback->lines);
+}
@@ -1,3 +1,7 @@
+#define _GNU_SOURCE
+
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -7,169 +11,2483 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
-#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include "dyn_arr.h"
 
+#include "handoff.h"
+#include "hash_index.h"
+#include "journal.h"
+#include "logger.h"
+#include "metrics.h"
+#include "mpsc_queue.h"
 #include "networking.h"
+#include "ratelimit.h"
+#include "rooms.h"
+#include "slab.h"
+#include "timer_wheel.h"
+#include "uring.h"
 
 #include "server.h"
 
-struct ServerState {
-	mtx_t mutex;
+#define MAX_EVENTS 64
+// Journal bytes queued on a connection at a time while replaying history
+#define REPLAY_CHUNK_SIZE (32 * 1024)
+// Messages before a resuming client's newest that are sent again, in case it
+// was still missing some that other workers delivered out of order
+#define RESUME_SLACK 64
+// ProtocolFeature flags the server can use with clients that support them
+#define SERVER_FEATURES (FEATURE_BATCH | FEATURE_DEFLATE | FEATURE_HEARTBEAT | FEATURE_ROOMS | FEATURE_NICKNAMES)
+// Most rooms a client may be in at once
+#define MAX_CLIENT_ROOMS 32
+// Segments handled for one client per tick before the others get their turn
+#define READ_BUDGET 64
+
+// Sentinel epoll data values for the per-worker sockets that are not clients
+#define EVENT_LISTENER ((void*)0)
+#define EVENT_WAKE ((void*)1)
+
+// Sizes for the io_uring backend: each worker's submission queue, the buffers
+// it reads connections into, and the most frames gathered into one write
+#define URING_ENTRIES 1024
+#define URING_BUFFER_COUNT 256
+#define URING_BUFFER_SIZE (16 * 1024)
+#define URING_BUFFER_GROUP 0
+#define URING_SEND_IOVECS 16
+// Longest time spent writing the shutdown notice before connections are closed
+#define URING_SHUTDOWN_MS 1000
+
+// What an io_uring completion is for, kept in the low bits of its user data.
+// Those for a client carry a pointer to it in the remaining bits.
+enum UringOperation {
+	URING_RECEIVE,
+	URING_SEND,
+	URING_WRITABLE,
+	URING_ACCEPT,
+	URING_WAKE,
+	URING_TIMEOUT,
+	URING_CANCEL,
+};
+#define URING_OPERATION_MASK 7
+
+// What a timer on a worker's wheel is for
+enum TimerKind {
+	// A client's `idle_timer`, see `checkIdle`
+	TIMER_IDLE,
+	// A deferred client's `resume_timer`
+	TIMER_RESUME,
+	// The worker's `flush_timer`, for broadcasts being held back
+	TIMER_FLUSH,
+};
+#define clientOf(timer, field) ((struct Client*)((char*)(timer) - offsetof(struct Client, field)))
+
+// A nickname registered by a client, and how to reach the client: the worker
+// it belongs to and its ID there. Owned by the client while it holds the
+// nickname, and listed in `ServerState.nicknames` for as long.
+struct Nickname {
+	char name[NICKNAME_MAX];
+	size_t name_len;
+	unsigned int worker;
+	uint64_t client_id;
+};
+
+// A connection as tracked by the server. `id` names the client within
+// `Worker.clients` until it is freed, and is never reused for another.
+// Clients are never removed while a tick is in progress; `closing` marks a
+// client that will be removed once the current batch of events is handled.
+struct Client {
+	struct Connection connection;
+	uint64_t id;
+	bool closing;
+	// Set once the client's SEGMENT_HELLO has been answered. Nothing else is
+	// sent to the client, or accepted from it, before then.
+	bool greeted;
+	// Set while the client is sent the worker's shared compressed stream of
+	// broadcasts. Clients that agreed to FEATURE_DEFLATE join it the next
+	// time it starts over.
+	bool attached;
+	// Sequence number of the first message broadcast after this client joined
+	uint64_t joined_seq;
+	// struct Membership*, one for each room the client is in
+	struct DynamicArray rooms;
+	// NULL until the client registers a nickname
+	struct Nickname* nickname;
+	// Set while listed in `Worker.unsent`
+	bool unsent;
+	// Limits on how fast the client may send
+	struct TokenBucket segment_bucket;
+	struct TokenBucket byte_bucket;
+	// The tick the client last handled segments in, and how many more it may
+	// handle during it
+	uint64_t read_tick;
+	unsigned int read_budget;
+	// Set while the client waits for its turn to carry on reading, listed in
+	// `Worker.ready` or, until it may, on `resume_timer`
+	bool deferred;
+	struct Timer resume_timer;
+	// Checks for the client going quiet. `heard_bytes` is how much it had sent
+	// as of the last check, and `ping_pending` is set while a SEGMENT_PING
+	// sent on finding it quiet is unanswered.
+	struct Timer idle_timer;
+	uint64_t heard_bytes;
+	bool ping_pending;
+	// Only used with io_uring. The client stays allocated, even once removed,
+	// until none of its `operations` are in flight. `writing` is set while one
+	// of them writes its output or waits for room to, and `receiving` while
+	// one reads the socket, which is cancelled whenever the client is listed
+	// in `Worker.ready`. Bytes read that do not fit in the connection's buffer
+	// wait in `backlog`.
+	unsigned int operations;
+	bool removed;
+	bool writing;
+	bool receiving;
+	bool cancelling;
+	unsigned char* backlog;
+	size_t backlog_length;
+	size_t backlog_capacity;
+	struct iovec iovecs[URING_SEND_IOVECS];
+	struct msghdr message;
+	// Messages still to be replayed, from `next_seq` up to but not including
+	// `end_seq`, and how many so far were no longer available
+	struct {
+		uint64_t next_seq;
+		uint64_t end_seq;
+		uint64_t missed;
+	} replay;
+	// The connection's totals as of the last time they were folded into the
+	// worker's metrics
+	struct {
+		uint64_t bytes_received;
+		uint64_t bytes_sent;
+		size_t queued_bytes;
+		size_t dropped_frames;
+	} synced;
+};
+
+// A frame relayed to the other workers. A single allocation carries one queue
+// node per receiving worker, followed by the name of the room the frame is
+// for, if any, and is freed by whichever worker drops the last reference. The
+// frame itself is shared, not copied.
+struct Broadcast;
+struct BroadcastNode {
+	struct MPSCNode node;
+	struct Broadcast* broadcast;
+};
+struct Broadcast {
+	atomic_uint refs;
+	uint64_t seq;
+	struct Frame* frame;
+	// NULL for a message to everyone
+	char* room;
+	size_t room_len;
+	// For a direct message, the ID of the client it is for, otherwise 0
+	uint64_t client_id;
+	struct BroadcastNode nodes[];
+};
+
+// A slot of a worker's retransmit window, which holds the most recent messages
+// broadcast by any worker, each in the slot its sequence number maps to
+struct WindowSlot {
+	uint64_t seq;
+	struct Frame* frame;
+};
+
+struct ServerState;
+
+// Each worker owns a shard of the connections: its own SO_REUSEPORT listening
+// socket, epoll instance and client list. Nothing in here is touched by other
+// threads except `inbox` and `wake_fd`, through which broadcasts are relayed,
+// and `metrics`, which the stats thread reads.
+struct Worker {
+	unsigned int id;
+	struct ServerState* state;
+	thrd_t thread;
 	int sfd_receiver;
-	bool shutdown;
-	struct DynamicArray connections;
+	int epoll_fd;
+	int wake_fd;
+	atomic_bool wake_pending;
+	struct MPSCQueue inbox;
+	struct Slab clients;
+	struct DynamicArray closing;
+	// Which of the worker's clients are in each room. Rooms span workers, so
+	// each worker indexes only its own share of a room's members.
+	struct Rooms rooms;
+	// Frames of the messages broadcast during the current tick, and scratch
+	// space for packing them into batches
+	struct DynamicArray outgoing;
+	struct DynamicArray batches;
+	// Broadcasts compressed once for every client attached to the stream.
+	// `compressed` is scratch space like `batches`, and `attach_pending` asks
+	// for the stream to start over so that waiting clients can attach.
+	struct Compressor compressor;
+	bool compressor_ready;
+	struct DynamicArray compressed;
+	bool attach_pending;
+	struct WindowSlot* window;
+	// When the oldest of `outgoing` was queued, and the bytes of all of them
+	uint64_t outgoing_since_ns;
+	size_t outgoing_bytes;
+	// Timers for the worker and its clients, advanced once per tick
+	struct TimerWheel timers;
+	struct Timer flush_timer;
+	// Clients whose output is written once the tick's events have been handled
+	struct DynamicArray unsent;
+	// Ticks are numbered so that clients know when their read budget is due
+	// again. `ready` lists the deferred clients that may carry on reading, and
+	// `serving` is scratch space for going through them.
+	uint64_t tick;
+	struct DynamicArray ready;
+	struct DynamicArray serving;
+	// Set when the worker runs on io_uring rather than epoll, see `uringLoop`.
+	// `operations` and `writes` count those in flight on behalf of clients.
+	bool uring;
+	struct Uring ring;
+	struct BufferRing buffers;
+	unsigned int operations;
+	unsigned int writes;
+	bool accepting;
+	bool shutdown_expired;
+	// Set once the worker has stopped to hand its clients over to another
+	// process, see `quiesce`
+	bool handing_off;
+	struct Metrics metrics;
+};
+
+struct ServerState {
+	const struct ServerConfig* config;
+	atomic_bool shutdown;
+	// Sequence number of the next message to be broadcast
+	_Atomic uint64_t next_seq;
+	unsigned int num_workers;
+	struct Worker* workers;
+	int sfd_stats;
+	thrd_t stats_thread;
+	// Where the next server connects to take over from this one, and that
+	// connection once it has, or -1
+	int sfd_handoff;
+	thrd_t handoff_thread;
+	int successor;
+	// NULL when not journaling
+	struct Journal* journal;
+	// struct Nickname*, by name, across every worker's clients
+	mtx_t nicknames_lock;
+	struct HashIndex nicknames;
 };
 
-static void acceptLoop(struct ServerState* state) {
-	unsigned int next_id = 0;
-	while(true) {
-		int socket = accept(state->sfd_receiver, NULL, NULL);
-		if (state->shutdown) break;
+static void wakeWorker(struct Worker* worker) {
+	// Only the first producer since the last drain pays for the syscall
+	if (atomic_exchange_explicit(&worker->wake_pending, true, memory_order_acq_rel)) return;
+	uint64_t value = 1;
+	write(worker->wake_fd, &value, sizeof(value));
+}
+
+// Folds whatever has changed on a client's connection since the last call
+// into the worker's metrics
+static void syncClientMetrics(struct Worker* worker, struct Client* client) {
+	struct Connection* connection = &client->connection;
+	struct Metrics* metrics = &worker->metrics;
+
+	Metrics_count(metrics, COUNTER_BYTES_IN, connection->bytes_received - client->synced.bytes_received);
+	Metrics_count(metrics, COUNTER_BYTES_OUT, connection->bytes_sent - client->synced.bytes_sent);
+	Metrics_count(metrics, COUNTER_DROPPED_FRAMES, connection->outbound.dropped_frames - client->synced.dropped_frames);
+	Metrics_adjust(metrics, GAUGE_QUEUED_BYTES, (int64_t)connection->outbound.bytes - (int64_t)client->synced.queued_bytes);
+
+	client->synced.bytes_received = connection->bytes_received;
+	client->synced.bytes_sent = connection->bytes_sent;
+	client->synced.dropped_frames = connection->outbound.dropped_frames;
+	client->synced.queued_bytes = connection->outbound.bytes;
+}
+
+static void leaveRooms(struct Worker* worker, struct Client* client) {
+	struct Membership** rooms = client->rooms.data;
+	for (size_t i = 0; i < client->rooms.num_elements; i++)
+		Rooms_leave(&worker->rooms, rooms[i]);
+	DynamicArray_clear(&client->rooms);
+}
+
+static void releaseNickname(struct Worker* worker, struct Client* client) {
+	struct Nickname* nickname = client->nickname;
+	if (nickname == NULL) return;
+
+	struct ServerState* state = worker->state;
+	mtx_lock(&state->nicknames_lock);
+	HashIndex_remove(&state->nicknames, nickname->name, nickname->name_len);
+	mtx_unlock(&state->nicknames_lock);
+	free(nickname);
+	client->nickname = NULL;
+}
+
+static void freeClient(struct Worker* worker, struct Client* client) {
+	cleanupConnection(&client->connection);
+	free(client->backlog);
+	DynamicArray_free(&client->rooms);
+	Slab_remove(&worker->clients, client->id);
+}
+
+static void removeClient(struct Worker* worker, struct Client* client) {
+	syncClientMetrics(worker, client);
+	Metrics_adjust(&worker->metrics, GAUGE_QUEUED_BYTES, -(int64_t)client->synced.queued_bytes);
+	Metrics_adjust(&worker->metrics, GAUGE_CONNECTIONS, -1);
+	Metrics_count(&worker->metrics, COUNTER_DISCONNECTS, 1);
+
+	leaveRooms(worker, client);
+	releaseNickname(worker, client);
+	TimerWheel_cancel(&worker->timers, &client->idle_timer);
+	if (client->deferred) {
+		TimerWheel_cancel(&worker->timers, &client->resume_timer);
+		struct Client** ready = worker->ready.data;
+		for (size_t i = 0; i < worker->ready.num_elements; i++) {
+			if (ready[i] != client) continue;
+			DynamicArray_removeOrdered(&worker->ready, i);
+			break;
+		}
+	}
+
+	// Output queued just before closing, such as the reason for it, was only
+	// listed to be written at the end of the tick, so write what the socket
+	// takes now
+	if (!client->writing && hasPendingOutput(&client->connection))
+		flushConnection(&client->connection);
+
+	// Operations still in flight refer to the client, so it is freed once the
+	// last of them completes, staying among `Worker.clients` as one that is
+	// closing until then. Shutting the socket down ends them sooner.
+	client->removed = true;
+	if (client->operations > 0) shutdown(client->connection.socket, SHUT_RDWR);
+	else freeClient(worker, client);
+}
+
+// Lists the client to have its pending output written once every event of
+// the current tick has been handled, so that everything queued on it during
+// the tick goes out in as few writes as possible. Returns false if the client
+// is already known to have failed.
+static bool flushClient(struct Worker* worker, struct Client* client) {
+	if (!client->unsent && !client->closing) {
+		client->unsent = true;
+		DynamicArray_push(&worker->unsent, &client);
+	}
+	return true;
+}
+
+static bool sendStatus(struct Worker* worker, struct Client* client, char* status, size_t status_len) {
+	struct Frame* frame = Frame_newStatus(status, status_len);
+	bool alive = queueFrame(&client->connection, frame) && flushClient(worker, client);
+	Frame_release(frame);
+	return alive;
+}
+
+static void closeClient(struct Worker* worker, struct Client* client) {
+	if (client->closing) return;
+	client->closing = true;
+	DynamicArray_push(&worker->closing, &client);
+}
+
+static void reapClients(struct Worker* worker) {
+	struct Client** closing = worker->closing.data;
+	for (size_t i = 0; i < worker->closing.num_elements; i++) {
+		logMessage("Connection %u closed, removing\n", closing[i]->connection.socket);
+		removeClient(worker, closing[i]);
+	}
+	DynamicArray_clear(&worker->closing);
+}
+
+static void releaseBroadcast(struct Broadcast* broadcast) {
+	if (atomic_fetch_sub_explicit(&broadcast->refs, 1, memory_order_acq_rel) == 1) {
+		Frame_release(broadcast->frame);
+		free(broadcast);
+	}
+}
+
+static struct Client* newClient(struct Worker* worker, int socket) {
+	uint64_t id;
+	struct Client* client = Slab_insert(&worker->clients, &id);
+	client->id = id;
+	client->connection = newConnection(socket);
+	client->closing = false;
+	client->greeted = false;
+	const struct ServerConfig* config = worker->state->config;
+	setOutboundLimit(&client->connection, config->queue_limit, config->slow_consumer);
+	uint64_t now_ns = Metrics_nowNs();
+	initTokenBucket(&client->segment_bucket, config->rate_segments, config->rate_segments, now_ns);
+	initTokenBucket(&client->byte_bucket, config->rate_bytes, config->rate_bytes, now_ns);
+	client->idle_timer.kind = TIMER_IDLE;
+	client->resume_timer.kind = TIMER_RESUME;
+	client->rooms = DynamicArray_new(sizeof(struct Membership*), 1);
+	return client;
+}
+
+static void addClient(struct Worker* worker, struct Client* client) {
+	// A client that does not say hello within the heartbeat interval is
+	// dropped like one that stops answering pings
+	unsigned int heartbeat_ms = worker->state->config->heartbeat_ms;
+	if (heartbeat_ms > 0)
+		TimerWheel_arm(&worker->timers, &client->idle_timer, Metrics_nowNs() + heartbeat_ms * 1000000ull);
+	Metrics_count(&worker->metrics, COUNTER_ACCEPTS, 1);
+	Metrics_adjust(&worker->metrics, GAUGE_CONNECTIONS, 1);
+	logMessage("Worker %u: connection %u accepted as client %lx\n", worker->id, client->connection.socket, client->id);
+}
+
+// For epoll only. The caller frees the client if its socket cannot be watched.
+static bool watchClient(struct Worker* worker, struct Client* client) {
+	struct epoll_event event = {0};
+	event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	event.data.ptr = client;
+	if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, client->connection.socket, &event) != 0) {
+		logMessage("Unable to watch connection %u: %s\n", client->connection.socket, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+static void acceptConnections(struct Worker* worker) {
+	while (true) {
+		int socket = accept4(worker->sfd_receiver, NULL, NULL, SOCK_NONBLOCK);
 		if (socket == -1) {
-			printf("Error accepting connection: %s\n", strerror(errno));
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			logMessage("Error accepting connection: %s\n", strerror(errno));
+			break;
+		}
+
+		struct Client* client = newClient(worker, socket);
+		if (!watchClient(worker, client)) {
+			freeClient(worker, client);
+			continue;
+		}
+		addClient(worker, client);
+	}
+}
+
+static void broadcastFrame(struct Worker* worker, struct Frame* frame) {
+	uint64_t start_ns = Metrics_nowNs();
+	uint64_t recipients = 0;
+
+	for (size_t i = 0; i < Slab_count(&worker->clients); i++) {
+		struct Client* client = Slab_at(&worker->clients, i);
+		if (client->closing || !client->greeted) continue;
+
+		if (!queueFrame(&client->connection, frame) || !flushClient(worker, client))
+			closeClient(worker, client);
+		syncClientMetrics(worker, client);
+		recipients++;
+	}
+
+	Metrics_countSegmentOut(&worker->metrics, frame->data[0], recipients);
+	Histogram_record(&worker->metrics.fanout_time, Metrics_nowNs() - start_ns);
+}
+
+// Queues a message on every client at the end of the tick, with the rest of
+// the tick's broadcasts
+static void queueBroadcast(struct Worker* worker, struct Frame* frame) {
+	if (worker->outgoing.num_elements == 0) {
+		worker->outgoing_since_ns = Metrics_nowNs();
+		worker->outgoing_bytes = 0;
+		// Wakes the worker to write them, if nothing else does first
+		unsigned int coalesce_us = worker->state->config->coalesce_us;
+		if (coalesce_us > 0)
+			TimerWheel_arm(&worker->timers, &worker->flush_timer, worker->outgoing_since_ns + coalesce_us * 1000ull);
+	}
+	Frame_ref(frame);
+	DynamicArray_push(&worker->outgoing, &frame);
+	worker->outgoing_bytes += frame->length;
+}
+
+// Whether the broadcasts held back by the coalescing window must be written
+// now: once the window has passed, or as soon as they would fill a batch,
+// since waiting longer saves nothing, or when shutting down. `flush_timer`
+// wakes the worker for the window ending.
+static bool broadcastsDue(struct Worker* worker) {
+	if (worker->outgoing.num_elements == 0) return false;
+
+	uint64_t window_ns = (uint64_t)worker->state->config->coalesce_us * 1000;
+	if (Metrics_nowNs() - worker->outgoing_since_ns >= window_ns || worker->outgoing_bytes >= SEGMENT_MAX_LENGTH) return true;
+	return atomic_load_explicit(&worker->state->shutdown, memory_order_acquire);
+}
+
+// Queues the messages broadcast during this tick on every client and writes
+// each client's output once. Clients that accept SEGMENT_BATCH get them
+// packed into as few batches as they fit in, which are built only once.
+static void flushBroadcasts(struct Worker* worker) {
+	if (!broadcastsDue(worker)) return;
+	TimerWheel_cancel(&worker->timers, &worker->flush_timer);
+	size_t num_frames = worker->outgoing.num_elements;
+	struct Frame** frames = worker->outgoing.data;
+	uint64_t start_ns = Metrics_nowNs();
+	uint64_t recipients = 0;
+	uint64_t batch_recipients = 0;
+	uint64_t compressed_recipients = 0;
+
+	// Clients can only attach where the stream starts over
+	bool restarted = worker->attach_pending;
+	if (restarted) {
+		Compressor_restart(&worker->compressor);
+		worker->attach_pending = false;
+	}
+	uint64_t compressed_in = worker->compressor.bytes_in;
+	uint64_t compressed_out = worker->compressor.bytes_out;
+
+	for (size_t i = 0; i < Slab_count(&worker->clients); i++) {
+		struct Client* client = Slab_at(&worker->clients, i);
+		if (client->closing || !client->greeted) continue;
+		struct Connection* connection = &client->connection;
+
+		struct Frame** queued = frames;
+		size_t num_queued = num_frames;
+		if ((connection->features & FEATURE_DEFLATE) && (client->attached || restarted)) {
+			// Every attached client is sent every piece, so it is compressed
+			// the first time any of them needs it
+			if (worker->compressed.num_elements == 0)
+				Compressor_compress(&worker->compressor, frames, num_frames, &worker->compressed);
+			client->attached = true;
+			queued = worker->compressed.data;
+			num_queued = worker->compressed.num_elements;
+			compressed_recipients++;
+		} else if ((connection->features & FEATURE_BATCH) && num_frames > 1) {
+			if (worker->batches.num_elements == 0) {
+				for (size_t packed = 0; packed < num_frames;) {
+					size_t count;
+					struct Frame* batch = Frame_newBatch(frames + packed, num_frames - packed, &count);
+					DynamicArray_push(&worker->batches, &batch);
+					packed += count;
+				}
+			}
+			queued = worker->batches.data;
+			num_queued = worker->batches.num_elements;
+			batch_recipients++;
+		}
+
+		bool alive = true;
+		for (size_t j = 0; j < num_queued && alive; j++)
+			alive = queueFrame(connection, queued[j]);
+		if (!alive || !flushClient(worker, client))
+			closeClient(worker, client);
+		syncClientMetrics(worker, client);
+		recipients++;
+	}
+
+	Metrics_countSegmentOut(&worker->metrics, SEGMENT_MESSAGE, num_frames * recipients);
+	Metrics_countSegmentOut(&worker->metrics, SEGMENT_BATCH, worker->batches.num_elements * batch_recipients);
+	Metrics_countSegmentOut(&worker->metrics, SEGMENT_COMPRESSED, worker->compressed.num_elements * compressed_recipients);
+	Metrics_count(&worker->metrics, COUNTER_COMPRESSOR_IN, worker->compressor.bytes_in - compressed_in);
+	Metrics_count(&worker->metrics, COUNTER_COMPRESSOR_OUT, worker->compressor.bytes_out - compressed_out);
+	Histogram_record(&worker->metrics.fanout_time, Metrics_nowNs() - start_ns);
+
+	struct Frame** batches = worker->batches.data;
+	for (size_t i = 0; i < worker->batches.num_elements; i++)
+		Frame_release(batches[i]);
+	DynamicArray_clear(&worker->batches);
+	struct Frame** compressed = worker->compressed.data;
+	for (size_t i = 0; i < worker->compressed.num_elements; i++)
+		Frame_release(compressed[i]);
+	DynamicArray_clear(&worker->compressed);
+	for (size_t i = 0; i < num_frames; i++)
+		Frame_release(frames[i]);
+	DynamicArray_clear(&worker->outgoing);
+}
+
+// Queues a frame on each of the worker's clients in a room, which are written
+// at the end of the tick with the rest of their output
+static void sendToRoom(struct Worker* worker, struct Room* room, struct Frame* frame) {
+	uint64_t start_ns = Metrics_nowNs();
+	uint64_t recipients = 0;
+
+	struct Membership** members = room->members.data;
+	for (size_t i = 0; i < room->members.num_elements; i++) {
+		struct Client* client = members[i]->member;
+		if (client->closing) continue;
+
+		if (!queueFrame(&client->connection, frame) || !flushClient(worker, client))
+			closeClient(worker, client);
+		syncClientMetrics(worker, client);
+		recipients++;
+	}
+
+	Metrics_countSegmentOut(&worker->metrics, frame->data[0], recipients);
+	Histogram_record(&worker->metrics.fanout_time, Metrics_nowNs() - start_ns);
+}
+
+// Queues a frame on one of the worker's clients, if it is still connected
+static void sendToClient(struct Worker* worker, uint64_t client_id, struct Frame* frame) {
+	struct Client* client = Slab_get(&worker->clients, client_id);
+	if (client == NULL || client->closing) return;
+
+	if (!queueFrame(&client->connection, frame) || !flushClient(worker, client))
+		closeClient(worker, client);
+	syncClientMetrics(worker, client);
+	Metrics_countSegmentOut(&worker->metrics, frame->data[0], 1);
+}
+
+static void broadcastStatus(struct Worker* worker, char* status) {
+	struct Frame* frame = Frame_newStatus(status, strlen(status));
+	broadcastFrame(worker, frame);
+	Frame_release(frame);
+}
+
+static void rememberFrame(struct Worker* worker, uint64_t seq, struct Frame* frame) {
+	unsigned int window_size = worker->state->config->retransmit_window;
+	if (window_size == 0) return;
+
+	struct WindowSlot* slot = &worker->window[seq % window_size];
+	if (slot->frame != NULL) Frame_release(slot->frame);
+	slot->seq = seq;
+	slot->frame = Frame_ref(frame);
+}
+
+static struct Frame* windowFrame(struct Worker* worker, uint64_t seq) {
+	unsigned int window_size = worker->state->config->retransmit_window;
+	if (window_size == 0) return NULL;
+
+	struct WindowSlot* slot = &worker->window[seq % window_size];
+	return slot->frame != NULL && slot->seq == seq ? slot->frame : NULL;
+}
+
+// Hands a frame to every other worker so it reaches their shards as well.
+// Frames for a room, named by `room`, reach only its members there.
+static void relayFrame(struct Worker* worker, struct Frame* frame, uint64_t seq, char* room, size_t room_len) {
+	struct ServerState* state = worker->state;
+	unsigned int num_targets = state->num_workers - 1;
+	if (num_targets == 0) return;
+
+	size_t nodes_size = sizeof(struct BroadcastNode) * num_targets;
+	struct Broadcast* broadcast = malloc(sizeof(struct Broadcast) + nodes_size + room_len);
+	atomic_init(&broadcast->refs, num_targets);
+	broadcast->seq = seq;
+	broadcast->frame = Frame_ref(frame);
+	broadcast->room = NULL;
+	broadcast->room_len = room_len;
+	broadcast->client_id = 0;
+	if (room != NULL) {
+		broadcast->room = (char*)broadcast->nodes + nodes_size;
+		memcpy(broadcast->room, room, room_len);
+	}
+
+	unsigned int node_index = 0;
+	for (unsigned int i = 0; i < state->num_workers; i++) {
+		struct Worker* target = &state->workers[i];
+		if (target == worker) continue;
+
+		struct BroadcastNode* node = &broadcast->nodes[node_index++];
+		node->broadcast = broadcast;
+		MPSCQueue_push(&target->inbox, &node->node);
+		wakeWorker(target);
+	}
+}
+
+// Hands a frame to the worker that owns a client, for that client alone
+static void relayDirect(struct Worker* target, uint64_t client_id, struct Frame* frame) {
+	struct Broadcast* broadcast = malloc(sizeof(struct Broadcast) + sizeof(struct BroadcastNode));
+	atomic_init(&broadcast->refs, 1);
+	broadcast->seq = 0;
+	broadcast->frame = Frame_ref(frame);
+	broadcast->room = NULL;
+	broadcast->room_len = 0;
+	broadcast->client_id = client_id;
+	broadcast->nodes[0].broadcast = broadcast;
+	MPSCQueue_push(&target->inbox, &broadcast->nodes[0].node);
+	wakeWorker(target);
+}
+
+static void drainInbox(struct Worker* worker) {
+	uint64_t value;
+	read(worker->wake_fd, &value, sizeof(value));
+	// Cleared before draining so a push racing with the drain wakes us again
+	atomic_store_explicit(&worker->wake_pending, false, memory_order_release);
+
+	struct MPSCNode* node;
+	while ((node = MPSCQueue_pop(&worker->inbox)) != NULL) {
+		struct Broadcast* broadcast = ((struct BroadcastNode*)node)->broadcast;
+		if (broadcast->client_id != 0) {
+			sendToClient(worker, broadcast->client_id, broadcast->frame);
+		} else if (broadcast->room != NULL) {
+			struct Room* room = Rooms_find(&worker->rooms, broadcast->room, broadcast->room_len);
+			if (room != NULL) sendToRoom(worker, room, broadcast->frame);
+		} else {
+			rememberFrame(worker, broadcast->seq, broadcast->frame);
+			queueBroadcast(worker, broadcast->frame);
+		}
+		releaseBroadcast(broadcast);
+	}
+}
+
+static void shutdownServer(struct ServerState* state) {
+	atomic_store(&state->shutdown, true);
+	for (unsigned int i = 0; i < state->num_workers; i++)
+		wakeWorker(&state->workers[i]);
+}
+
+// Queues the next chunk of a client's replay once the previous one has mostly
+// been written, so live broadcasts queued behind a chunk wait for at most that
+// one chunk. Messages still in the retransmit window are queued from there;
+// older ones are sent straight from the journal's files.
+static void pumpReplay(struct Worker* worker, struct Client* client) {
+	struct Journal* journal = worker->state->journal;
+	struct Connection* connection = &client->connection;
+	unsigned int window_size = worker->state->config->retransmit_window;
+	bool alive = true;
+
+	while (alive && client->replay.next_seq < client->replay.end_seq && connection->outbound.bytes < REPLAY_CHUNK_SIZE) {
+		uint64_t seq = client->replay.next_seq;
+		struct Frame* frame = windowFrame(worker, seq);
+		if (frame != NULL) {
+			alive = queueFrame(connection, frame);
+			Metrics_countSegmentOut(&worker->metrics, SEGMENT_MESSAGE, 1);
+			client->replay.next_seq++;
+			continue;
+		}
+
+		struct JournalRange range;
+		if (journal != NULL && Journal_read(journal, seq, client->replay.end_seq, REPLAY_CHUNK_SIZE, &range)) {
+			frame = Frame_newFileRange(range.fd, range.offset, range.length, range.count);
+			alive = queueFrame(connection, frame);
+			Frame_release(frame);
+			Metrics_countSegmentOut(&worker->metrics, SEGMENT_MESSAGE, range.count);
+			// Anything before the range is older than the journal
+			client->replay.missed += range.seq - seq;
+			client->replay.next_seq = range.seq + range.count;
 			continue;
 		}
 
-		fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
+		// Nothing older than the window can be in it, so skip straight there
+		uint64_t window_start = client->replay.end_seq > window_size ? client->replay.end_seq - window_size : 0;
+		uint64_t next_seq = seq < window_start ? window_start : seq + 1;
+		client->replay.missed += next_seq - seq;
+		client->replay.next_seq = next_seq;
+	}
+
+	if (alive) alive = flushClient(worker, client);
+	if (alive && client->replay.next_seq == client->replay.end_seq && client->replay.missed > 0) {
+		char notice[64];
+		int notice_len = snprintf(notice, sizeof(notice), "%lu messages could not be recovered.", client->replay.missed);
+		alive = sendStatus(worker, client, notice, notice_len);
+		client->replay.missed = 0;
+	}
+
+	if (!alive) closeClient(worker, client);
+	syncClientMetrics(worker, client);
+}
+
+static void startReplay(struct Worker* worker, struct Client* client, uint64_t start_seq) {
+	client->replay.next_seq = start_seq > 0 ? start_seq : 1;
+	client->replay.end_seq = client->joined_seq;
+	client->replay.missed = 0;
+	pumpReplay(worker, client);
+}
+
+static void handleHistory(struct Worker* worker, struct Client* client, struct Segment_History* request) {
+	struct Journal* journal = worker->state->journal;
+	if (journal == NULL) {
+		char* notice = "This server keeps no history.";
+		if (!sendStatus(worker, client, notice, strlen(notice))) closeClient(worker, client);
+		return;
+	}
+
+	uint64_t start_seq = 0;
+	if (request->count > 0 && request->count < client->joined_seq)
+		start_seq = client->joined_seq - request->count;
+	if (request->since > 0) {
+		uint64_t since_seq = Journal_findTime(journal, request->since * 1000000);
+		if (since_seq > start_seq) start_seq = since_seq;
+	}
+
+	startReplay(worker, client, start_seq);
+}
+
+static void handleResume(struct Worker* worker, struct Client* client, struct Segment_Resume* request) {
+	struct Frame* reply = Frame_newResume(client->joined_seq);
+	bool alive = queueFrame(&client->connection, reply);
+	Frame_release(reply);
+	if (!alive) {
+		closeClient(worker, client);
+		return;
+	}
+
+	// A client from before a restart without a journal is past our numbering
+	if (request->seq >= client->joined_seq) {
+		flushClient(worker, client);
+		return;
+	}
+
+	uint64_t start_seq = request->seq + 1 > RESUME_SLACK ? request->seq + 1 - RESUME_SLACK : 0;
+	startReplay(worker, client, start_seq);
+}
+
+// Has TCP probe a connection that has been silent for `interval_ms`, and
+// give up on it after a few more intervals without an answer
+static void keepAlive(int socket, unsigned int interval_ms) {
+	int enable = 1;
+	int interval_s = interval_ms >= 1000 ? interval_ms / 1000 : 1;
+	int probes = 2;
+	setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+	setsockopt(socket, IPPROTO_TCP, TCP_KEEPIDLE, &interval_s, sizeof(interval_s));
+	setsockopt(socket, IPPROTO_TCP, TCP_KEEPINTVL, &interval_s, sizeof(interval_s));
+	setsockopt(socket, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+}
+
+static void handleHello(struct Worker* worker, struct Client* client, struct Segment_Hello* hello) {
+	struct Connection* connection = &client->connection;
+	if (client->greeted) {
+		logMessage("Connection %u sent a second hello, ignoring\n", connection->socket);
+		return;
+	}
+
+	bool compatible = hello->version == PROTOCOL_VERSION;
+	uint32_t features = SERVER_FEATURES;
+	if (!worker->compressor_ready) features &= ~FEATURE_DEFLATE;
+	if (worker->state->config->heartbeat_ms == 0) features &= ~FEATURE_HEARTBEAT;
+	connection->features = compatible ? hello->features & features : 0;
+	struct Frame* reply = Frame_newHello(PROTOCOL_VERSION, connection->features);
+	bool alive = queueFrame(connection, reply) && flushClient(worker, client);
+	Frame_release(reply);
+
+	if (!compatible) {
+		logMessage("Connection %u speaks protocol version %u, disconnecting\n", connection->socket, hello->version);
+		closeClient(worker, client);
+		return;
+	}
+	if (!alive) {
+		closeClient(worker, client);
+		return;
+	}
+
+	client->greeted = true;
+	client->joined_seq = atomic_load(&worker->state->next_seq);
+	// Clients that cannot be pinged are left to TCP to find out about
+	if (client->idle_timer.armed && !(connection->features & FEATURE_HEARTBEAT)) {
+		TimerWheel_cancel(&worker->timers, &client->idle_timer);
+		keepAlive(connection->socket, worker->state->config->heartbeat_ms);
+	}
+	if (connection->features & FEATURE_DEFLATE) worker->attach_pending = true;
+}
+
+// The name a client's messages are sent under
+static char* senderOf(struct Client* client, size_t* sender_len) {
+	if (client->nickname == NULL) {
+		*sender_len = strlen(UNNAMED_SENDER);
+		return UNNAMED_SENDER;
+	}
+	*sender_len = client->nickname->name_len;
+	return client->nickname->name;
+}
+
+// Returns the client's membership of the named room, or NULL if it is not in
+// it. Clients are in few enough rooms that looking through them all is
+// cheaper than another index.
+static struct Membership* findMembership(struct Client* client, char* room, size_t room_len) {
+	struct Membership** rooms = client->rooms.data;
+	for (size_t i = 0; i < client->rooms.num_elements; i++) {
+		struct Room* joined = rooms[i]->room;
+		if (joined->name_len == room_len && memcmp(joined->name, room, room_len) == 0) return rooms[i];
+	}
+	return NULL;
+}
+
+// Confirms a join or leave by sending the client's segment back
+static void confirmRoom(struct Worker* worker, struct Client* client, enum SegmentType type, char* room, size_t room_len) {
+	struct Frame* frame = Frame_newRoom(type, room, room_len);
+	if (!queueFrame(&client->connection, frame) || !flushClient(worker, client))
+		closeClient(worker, client);
+	Frame_release(frame);
+}
+
+static void handleJoin(struct Worker* worker, struct Client* client, struct Segment_Room* request) {
+	char* notice = NULL;
+	if (request->room_len == 0 || request->room_len > ROOM_NAME_MAX) notice = "Room names must be 1 to 64 bytes long.";
+	else if (client->rooms.num_elements >= MAX_CLIENT_ROOMS) notice = "You are in too many rooms to join another.";
+	if (notice != NULL) {
+		if (!sendStatus(worker, client, notice, strlen(notice))) closeClient(worker, client);
+		return;
+	}
+
+	if (findMembership(client, request->room, request->room_len) == NULL) {
+		struct Membership* membership = Rooms_join(&worker->rooms, request->room, request->room_len, client);
+		DynamicArray_push(&client->rooms, &membership);
+	}
+	confirmRoom(worker, client, SEGMENT_JOIN, request->room, request->room_len);
+}
+
+static void handleLeave(struct Worker* worker, struct Client* client, struct Segment_Room* request) {
+	struct Membership* membership = findMembership(client, request->room, request->room_len);
+	if (membership != NULL) {
+		struct Membership** rooms = client->rooms.data;
+		for (size_t i = 0; i < client->rooms.num_elements; i++) {
+			if (rooms[i] != membership) continue;
+			DynamicArray_remove(&client->rooms, i);
+			break;
+		}
+		Rooms_leave(&worker->rooms, membership);
+	}
+	confirmRoom(worker, client, SEGMENT_LEAVE, request->room, request->room_len);
+}
+
+static void handleRoomMessage(struct Worker* worker, struct Client* client, struct Segment_RoomMessage* segment) {
+	struct Connection* connection = &client->connection;
+	struct Membership* membership = findMembership(client, segment->room, segment->room_len);
+	if (membership == NULL) {
+		char* notice = "You are not in that room, message not sent.";
+		if (!sendStatus(worker, client, notice, strlen(notice))) closeClient(worker, client);
+		return;
+	}
 
-		struct Connection new_connection = newConnection(socket);
-		printf("Connection %u accepted\n", new_connection.socket);
+	size_t sender_len;
+	char* sender = senderOf(client, &sender_len);
+	logMessage("Connection %u message to %.*s: <%.*s> %.*s\n", connection->socket,
+		(int)segment->room_len, segment->room, (int)sender_len, sender, (int)segment->contents_len, segment->contents);
+	struct Frame* frame = Frame_newRoomMessage(segment->room, segment->room_len, sender, sender_len, segment->contents, segment->contents_len);
+	if (frame == NULL) {
+		char* notice = "Message too long, not sent.";
+		if (!sendStatus(worker, client, notice, strlen(notice))) closeClient(worker, client);
+		return;
+	}
+	sendToRoom(worker, membership->room, frame);
+	relayFrame(worker, frame, 0, segment->room, segment->room_len);
+	Frame_release(frame);
+}
 
-		mtx_lock(&state->mutex);
-		DynamicArray_push(&state->connections, &new_connection);
-		mtx_unlock(&state->mutex);
+static bool validNickname(char* nick, size_t nick_len) {
+	if (nick_len == 0 || nick_len > NICKNAME_MAX) return false;
+	for (size_t i = 0; i < nick_len; i++) {
+		unsigned char c = nick[i];
+		if (c <= ' ' || c == 0x7F) return false;
 	}
+	return true;
 }
 
-static void broadcastMessage(struct ServerState* state, char* sender, char* message) {
-	struct Connection* connections = state->connections.data;
-	for (size_t i = 0; i < state->connections.num_elements; i++) {
-		struct Connection* cur_connection = &connections[i];
-		sendSegment_Message(cur_connection, sender, message);
+static void handleNick(struct Worker* worker, struct Client* client, struct Segment_Nick* request) {
+	struct ServerState* state = worker->state;
+	char* notice = NULL;
+	if (!validNickname(request->nick, request->nick_len)) {
+		notice = "Nicknames must be 1 to 32 bytes long, without spaces.";
+	} else if (request->nick_len == strlen(UNNAMED_SENDER) && memcmp(request->nick, UNNAMED_SENDER, request->nick_len) == 0) {
+		notice = "That nickname is taken.";
+	} else {
+		struct Nickname* nickname = malloc(sizeof(struct Nickname));
+		memcpy(nickname->name, request->nick, request->nick_len);
+		nickname->name_len = request->nick_len;
+		nickname->worker = worker->id;
+		nickname->client_id = client->id;
+
+		mtx_lock(&state->nicknames_lock);
+		struct Nickname* holder = HashIndex_get(&state->nicknames, request->nick, request->nick_len);
+		if (holder == NULL) {
+			HashIndex_insert(&state->nicknames, nickname->name, nickname->name_len, nickname);
+			if (client->nickname != NULL)
+				HashIndex_remove(&state->nicknames, client->nickname->name, client->nickname->name_len);
+		} else if (holder != client->nickname) {
+			notice = "That nickname is taken.";
+		}
+		mtx_unlock(&state->nicknames_lock);
+
+		if (holder == NULL) {
+			free(client->nickname);
+			client->nickname = nickname;
+		} else {
+			free(nickname);
+		}
 	}
+
+	if (notice != NULL) {
+		if (!sendStatus(worker, client, notice, strlen(notice))) closeClient(worker, client);
+		return;
+	}
+	struct Frame* reply = Frame_newNick(request->nick, request->nick_len);
+	if (!queueFrame(&client->connection, reply) || !flushClient(worker, client))
+		closeClient(worker, client);
+	Frame_release(reply);
 }
 
-static void broadcastStatus(struct ServerState* state, char* status) {
-	struct Connection* connections = state->connections.data;
-	for (size_t i = 0; i < state->connections.num_elements; i++) {
-		struct Connection* cur_connection = &connections[i];
-		sendSegment_Status(cur_connection, status);
+// Passes a message straight to the one client holding a nickname, wherever it
+// is, without touching any other client
+static void handleDirect(struct Worker* worker, struct Client* client, struct Segment_Direct* segment) {
+	struct ServerState* state = worker->state;
+	char* notice = NULL;
+	bool found = false;
+	unsigned int target_worker;
+	uint64_t target_id;
+	if (client->nickname == NULL) {
+		notice = "Pick a nickname before sending direct messages.";
+	} else if (segment->nick_len <= NICKNAME_MAX) {
+		mtx_lock(&state->nicknames_lock);
+		struct Nickname* holder = HashIndex_get(&state->nicknames, segment->nick, segment->nick_len);
+		if (holder != NULL) {
+			found = true;
+			target_worker = holder->worker;
+			target_id = holder->client_id;
+		}
+		mtx_unlock(&state->nicknames_lock);
+	}
+
+	struct Frame* frame = NULL;
+	if (notice == NULL && !found) notice = "No one goes by that nickname.";
+	if (notice == NULL) {
+		frame = Frame_newDirect(client->nickname->name, client->nickname->name_len, segment->contents, segment->contents_len);
+		if (frame == NULL) notice = "Message too long, not sent.";
+	}
+	if (notice != NULL) {
+		if (!sendStatus(worker, client, notice, strlen(notice))) closeClient(worker, client);
+		return;
 	}
+
+	if (target_worker == worker->id) sendToClient(worker, target_id, frame);
+	else relayDirect(&state->workers[target_worker], target_id, frame);
+	Frame_release(frame);
+}
+
+// Clients from before SEGMENT_HELLO existed are told why they are being
+// disconnected in the framing they understand
+static void rejectLegacyClient(struct Worker* worker, struct Client* client) {
+	char* notice = "This server needs a newer client, please upgrade.";
+	struct Frame* frame = Frame_newLegacyStatus(notice, strlen(notice));
+	queueFrame(&client->connection, frame);
+	flushClient(worker, client);
+	Frame_release(frame);
+
+	logMessage("Connection %u did not open with a hello, disconnecting\n", client->connection.socket);
+	closeClient(worker, client);
 }
 
-static void handleSegment(struct ServerState* state, struct Connection* connection) {
+static void handleSegment(struct Worker* worker, struct Client* client) {
+	struct Connection* connection = &client->connection;
+	Metrics_countSegmentIn(&worker->metrics, connection->segment_type);
+
+	if (!client->greeted && connection->segment_type != SEGMENT_HELLO) {
+		rejectLegacyClient(worker, client);
+		markHandled(connection);
+		return;
+	}
+
 	switch (connection->segment_type) {
 		case SEGMENT_STATUS: {
-			printf("Status message received by the server..?\n");
+			logMessage("Status message received by the server..?\n");
 			break;
 		}
 		case SEGMENT_MESSAGE: {
-			struct Segment_Message* segment = connection->segment;
-			printf("Connection %u message: <%s> %s\n", connection->socket, segment->sender, segment->contents);
-			broadcastMessage(state, segment->sender, segment->contents);
-			if (strcmp(segment->contents, "close") == 0) {
-				state->shutdown = true;
-				printf("Shutting down server\n");
+			struct Segment_Message* segment = &connection->segment.message;
+			size_t sender_len;
+			char* sender = senderOf(client, &sender_len);
+			logMessage("Connection %u message: <%.*s> %.*s\n", connection->socket,
+				(int)sender_len, sender, (int)segment->contents_len, segment->contents);
+			// Checked before taking a sequence number, so none go unused
+			if (Frame_messageLength(sender_len, segment->contents_len) > SEGMENT_MAX_HEADER + SEGMENT_MAX_LENGTH) {
+				char* notice = "Message too long, not sent.";
+				if (!sendStatus(worker, client, notice, strlen(notice))) closeClient(worker, client);
+				break;
+			}
+			uint64_t seq = atomic_fetch_add_explicit(&worker->state->next_seq, 1, memory_order_relaxed);
+			struct Frame* frame = Frame_newMessage(seq, sender, sender_len, segment->contents, segment->contents_len);
+			rememberFrame(worker, seq, frame);
+			if (worker->state->journal != NULL) Journal_append(worker->state->journal, frame, seq);
+			queueBroadcast(worker, frame);
+			relayFrame(worker, frame, seq, NULL, 0);
+			Frame_release(frame);
+			if (segment->contents_len == 5 && memcmp(segment->contents, "close", 5) == 0) {
+				shutdownServer(worker->state);
+				logMessage("Shutting down server\n");
 			}
 			break;
 		}
+		case SEGMENT_HISTORY: {
+			handleHistory(worker, client, &connection->segment.history);
+			break;
+		}
+		case SEGMENT_RESUME: {
+			handleResume(worker, client, &connection->segment.resume);
+			break;
+		}
+		case SEGMENT_HELLO: {
+			handleHello(worker, client, &connection->segment.hello);
+			break;
+		}
+		case SEGMENT_PING: {
+			struct Frame* pong = Frame_newPong(connection->segment.ping.token);
+			if (!queueFrame(connection, pong) || !flushClient(worker, client))
+				closeClient(worker, client);
+			Frame_release(pong);
+			break;
+		}
+		case SEGMENT_PONG: {
+			// Hearing anything from the client is enough for `checkIdle`
+			break;
+		}
+		case SEGMENT_JOIN: {
+			handleJoin(worker, client, &connection->segment.room);
+			break;
+		}
+		case SEGMENT_LEAVE: {
+			handleLeave(worker, client, &connection->segment.room);
+			break;
+		}
+		case SEGMENT_ROOM_MESSAGE: {
+			handleRoomMessage(worker, client, &connection->segment.room_message);
+			break;
+		}
+		case SEGMENT_NICK: {
+			handleNick(worker, client, &connection->segment.nick);
+			break;
+		}
+		case SEGMENT_DIRECT: {
+			handleDirect(worker, client, &connection->segment.direct);
+			break;
+		}
 		default:
-			printf("Default segment type?\n");
+			logMessage("Default segment type?\n");
 			break;
 	}
 
 	markHandled(connection);
 }
 
-static void pollLoop(struct ServerState* state) {
-	while(true) {
-		if (state->shutdown) break;
- 
-		mtx_lock(&state->mutex);
-
-		struct Connection* connections = state->connections.data;
-		for (size_t i = 0; i < state->connections.num_elements; i++) {
-			struct Connection* cur_connection = &connections[i];
-			updateConnection(cur_connection);
-			if (cur_connection->reader.closed) {
-				printf("Connection %u closed, removing\n", cur_connection->socket);
-				cleanupConnection(cur_connection);
-				DynamicArray_remove(&state->connections, i);
-				i--;
-			}
+static void pauseReceive(struct Worker* worker, struct Client* client);
 
-			if (cur_connection->segment_ready)
-				handleSegment(state, cur_connection);
-		}
+// Has the client carry on reading in a later tick, no sooner than
+// `ready_at_ns`. With io_uring, its socket is not read from in the meantime.
+static void deferClient(struct Worker* worker, struct Client* client, uint64_t ready_at_ns) {
+	if (worker->uring) pauseReceive(worker, client);
+	if (client->deferred) return;
 
-		mtx_unlock(&state->mutex);
-		thrd_yield();
-	}
-	mtx_lock(&state->mutex);
-	broadcastStatus(state, "Server has shut down.");
-	mtx_unlock(&state->mutex);
+	client->deferred = true;
+	if (ready_at_ns > Metrics_nowNs()) TimerWheel_arm(&worker->timers, &client->resume_timer, ready_at_ns);
+	else DynamicArray_push(&worker->ready, &client);
 }
 
-int server(uint16_t port) {
-	printf("Hosting on port %hu\n", port);
+// Defers the client until `bucket` holds `amount` tokens
+static void throttleClient(struct Worker* worker, struct Client* client, struct TokenBucket* bucket, uint64_t amount, enum Counter counter) {
+	Metrics_count(&worker->metrics, counter, 1);
+	deferClient(worker, client, bucket->refilled_ns + TokenBucket_waitNs(bucket, amount));
+}
 
-	struct sockaddr_in bind_addr = {0};
-	bind_addr.sin_family = AF_INET;
-	bind_addr.sin_port = htons(port);
-	bind_addr.sin_addr = (struct in_addr) { INADDR_ANY };
+// Moves as much of the client's backlog into its connection's buffer as fits
+static void feedBacklog(struct Client* client) {
+	if (client->backlog_length == 0) return;
+	size_t taken = receiveBytes(&client->connection, client->backlog, client->backlog_length);
+	client->backlog_length -= taken;
+	memmove(client->backlog, client->backlog + taken, client->backlog_length);
+}
 
-	int sfd_receiver = socket(AF_INET, SOCK_STREAM, 0);
-	if (sfd_receiver == -1) {
-		printf("Unable to create socket.\n");
-		return 1;
+// Handles the segments the client has sent, reading more as they run out,
+// until there are none left or the client has had its share of the tick. With
+// epoll the socket is read from here; with io_uring it has already been read,
+// into the connection's buffer and the client's backlog. A client stopped
+// with more to read, by its read budget or its rate limits, is deferred.
+static void handleSegments(struct Worker* worker, struct Client* client) {
+	struct Connection* connection = &client->connection;
+	uint64_t now_ns = Metrics_nowNs();
+	if (client->read_tick != worker->tick) {
+		client->read_tick = worker->tick;
+		client->read_budget = READ_BUDGET;
 	}
 
-	if (bind(sfd_receiver, (struct sockaddr*) &bind_addr, sizeof(struct sockaddr_in)) != 0) {
-		printf("Unable to bind socket.\n");
-		return 1;
-	}
+	while (true) {
+		nextSegment(connection);
+		if (!connection->segment_ready && !connection->malformed) {
+			// With epoll only bytes taken over from the server being replaced
+			// wait in the backlog, and the socket is read once they run out
+			bool fed = worker->uring || client->backlog_length > 0;
+			if (fed) {
+				feedBacklog(client);
+			} else if (connection->reader.closed) {
+				break;
+			} else if (TokenBucket_has(&client->byte_bucket, 1, now_ns)) {
+				uint64_t bytes_received = connection->bytes_received;
+				updateConnection(connection);
+				TokenBucket_take(&client->byte_bucket, connection->bytes_received - bytes_received);
+			} else {
+				throttleClient(worker, client, &client->byte_bucket, 1, COUNTER_BYTE_THROTTLES);
+				break;
+			}
+			nextSegment(connection);
+			if (fed && !worker->uring && client->backlog_length == 0 && !connection->segment_ready && !connection->malformed) continue;
+		}
+		if (!connection->segment_ready) break;
+
+		if (client->read_budget == 0) {
+			Metrics_count(&worker->metrics, COUNTER_DEFERRED_READS, 1);
+			deferClient(worker, client, 0);
+			break;
+		}
+		if (!TokenBucket_has(&client->segment_bucket, 1, now_ns)) {
+			// Waking for every single token would mostly cost ticks
+			uint64_t rate = client->segment_bucket.rate;
+			throttleClient(worker, client, &client->segment_bucket, rate < READ_BUDGET ? rate : READ_BUDGET, COUNTER_SEGMENT_THROTTLES);
+			break;
+		}
+		TokenBucket_take(&client->segment_bucket, 1);
+		client->read_budget--;
 
-	if (listen(sfd_receiver, 0) != 0) {
-		printf("Unable to mark socket as listening.\n");
-		return 1;
+		handleSegment(worker, client);
+		if (client->closing) return;
 	}
+	syncClientMetrics(worker, client);
 
-	struct ServerState state = {0};
-	if (mtx_init(&state.mutex, mtx_plain) != thrd_success) {
-		printf("Unable to create mutex.\n");
-		return 1;
+	if (connection->malformed) {
+		if (!client->greeted) rejectLegacyClient(worker, client);
+		else logMessage("Connection %u sent a malformed segment, disconnecting\n", connection->socket);
 	}
-	state.sfd_receiver = sfd_receiver;
-	state.shutdown = false;
-	state.connections = DynamicArray_new(sizeof(struct Connection), 1);
-	
-	thrd_t accept_thread;
-	if (thrd_create(&accept_thread, (thrd_start_t)acceptLoop, &state) != thrd_success) {
-		printf("Failed to create acception thread.\n");
-		return 1;
+
+	// Segments already read are still handled when the peer closes first
+	if (connection->reader.closed && (!client->deferred || connection->malformed))
+		closeClient(worker, client);
+}
+
+// Connections are edge triggered, so every segment available on the socket
+// must be consumed, and pending output written until the socket is full,
+// before returning to epoll_wait. The writing happens at the end of the tick.
+static void serviceClient(struct Worker* worker, struct Client* client, uint32_t events) {
+	if (client->closing) return;
+	struct Connection* connection = &client->connection;
+
+	if ((events & EPOLLOUT) && hasPendingOutput(connection))
+		flushClient(worker, client);
+	if ((events & EPOLLOUT) && client->replay.next_seq < client->replay.end_seq)
+		pumpReplay(worker, client);
+
+	// Deferred clients wait for their turn in `serveReady`
+	if (!client->deferred) handleSegments(worker, client);
+}
+
+static uint64_t userData(struct Client* client, enum UringOperation operation) {
+	return (uintptr_t)client | operation;
+}
+
+// Takes an entry for an operation on behalf of `client`, counting it as in
+// flight. Returns NULL if the submission queue could not be emptied.
+static struct io_uring_sqe* clientSqe(struct Worker* worker, struct Client* client, enum UringOperation operation) {
+	struct io_uring_sqe* sqe = Uring_getSqe(&worker->ring);
+	if (sqe == NULL) {
+		logMessage("Unable to submit to io_uring: %s\n", strerror(errno));
+		return NULL;
 	}
-	pollLoop(&state);
-	printf("Exited poll loop\n");
-	shutdown(state.sfd_receiver, SHUT_RD);
+	sqe->user_data = userData(client, operation);
+	client->operations++;
+	worker->operations++;
+	return sqe;
+}
 
-	mtx_destroy(&state.mutex);
+static void completeOperation(struct Worker* worker, struct Client* client) {
+	client->operations--;
+	worker->operations--;
+	if (client->removed && client->operations == 0) freeClient(worker, client);
+}
 
-	struct Connection* connections = state.connections.data;
-	for (size_t i = 0; i < state.connections.num_elements; i++) {
-		struct Connection* cur_connection = &connections[i];
-		cleanupConnection(cur_connection);
+// Accepts connections until the listener fails, each with its own completion
+static void armAccept(struct Worker* worker) {
+	struct io_uring_sqe* sqe = Uring_getSqe(&worker->ring);
+	if (sqe == NULL) {
+		logMessage("Unable to submit to io_uring: %s\n", strerror(errno));
+		return;
 	}
-	DynamicArray_free(&state.connections);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = worker->sfd_receiver;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK;
+	sqe->user_data = userData(NULL, URING_ACCEPT);
+	worker->accepting = true;
+}
 
-	printf("Joining...\n");
-	thrd_join(accept_thread, NULL);
-	printf("Closing.\n");
-	close(state.sfd_receiver);
+static void armWake(struct Worker* worker) {
+	struct io_uring_sqe* sqe = Uring_getSqe(&worker->ring);
+	if (sqe == NULL) {
+		logMessage("Unable to submit to io_uring: %s\n", strerror(errno));
+		return;
+	}
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = worker->wake_fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = userData(NULL, URING_WAKE);
+}
+
+// Reads the connection into buffers from the worker's ring until it closes,
+// with a completion for each read
+static void armReceive(struct Worker* worker, struct Client* client) {
+	struct io_uring_sqe* sqe = clientSqe(worker, client, URING_RECEIVE);
+	if (sqe == NULL) {
+		closeClient(worker, client);
+		return;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = client->connection.socket;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	client->receiving = true;
+}
+
+// Cancels the client's receive, so that nothing more is read from its socket
+// until it is armed again
+static void pauseReceive(struct Worker* worker, struct Client* client) {
+	if (!client->receiving || client->cancelling) return;
+	struct io_uring_sqe* sqe = clientSqe(worker, client, URING_CANCEL);
+	// Still receiving only grows the backlog
+	if (sqe == NULL) return;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = userData(client, URING_RECEIVE);
+	client->cancelling = true;
+}
+
+// Starts writing the client's pending output. Frames are gathered into one
+// send; journal ranges are written with sendfile, which io_uring has no
+// operation for, waiting for the socket to have room whenever it fills.
+static void startWriting(struct Worker* worker, struct Client* client) {
+	struct Connection* connection = &client->connection;
+	if (!hasPendingOutput(connection)) return;
+
+	unsigned int num_iovecs = startWrite(connection, client->iovecs, URING_SEND_IOVECS);
+	if (num_iovecs == 0) {
+		bool alive = flushConnection(connection);
+		syncClientMetrics(worker, client);
+		if (!alive) {
+			closeClient(worker, client);
+			return;
+		}
+		if (!hasPendingOutput(connection)) {
+			if (client->replay.next_seq < client->replay.end_seq) pumpReplay(worker, client);
+			return;
+		}
+
+		struct io_uring_sqe* sqe = clientSqe(worker, client, URING_WRITABLE);
+		if (sqe == NULL) {
+			closeClient(worker, client);
+			return;
+		}
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = connection->socket;
+		sqe->poll32_events = POLLOUT;
+		client->writing = true;
+		worker->writes++;
+		return;
+	}
+
+	struct io_uring_sqe* sqe = clientSqe(worker, client, URING_SEND);
+	if (sqe == NULL) {
+		finishWrite(connection, 0);
+		closeClient(worker, client);
+		return;
+	}
+	client->message = (struct msghdr) {0};
+	client->message.msg_iov = client->iovecs;
+	client->message.msg_iovlen = num_iovecs;
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = connection->socket;
+	sqe->addr = (uintptr_t)&client->message;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	// As in `flushConnection`, frames left over will follow right behind
+	if (num_iovecs < connection->outbound.count) sqe->msg_flags |= MSG_MORE;
+	client->writing = true;
+	worker->writes++;
+}
+
+static void handleAccept(struct Worker* worker, struct io_uring_cqe* cqe) {
+	bool shutting_down = atomic_load_explicit(&worker->state->shutdown, memory_order_acquire);
+	if (cqe->res >= 0) {
+		if (!shutting_down) {
+			struct Client* client = newClient(worker, cqe->res);
+			addClient(worker, client);
+			armReceive(worker, client);
+		} else if (worker->state->successor != -1) {
+			// Handed over with the rest, to be read from there
+			addClient(worker, newClient(worker, cqe->res));
+		} else {
+			close(cqe->res);
+		}
+	} else if (cqe->res != -ECONNABORTED && cqe->res != -ECANCELED) {
+		logMessage("Error accepting connection: %s\n", strerror(-cqe->res));
+	}
+
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		worker->accepting = false;
+		if (!shutting_down) armAccept(worker);
+	}
+}
+
+// Appends to the client's backlog, which is kept behind whatever its
+// connection's buffer holds
+static void pushBacklog(struct Client* client, const unsigned char* data, size_t length) {
+	if (client->backlog_length + length > client->backlog_capacity) {
+		size_t capacity = client->backlog_capacity > 0 ? client->backlog_capacity : URING_BUFFER_SIZE;
+		while (capacity < client->backlog_length + length) capacity *= 2;
+		client->backlog = realloc(client->backlog, capacity);
+		client->backlog_capacity = capacity;
+	}
+	memcpy(client->backlog + client->backlog_length, data, length);
+	client->backlog_length += length;
+}
+
+static void handleReceive(struct Worker* worker, struct Client* client, struct io_uring_cqe* cqe) {
+	struct Connection* connection = &client->connection;
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		uint16_t id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		if (cqe->res > 0 && !client->closing) {
+			unsigned char* data = BufferRing_get(&worker->buffers, id);
+			size_t length = cqe->res;
+			// Bytes arriving while a segment, or a batch of them, is still
+			// being handed out wait their turn behind it
+			bool in_use = connection->segment_ready || connection->batch_pos < connection->batch_end;
+			size_t taken = client->backlog_length == 0 && !in_use ? receiveBytes(connection, data, length) : 0;
+			if (taken < length) pushBacklog(client, data + taken, length - taken);
+
+			TokenBucket_take(&client->byte_bucket, length);
+			if (!TokenBucket_has(&client->byte_bucket, 1, Metrics_nowNs()))
+				throttleClient(worker, client, &client->byte_bucket, 1, COUNTER_BYTE_THROTTLES);
+		}
+		BufferRing_recycle(&worker->buffers, id);
+	}
+	// Running out of buffers only ends the operation, which is armed again,
+	// as does cancelling it
+	if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED))
+		connection->reader.closed = true;
+
+	bool more = cqe->flags & IORING_CQE_F_MORE;
+	if (!more) {
+		client->receiving = false;
+		client->cancelling = false;
+	}
+	// Deferred clients wait for their turn in `serveReady`
+	if (!client->closing && !client->deferred) {
+		handleSegments(worker, client);
+		if (!client->closing && !client->deferred && !client->receiving && !worker->handing_off) armReceive(worker, client);
+	}
+	if (!more) completeOperation(worker, client);
+}
+
+static void handleWritten(struct Worker* worker, struct Client* client, struct io_uring_cqe* cqe, enum UringOperation operation) {
+	client->writing = false;
+	worker->writes--;
+	if (operation == URING_SEND) finishWrite(&client->connection, cqe->res > 0 ? cqe->res : 0);
+
+	// Writes are only cancelled to hand the client over, with its output
+	if (cqe->res < 0 && cqe->res != -EAGAIN && cqe->res != -EINTR && cqe->res != -ECANCELED) {
+		closeClient(worker, client);
+	} else if (!client->closing) {
+		syncClientMetrics(worker, client);
+		if (client->replay.next_seq < client->replay.end_seq) pumpReplay(worker, client);
+		if (hasPendingOutput(&client->connection)) flushClient(worker, client);
+	}
+	completeOperation(worker, client);
+}
+
+static void handleCompletions(struct Worker* worker) {
+	struct io_uring_cqe cqe;
+	while (Uring_pop(&worker->ring, &cqe)) {
+		enum UringOperation operation = cqe.user_data & URING_OPERATION_MASK;
+		struct Client* client = (struct Client*)(uintptr_t)(cqe.user_data & ~(uint64_t)URING_OPERATION_MASK);
+
+		switch (operation) {
+			case URING_RECEIVE:
+				handleReceive(worker, client, &cqe);
+				break;
+			case URING_SEND:
+			case URING_WRITABLE:
+				handleWritten(worker, client, &cqe, operation);
+				break;
+			case URING_ACCEPT:
+				handleAccept(worker, &cqe);
+				break;
+			case URING_WAKE:
+				drainInbox(worker);
+				if (!(cqe.flags & IORING_CQE_F_MORE)) armWake(worker);
+				break;
+			case URING_TIMEOUT:
+				worker->shutdown_expired = true;
+				break;
+			case URING_CANCEL:
+				if (client != NULL) completeOperation(worker, client);
+				break;
+		}
+	}
+}
+
+// Writes as much of the client's output as the socket takes, carrying on with
+// its replay if that leaves nothing queued
+static void writeClient(struct Worker* worker, struct Client* client) {
+	bool alive = flushConnection(&client->connection);
+	syncClientMetrics(worker, client);
+	if (!alive) closeClient(worker, client);
+	else if (!hasPendingOutput(&client->connection) && client->replay.next_seq < client->replay.end_seq)
+		pumpReplay(worker, client);
+}
+
+// Writes to, or with io_uring starts writing to, every client listed by
+// `flushClient`. Clients may be listed again as this goes.
+static void writeClients(struct Worker* worker) {
+	for (size_t i = 0; i < worker->unsent.num_elements; i++) {
+		struct Client* client = ((struct Client**)worker->unsent.data)[i];
+		client->unsent = false;
+		if (client->closing) continue;
+
+		if (!worker->uring) writeClient(worker, client);
+		else if (!client->writing) startWriting(worker, client);
+	}
+	DynamicArray_clear(&worker->unsent);
+}
+
+// Runs once the client has gone a heartbeat interval without being checked.
+// A client that has sent anything since the last check is checked again an
+// interval later. One that has not is pinged, and dropped if it still has
+// not by the next check, so a dead peer is found within three intervals.
+static void checkIdle(struct Worker* worker, struct Client* client) {
+	struct Connection* connection = &client->connection;
+	if (client->closing) return;
+	if (!client->greeted) {
+		logMessage("Connection %u did not say hello in time, disconnecting\n", connection->socket);
+		closeClient(worker, client);
+		return;
+	}
+
+	if (connection->bytes_received != client->heard_bytes) {
+		client->heard_bytes = connection->bytes_received;
+		client->ping_pending = false;
+	} else if (client->ping_pending) {
+		logMessage("Connection %u stopped answering pings, disconnecting\n", connection->socket);
+		closeClient(worker, client);
+		return;
+	} else {
+		uint64_t token = Metrics_nowNs();
+		struct Frame* ping = Frame_newPing(token);
+		bool alive = queueFrame(connection, ping) && flushClient(worker, client);
+		Frame_release(ping);
+		if (!alive) {
+			closeClient(worker, client);
+			return;
+		}
+		client->ping_pending = true;
+	}
+
+	uint64_t interval_ns = worker->state->config->heartbeat_ms * 1000000ull;
+	TimerWheel_arm(&worker->timers, &client->idle_timer, Metrics_nowNs() + interval_ns);
+}
+
+// Fires every timer that has come due since the last tick
+static void runTimers(struct Worker* worker) {
+	TimerWheel_advance(&worker->timers, Metrics_nowNs());
+
+	struct Timer* timer;
+	while ((timer = TimerWheel_pop(&worker->timers)) != NULL) {
+		switch (timer->kind) {
+			case TIMER_IDLE:
+				checkIdle(worker, clientOf(timer, idle_timer));
+				break;
+			case TIMER_RESUME: {
+				struct Client* client = clientOf(timer, resume_timer);
+				DynamicArray_push(&worker->ready, &client);
+				break;
+			}
+			case TIMER_FLUSH:
+				// `flushBroadcasts` writes them at the end of the tick
+				break;
+		}
+	}
+}
+
+// Carries on reading from the deferred clients that may. Clients deferred
+// again wait for a later tick.
+static void serveReady(struct Worker* worker) {
+	struct DynamicArray serving = worker->ready;
+	worker->ready = worker->serving;
+	worker->serving = serving;
+
+	struct Client** clients = serving.data;
+	for (size_t i = 0; i < serving.num_elements; i++) {
+		struct Client* client = clients[i];
+		client->deferred = false;
+		if (client->closing) continue;
+
+		handleSegments(worker, client);
+		if (!worker->uring || client->closing || client->deferred || client->receiving) continue;
+		// Bytes received while deferred may have left the client owing
+		if (TokenBucket_has(&client->byte_bucket, 1, Metrics_nowNs())) armReceive(worker, client);
+		else throttleClient(worker, client, &client->byte_bucket, 1, COUNTER_BYTE_THROTTLES);
+	}
+	DynamicArray_clear(&worker->serving);
+}
+
+// Returns how long the worker may wait for events before it has something of
+// its own to do, or -1 if there is nothing
+static int64_t idleFor(struct Worker* worker) {
+	if (worker->ready.num_elements > 0) return 0;
+	return TimerWheel_nextNs(&worker->timers, Metrics_nowNs());
+}
+
+// Handles every segment the client has already sent, whatever its budget or
+// rate limits
+static void drainSegments(struct Worker* worker, struct Client* client) {
+	struct Connection* connection = &client->connection;
+	while (!client->closing) {
+		nextSegment(connection);
+		if (!connection->segment_ready && client->backlog_length > 0) {
+			feedBacklog(client);
+			nextSegment(connection);
+		}
+		if (!connection->segment_ready) break;
+		handleSegment(worker, client);
+	}
+
+	if (connection->malformed || connection->reader.closed) closeClient(worker, client);
+}
+
+// Cancels every operation on a socket, with a completion for the cancellation
+// on behalf of `client`, if any
+static void cancelSocket(struct Worker* worker, struct Client* client, int socket) {
+	struct io_uring_sqe* sqe = client != NULL ? clientSqe(worker, client, URING_CANCEL) : Uring_getSqe(&worker->ring);
+	if (sqe == NULL) return;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = socket;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	sqe->user_data = userData(client, URING_CANCEL);
+}
+
+// Stops the worker where another process can carry on with its clients:
+// nothing is left in flight, every segment already read has been handled, and
+// what that queued has been written as far as the sockets take it. The rest is
+// handed over as it is, see `handOff`.
+static void quiesce(struct Worker* worker) {
+	worker->handing_off = true;
+	if (worker->uring) {
+		if (worker->accepting) cancelSocket(worker, NULL, worker->sfd_receiver);
+		for (size_t i = 0; i < Slab_count(&worker->clients); i++) {
+			struct Client* client = Slab_at(&worker->clients, i);
+			if (client->operations > 0) cancelSocket(worker, client, client->connection.socket);
+		}
+		while ((worker->operations > 0 || worker->accepting) && Uring_submit(&worker->ring, 1, -1))
+			handleCompletions(worker);
+	}
+
+	for (size_t i = 0; i < Slab_count(&worker->clients); i++) {
+		struct Client* client = Slab_at(&worker->clients, i);
+		if (!client->closing) drainSegments(worker, client);
+	}
+	flushBroadcasts(worker);
+	// With io_uring, writing would only start another operation
+	if (!worker->uring) writeClients(worker);
+	reapClients(worker);
+}
+
+static int pollLoop(struct Worker* worker) {
+	struct epoll_event events[MAX_EVENTS];
+	while (!atomic_load_explicit(&worker->state->shutdown, memory_order_acquire)) {
+		// Wake in time for the next timer, or straight away for deferred
+		// clients that may carry on
+		int64_t idle_ns = idleFor(worker);
+		struct timespec timeout = { idle_ns / 1000000000, idle_ns % 1000000000 };
+		int num_events = epoll_pwait2(worker->epoll_fd, events, MAX_EVENTS, idle_ns >= 0 ? &timeout : NULL, NULL);
+		if (num_events == -1) {
+			if (errno == EINTR) continue;
+			logMessage("Error waiting for events: %s\n", strerror(errno));
+			break;
+		}
+		uint64_t start_ns = Metrics_nowNs();
+		worker->tick++;
+
+		for (int i = 0; i < num_events; i++) {
+			void* data = events[i].data.ptr;
+			if (data == EVENT_LISTENER)
+				acceptConnections(worker);
+			else if (data == EVENT_WAKE)
+				drainInbox(worker);
+			else
+				serviceClient(worker, data, events[i].events);
+		}
+
+		runTimers(worker);
+		serveReady(worker);
+		flushBroadcasts(worker);
+		writeClients(worker);
+		reapClients(worker);
+		Histogram_record(&worker->metrics.loop_time, Metrics_nowNs() - start_ns);
+	}
+
+	if (worker->state->successor != -1) {
+		quiesce(worker);
+		return 0;
+	}
+	flushBroadcasts(worker);
+	broadcastStatus(worker, "Server has shut down.");
+	writeClients(worker);
+	return 0;
+}
+
+// The same ticks as `pollLoop`, driven by io_uring completions instead of
+// readiness. Accepting and reading are each one long running operation, and
+// every write started during a tick is submitted along with the wait for the
+// next, so a busy tick costs a single system call however many connections
+// it touches.
+static int uringLoop(struct Worker* worker) {
+	armAccept(worker);
+	armWake(worker);
+	// Output taken over from another process
+	writeClients(worker);
+
+	while (!atomic_load_explicit(&worker->state->shutdown, memory_order_acquire)) {
+		if (!Uring_submit(&worker->ring, 1, idleFor(worker))) {
+			logMessage("Error waiting for completions: %s\n", strerror(errno));
+			break;
+		}
+		uint64_t start_ns = Metrics_nowNs();
+		worker->tick++;
+
+		handleCompletions(worker);
+		runTimers(worker);
+		serveReady(worker);
+		flushBroadcasts(worker);
+		writeClients(worker);
+		reapClients(worker);
+		Histogram_record(&worker->metrics.loop_time, Metrics_nowNs() - start_ns);
+	}
+
+	if (worker->state->successor != -1) {
+		quiesce(worker);
+		return 0;
+	}
+	// Give the notice a moment to be written, then close every connection
+	// and wait for whatever they still have in flight
+	flushBroadcasts(worker);
+	broadcastStatus(worker, "Server has shut down.");
+	writeClients(worker);
+
+	struct __kernel_timespec timeout = { URING_SHUTDOWN_MS / 1000, (URING_SHUTDOWN_MS % 1000) * 1000000 };
+	struct io_uring_sqe* sqe = Uring_getSqe(&worker->ring);
+	if (sqe != NULL) {
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->addr = (uintptr_t)&timeout;
+		sqe->len = 1;
+		sqe->user_data = userData(NULL, URING_TIMEOUT);
+	}
+	worker->shutdown_expired = sqe == NULL;
+	while (worker->writes > 0 && !worker->shutdown_expired && Uring_submit(&worker->ring, 1, -1)) {
+		handleCompletions(worker);
+		writeClients(worker);
+		reapClients(worker);
+	}
+
+	for (size_t i = 0; i < Slab_count(&worker->clients); i++)
+		closeClient(worker, Slab_at(&worker->clients, i));
+	reapClients(worker);
+	while (worker->operations > 0 && Uring_submit(&worker->ring, 1, -1))
+		handleCompletions(worker);
+
+	return 0;
+}
+
+static int openListener(uint16_t port) {
+	struct sockaddr_in bind_addr = {0};
+	bind_addr.sin_family = AF_INET;
+	bind_addr.sin_port = htons(port);
+	bind_addr.sin_addr = (struct in_addr) { INADDR_ANY };
+
+	int sfd_receiver = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (sfd_receiver == -1) {
+		logMessage("Unable to create socket.\n");
+		return -1;
+	}
+
+	// Every worker binds its own socket to the port and the kernel spreads
+	// incoming connections between them
+	int enable = 1;
+	if (setsockopt(sfd_receiver, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) != 0) {
+		logMessage("Unable to set SO_REUSEPORT.\n");
+		close(sfd_receiver);
+		return -1;
+	}
+
+	if (bind(sfd_receiver, (struct sockaddr*) &bind_addr, sizeof(struct sockaddr_in)) != 0) {
+		logMessage("Unable to bind socket.\n");
+		close(sfd_receiver);
+		return -1;
+	}
+
+	if (listen(sfd_receiver, SOMAXCONN) != 0) {
+		logMessage("Unable to mark socket as listening.\n");
+		close(sfd_receiver);
+		return -1;
+	}
+
+	return sfd_receiver;
+}
+
+// Serves a snapshot of every worker's metrics, merged together, to each
+// connection made to the stats socket
+static int statsLoop(struct ServerState* state) {
+	while (true) {
+		int socket = accept(state->sfd_stats, NULL, NULL);
+		if (socket == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			break;
+		}
+
+		struct Metrics* snapshot = calloc(1, sizeof(struct Metrics));
+		for (unsigned int i = 0; i < state->num_workers; i++)
+			Metrics_merge(snapshot, &state->workers[i].metrics);
+
+		size_t length = Metrics_format(snapshot, NULL, 0);
+		char* bfr = malloc(length + 1);
+		Metrics_format(snapshot, bfr, length + 1);
+
+		size_t total_sent = 0;
+		while (total_sent < length) {
+			ssize_t bytes_sent = send(socket, bfr + total_sent, length - total_sent, MSG_NOSIGNAL);
+			if (bytes_sent <= 0) break;
+			total_sent += bytes_sent;
+		}
+
+		free(bfr);
+		free(snapshot);
+		close(socket);
+	}
+
+	return 0;
+}
+
+// Waits for a newer server to connect to the handoff socket, then has the
+// workers stop for it. Only one server can take over, so that ends the thread.
+static int handoffLoop(struct ServerState* state) {
+	while (true) {
+		int socket = accept(state->sfd_handoff, NULL, NULL);
+		if (socket == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			break;
+		}
+
+		struct HandoffRecord request;
+		int fd;
+		unsigned char* payload;
+		if (!Handoff_receive(socket, &request, &fd, &payload)) {
+			close(socket);
+			continue;
+		}
+		if (fd != -1) close(fd);
+		free(payload);
+		if (request.type != HANDOFF_STATE || request.state.version != HANDOFF_VERSION) {
+			logMessage("Refusing to hand over to a server that does not speak handoff version %u\n", HANDOFF_VERSION);
+			close(socket);
+			continue;
+		}
+
+		// The new server listens there from now on
+		unlink(state->config->handoff_path);
+		logMessage("Handing over to a new server\n");
+		state->successor = socket;
+		shutdownServer(state);
+		break;
+	}
 
 	return 0;
 }
+
+static int openStatsSocket(const char* path) {
+	struct sockaddr_un bind_addr = {0};
+	bind_addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(bind_addr.sun_path)) {
+		logMessage("Stats socket path is too long.\n");
+		return -1;
+	}
+	strcpy(bind_addr.sun_path, path);
+
+	int sfd_stats = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sfd_stats == -1) {
+		logMessage("Unable to create stats socket.\n");
+		return -1;
+	}
+
+	unlink(path);
+	if (bind(sfd_stats, (struct sockaddr*) &bind_addr, sizeof(struct sockaddr_un)) != 0
+	|| listen(sfd_stats, 16) != 0) {
+		logMessage("Unable to bind stats socket: %s\n", strerror(errno));
+		close(sfd_stats);
+		return -1;
+	}
+
+	return sfd_stats;
+}
+
+static bool watch(int epoll_fd, int fd, void* data) {
+	struct epoll_event event = {0};
+	event.events = EPOLLIN | EPOLLET;
+	event.data.ptr = data;
+	return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+static bool initUringBackend(struct Worker* worker) {
+	if (!initUring(&worker->ring, URING_ENTRIES, URING_ENTRIES * 4)) return false;
+	if (!initBufferRing(&worker->buffers, &worker->ring, URING_BUFFER_GROUP, URING_BUFFER_COUNT, URING_BUFFER_SIZE)) {
+		cleanupUring(&worker->ring);
+		return false;
+	}
+	worker->uring = true;
+	return true;
+}
+
+// `listener` is a listening socket taken over from another server, or -1 to
+// open one
+static bool initWorker(struct Worker* worker, struct ServerState* state, unsigned int id, uint16_t port, int listener) {
+	worker->id = id;
+	worker->state = state;
+	worker->sfd_receiver = -1;
+	worker->epoll_fd = -1;
+	worker->wake_fd = -1;
+	worker->uring = false;
+	atomic_init(&worker->wake_pending, false);
+	MPSCQueue_init(&worker->inbox);
+	initSlab(&worker->clients, sizeof(struct Client));
+	initRooms(&worker->rooms);
+	worker->closing = DynamicArray_new(sizeof(struct Client*), 1);
+	worker->unsent = DynamicArray_new(sizeof(struct Client*), 1);
+	worker->ready = DynamicArray_new(sizeof(struct Client*), 1);
+	initTimerWheel(&worker->timers, Metrics_nowNs());
+	worker->flush_timer.kind = TIMER_FLUSH;
+	worker->serving = DynamicArray_new(sizeof(struct Client*), 1);
+	worker->outgoing = DynamicArray_new(sizeof(struct Frame*), 1);
+	worker->batches = DynamicArray_new(sizeof(struct Frame*), 1);
+	worker->compressed = DynamicArray_new(sizeof(struct Frame*), 1);
+	worker->compressor_ready = initCompressor(&worker->compressor, COMPRESSION_SHARED);
+	if (!worker->compressor_ready) logMessage("Unable to start compressor, compression is disabled.\n");
+	worker->window = calloc(state->config->retransmit_window, sizeof(struct WindowSlot));
+
+	worker->sfd_receiver = listener != -1 ? listener : openListener(port);
+	if (worker->sfd_receiver == -1) return false;
+
+	worker->wake_fd = eventfd(0, EFD_NONBLOCK);
+	if (worker->wake_fd == -1) {
+		logMessage("Unable to create eventfd.\n");
+		return false;
+	}
+
+	if (state->config->backend == BACKEND_URING) {
+		if (initUringBackend(worker)) return true;
+		logMessage("Worker %u is unable to use io_uring (%s), using epoll instead.\n", id, strerror(errno));
+	}
+
+	worker->epoll_fd = epoll_create1(0);
+	if (worker->epoll_fd == -1) {
+		logMessage("Unable to create epoll instance.\n");
+		return false;
+	}
+
+	if (!watch(worker->epoll_fd, worker->sfd_receiver, EVENT_LISTENER)
+	|| !watch(worker->epoll_fd, worker->wake_fd, EVENT_WAKE)) {
+		logMessage("Unable to watch worker sockets.\n");
+		return false;
+	}
+
+	return true;
+}
+
+static void cleanupWorker(struct Worker* worker) {
+	for (size_t i = 0; i < Slab_count(&worker->clients); i++) {
+		struct Client* client = Slab_at(&worker->clients, i);
+		cleanupConnection(&client->connection);
+		free(client->backlog);
+		leaveRooms(worker, client);
+		DynamicArray_free(&client->rooms);
+		releaseNickname(worker, client);
+	}
+	cleanupSlab(&worker->clients);
+	cleanupRooms(&worker->rooms);
+	DynamicArray_free(&worker->closing);
+	DynamicArray_free(&worker->unsent);
+	DynamicArray_free(&worker->ready);
+	DynamicArray_free(&worker->serving);
+
+	struct Frame** outgoing = worker->outgoing.data;
+	for (size_t i = 0; i < worker->outgoing.num_elements; i++)
+		Frame_release(outgoing[i]);
+	DynamicArray_free(&worker->outgoing);
+	DynamicArray_free(&worker->batches);
+	DynamicArray_free(&worker->compressed);
+	if (worker->compressor_ready) cleanupCompressor(&worker->compressor);
+
+	for (unsigned int i = 0; i < worker->state->config->retransmit_window; i++)
+		if (worker->window[i].frame != NULL) Frame_release(worker->window[i].frame);
+	free(worker->window);
+
+	// Relayed broadcasts that were never drained still hold references
+	struct MPSCNode* node;
+	while ((node = MPSCQueue_pop(&worker->inbox)) != NULL)
+		releaseBroadcast(((struct BroadcastNode*)node)->broadcast);
+
+	if (worker->uring) {
+		cleanupUring(&worker->ring);
+		cleanupBufferRing(&worker->buffers);
+	}
+	if (worker->wake_fd != -1) close(worker->wake_fd);
+	if (worker->epoll_fd != -1) close(worker->epoll_fd);
+	if (worker->sfd_receiver != -1) close(worker->sfd_receiver);
+}
+
+// Sends everything about a client that another server needs to carry on
+// with it. Returns false if the handoff socket failed, and clears `handed`,
+// closing the connection, if only this client could not be handed over.
+static bool handOffClient(int socket, struct Client* client, bool* handed) {
+	struct Connection* connection = &client->connection;
+	struct OutboundQueue* outbound = &connection->outbound;
+	struct HandoffRecord record = {0};
+	record.type = HANDOFF_CLIENT;
+	struct HandoffClient* saved = &record.client;
+	saved->features = connection->features;
+	saved->greeted = client->greeted;
+	saved->joined_seq = client->joined_seq;
+	saved->replay_next_seq = client->replay.next_seq;
+	saved->replay_end_seq = client->replay.end_seq;
+	saved->replay_missed = client->replay.missed;
+	size_t buffered = connection->reader.end - connection->reader.start;
+	saved->input_length = buffered + client->backlog_length;
+	saved->output_length = outbound->head_offset + outbound->bytes;
+	saved->output_written = outbound->head_offset;
+	saved->nickname_length = client->nickname != NULL ? client->nickname->name_len : 0;
+	saved->num_rooms = client->rooms.num_elements;
+
+	size_t capacity = saved->input_length + saved->output_length + saved->nickname_length
+		+ COMPRESSION_STREAM_COUNT * (1 << MAX_WBITS) + saved->num_rooms * (1 + ROOM_NAME_MAX);
+	unsigned char* payload = malloc(capacity);
+	unsigned char* write_pos = payload;
+
+	memcpy(write_pos, connection->bfr + connection->reader.start, buffered);
+	if (client->backlog_length > 0) memcpy(write_pos + buffered, client->backlog, client->backlog_length);
+	write_pos += saved->input_length;
+	if (!copyPendingOutput(connection, write_pos)) {
+		logMessage("Unable to read the output of connection %u, closing it instead\n", connection->socket);
+		free(payload);
+		// None of what was lost has reached the peer yet, so a notice can go
+		// out in its place
+		if (outbound->head_offset == 0) {
+			char* notice = "Lost messages bound for you while restarting, reconnect to catch up.";
+			struct Frame* frame = Frame_newStatus(notice, strlen(notice));
+			send(connection->socket, frame->data, frame->length, MSG_NOSIGNAL | MSG_DONTWAIT);
+			Frame_release(frame);
+		}
+		shutdown(connection->socket, SHUT_RDWR);
+		*handed = false;
+		return true;
+	}
+	write_pos += saved->output_length;
+	if (client->nickname != NULL) memcpy(write_pos, client->nickname->name, saved->nickname_length);
+	write_pos += saved->nickname_length;
+
+	for (int i = 0; i < COMPRESSION_STREAM_COUNT; i++) {
+		unsigned int length;
+		if (saveInflater(connection, i, write_pos, &length)) {
+			saved->window_lengths[i] = length;
+			write_pos += length;
+		} else {
+			saved->window_lengths[i] = HANDOFF_NO_STREAM;
+		}
+	}
+
+	struct Membership** rooms = client->rooms.data;
+	for (size_t i = 0; i < saved->num_rooms; i++) {
+		struct Room* room = rooms[i]->room;
+		*write_pos++ = room->name_len;
+		memcpy(write_pos, room->name, room->name_len);
+		write_pos += room->name_len;
+	}
+
+	record.payload_length = write_pos - payload;
+	bool alive = Handoff_send(socket, &record, connection->socket, payload);
+	free(payload);
+	return alive;
+}
+
+// Hands the listening sockets, every client and the retransmit window over to
+// the server that connected to the handoff socket, once the workers have
+// stopped for it. Each socket stays open here until this process exits, but
+// nothing more is read from or written to it.
+static void handOff(struct ServerState* state) {
+	int socket = state->successor;
+	for (unsigned int i = 0; i < state->num_workers; i++) {
+		if (state->workers[i].handing_off) continue;
+		// It was shut down at the same time, and its clients let go
+		logMessage("Worker %u shut down instead of stopping for the handoff, not handing over\n", i);
+		close(socket);
+		return;
+	}
+
+	// Messages relayed between the workers as they stopped
+	for (unsigned int i = 0; i < state->num_workers; i++) {
+		struct Worker* worker = &state->workers[i];
+		drainInbox(worker);
+		flushBroadcasts(worker);
+		reapClients(worker);
+	}
+
+	struct HandoffRecord record = {0};
+	record.type = HANDOFF_STATE;
+	record.state.version = HANDOFF_VERSION;
+	record.state.num_listeners = state->num_workers;
+	record.state.next_seq = atomic_load(&state->next_seq);
+	bool alive = Handoff_send(socket, &record, -1, NULL);
+
+	record = (struct HandoffRecord) { .type = HANDOFF_LISTENER };
+	for (unsigned int i = 0; i < state->num_workers && alive; i++)
+		alive = Handoff_send(socket, &record, state->workers[i].sfd_receiver, NULL);
+
+	size_t num_handed = 0;
+	size_t num_dropped = 0;
+	for (unsigned int i = 0; i < state->num_workers && alive; i++) {
+		struct Worker* worker = &state->workers[i];
+		for (size_t j = 0; j < Slab_count(&worker->clients) && alive; j++) {
+			struct Client* client = Slab_at(&worker->clients, j);
+			if (client->closing) continue;
+			bool handed = true;
+			alive = handOffClient(socket, client, &handed);
+			if (handed) num_handed++;
+			else num_dropped++;
+		}
+	}
+
+	// Every worker's window holds every message by now
+	struct Worker* worker = &state->workers[0];
+	for (unsigned int i = 0; i < state->config->retransmit_window && alive; i++) {
+		struct WindowSlot* slot = &worker->window[i];
+		if (slot->frame == NULL) continue;
+		record = (struct HandoffRecord) { .type = HANDOFF_MESSAGE, .payload_length = slot->frame->length };
+		record.message.seq = slot->seq;
+		alive = Handoff_send(socket, &record, -1, slot->frame->data);
+	}
+
+	// The new server opens the journal once it has been let go of here
+	if (state->journal != NULL) {
+		Journal_stop(state->journal);
+		state->journal = NULL;
+	}
+	record = (struct HandoffRecord) { .type = HANDOFF_END };
+	if (alive) alive = Handoff_send(socket, &record, -1, NULL);
+	close(socket);
+
+	if (alive) logMessage("Handed %zu connections over to the new server, closed %zu it could not take\n", num_handed, num_dropped);
+	else logMessage("Handoff failed: %s\n", strerror(errno));
+}
+
+// What a server takes over from the one it replaces
+struct Predecessor {
+	int socket;
+	uint64_t next_seq;
+	// Set to -1 as workers take them
+	int* listeners;
+	unsigned int num_listeners;
+};
+
+// Connects to the server running with the handoff socket, if there is one,
+// and takes over its listening sockets. Returns false if one is running but
+// did not hand over; `socket` is left at -1 if none is.
+static bool startTakeover(struct Predecessor* predecessor, const char* path) {
+	predecessor->socket = Handoff_connect(path);
+	if (predecessor->socket == -1) return true;
+	logMessage("Taking over from the server running at %s\n", path);
+
+	struct HandoffRecord record = {0};
+	record.type = HANDOFF_STATE;
+	record.state.version = HANDOFF_VERSION;
+	int fd;
+	unsigned char* payload;
+	if (!Handoff_send(predecessor->socket, &record, -1, NULL)
+	|| !Handoff_receive(predecessor->socket, &record, &fd, &payload)) {
+		logMessage("The running server did not hand over.\n");
+		return false;
+	}
+	free(payload);
+	if (fd != -1) close(fd);
+
+	predecessor->next_seq = record.state.next_seq;
+	unsigned int num_listeners = record.state.num_listeners;
+	predecessor->listeners = malloc(num_listeners * sizeof(int));
+	while (predecessor->num_listeners < num_listeners) {
+		bool received = Handoff_receive(predecessor->socket, &record, &fd, &payload);
+		free(payload);
+		if (!received || record.type != HANDOFF_LISTENER || fd == -1) {
+			if (fd != -1) close(fd);
+			logMessage("Handoff failed while taking over listening sockets.\n");
+			return false;
+		}
+		predecessor->listeners[predecessor->num_listeners++] = fd;
+	}
+
+	return true;
+}
+
+// Carries on with a client handed over by the server being replaced, before
+// the worker has started. Returns false, closing its socket, if it could not.
+static bool takeOverClient(struct Worker* worker, int socket, struct HandoffClient* saved, unsigned char* payload) {
+	struct ServerState* state = worker->state;
+	struct Client* client = newClient(worker, socket);
+	struct Connection* connection = &client->connection;
+	unsigned char* read_pos = payload;
+
+	// Whatever does not fit in its buffer waits in its backlog
+	size_t taken = saved->input_length > 0 ? receiveBytes(connection, read_pos, saved->input_length) : 0;
+	if (taken < saved->input_length) pushBacklog(client, read_pos + taken, saved->input_length - taken);
+	bool restored = true;
+	read_pos += saved->input_length;
+	restorePendingOutput(connection, read_pos, saved->output_length, saved->output_written);
+	read_pos += saved->output_length;
+	char* nickname = (char*)read_pos;
+	read_pos += saved->nickname_length;
+	for (int i = 0; i < COMPRESSION_STREAM_COUNT && restored; i++) {
+		if (saved->window_lengths[i] == HANDOFF_NO_STREAM) continue;
+		restored = restoreInflater(connection, i, read_pos, saved->window_lengths[i]);
+		read_pos += saved->window_lengths[i];
+	}
+	if (!restored) {
+		logMessage("Unable to take over connection %u\n", socket);
+		freeClient(worker, client);
+		return false;
+	}
+	if (worker->uring) {
+		armReceive(worker, client);
+	} else if (!watchClient(worker, client)) {
+		freeClient(worker, client);
+		return false;
+	}
+
+	connection->features = saved->features;
+	if (!worker->compressor_ready) connection->features &= ~FEATURE_DEFLATE;
+	// The stream it was sent stays behind, so it is sent this worker's from
+	// where that next starts over
+	if (connection->features & FEATURE_DEFLATE) worker->attach_pending = true;
+	client->greeted = saved->greeted;
+	client->joined_seq = saved->joined_seq;
+	client->replay.next_seq = saved->replay_next_seq;
+	client->replay.end_seq = saved->replay_end_seq;
+	client->replay.missed = saved->replay_missed;
+
+	if (saved->nickname_length > 0) {
+		struct Nickname* held = malloc(sizeof(struct Nickname));
+		memcpy(held->name, nickname, saved->nickname_length);
+		held->name_len = saved->nickname_length;
+		held->worker = worker->id;
+		held->client_id = client->id;
+		mtx_lock(&state->nicknames_lock);
+		bool registered = HashIndex_insert(&state->nicknames, held->name, held->name_len, held);
+		mtx_unlock(&state->nicknames_lock);
+		if (registered) client->nickname = held;
+		else free(held);
+	}
+
+	for (uint32_t i = 0; i < saved->num_rooms; i++) {
+		size_t room_len = *read_pos++;
+		struct Membership* membership = Rooms_join(&worker->rooms, (char*)read_pos, room_len, client);
+		DynamicArray_push(&client->rooms, &membership);
+		read_pos += room_len;
+	}
+
+	unsigned int heartbeat_ms = state->config->heartbeat_ms;
+	if (heartbeat_ms > 0 && (!client->greeted || (connection->features & FEATURE_HEARTBEAT)))
+		TimerWheel_arm(&worker->timers, &client->idle_timer, Metrics_nowNs() + heartbeat_ms * 1000000ull);
+	Metrics_adjust(&worker->metrics, GAUGE_CONNECTIONS, 1);
+	syncClientMetrics(worker, client);
+	if (hasPendingOutput(connection)) flushClient(worker, client);
+	return true;
+}
+
+// Takes over the clients and retransmit window of the server being replaced,
+// spreading the clients across the workers, which have not started yet
+static bool finishTakeover(struct ServerState* state, struct Predecessor* predecessor) {
+	unsigned int next_worker = 0;
+	size_t num_taken = 0;
+	while (true) {
+		struct HandoffRecord record;
+		int fd;
+		unsigned char* payload;
+		if (!Handoff_receive(predecessor->socket, &record, &fd, &payload)) {
+			logMessage("Handoff failed: the running server stopped partway through.\n");
+			return false;
+		}
+		if (record.type == HANDOFF_END) break;
+
+		if (record.type == HANDOFF_CLIENT && fd != -1) {
+			struct Worker* worker = &state->workers[next_worker++ % state->num_workers];
+			if (takeOverClient(worker, fd, &record.client, payload)) num_taken++;
+		} else if (record.type == HANDOFF_MESSAGE) {
+			struct Frame* frame = Frame_copy(payload, record.payload_length);
+			for (unsigned int i = 0; i < state->num_workers; i++)
+				rememberFrame(&state->workers[i], record.message.seq, frame);
+			Frame_release(frame);
+		} else if (fd != -1) {
+			close(fd);
+		}
+		free(payload);
+	}
+	close(predecessor->socket);
+	predecessor->socket = -1;
+
+	// Listeners left over when there are fewer workers than before are
+	// emptied into the workers and closed
+	for (unsigned int i = 0; i < predecessor->num_listeners; i++) {
+		int listener = predecessor->listeners[i];
+		if (listener == -1) continue;
+		int socket;
+		while ((socket = accept4(listener, NULL, NULL, SOCK_NONBLOCK)) != -1 || errno == EINTR || errno == ECONNABORTED) {
+			if (socket == -1) continue;
+			struct Worker* worker = &state->workers[next_worker++ % state->num_workers];
+			struct Client* client = newClient(worker, socket);
+			if (worker->uring) {
+				armReceive(worker, client);
+			} else if (!watchClient(worker, client)) {
+				freeClient(worker, client);
+				continue;
+			}
+			addClient(worker, client);
+		}
+		close(listener);
+		predecessor->listeners[i] = -1;
+	}
+
+	atomic_store(&state->next_seq, predecessor->next_seq);
+	logMessage("Took over %zu connections\n", num_taken);
+	return true;
+}
+
+static void cleanupPredecessor(struct Predecessor* predecessor) {
+	if (predecessor->socket != -1) close(predecessor->socket);
+	for (unsigned int i = 0; i < predecessor->num_listeners; i++)
+		if (predecessor->listeners[i] != -1) close(predecessor->listeners[i]);
+	free(predecessor->listeners);
+}
+
+int server(const struct ServerConfig* config) {
+	unsigned int num_workers = config->workers;
+	if (num_workers == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		num_workers = cpus > 0 ? cpus : 1;
+	}
+	// Replay is sent with sendfile, which has no MSG_NOSIGNAL
+	signal(SIGPIPE, SIG_IGN);
+	Logger_start();
+	logMessage("Hosting on port %hu with %u workers\n", config->port, num_workers);
+
+	struct ServerState state = {0};
+	state.config = config;
+	atomic_init(&state.shutdown, false);
+	atomic_init(&state.next_seq, 1);
+	state.num_workers = num_workers;
+	state.workers = calloc(num_workers, sizeof(struct Worker));
+	state.sfd_stats = -1;
+	state.sfd_handoff = -1;
+	state.successor = -1;
+	mtx_init(&state.nicknames_lock, mtx_plain);
+	initHashIndex(&state.nicknames);
+	struct Journal journal;
+
+	struct Predecessor predecessor = { .socket = -1 };
+
+	unsigned int num_initialized = 0;
+	unsigned int num_started = 0;
+	int result = 0;
+	if (config->handoff_path != NULL && !startTakeover(&predecessor, config->handoff_path)) {
+		result = 1;
+		goto cleanup;
+	}
+
+	for (; num_initialized < num_workers; num_initialized++) {
+		struct Worker* worker = &state.workers[num_initialized];
+		int listener = -1;
+		if (num_initialized < predecessor.num_listeners) {
+			listener = predecessor.listeners[num_initialized];
+			predecessor.listeners[num_initialized] = -1;
+		}
+		if (!initWorker(worker, &state, num_initialized, config->port, listener)) {
+			num_initialized++;
+			result = 1;
+			goto cleanup;
+		}
+	}
+
+	bool took_over = predecessor.socket != -1;
+	if (took_over && !finishTakeover(&state, &predecessor)) {
+		result = 1;
+		goto cleanup;
+	}
+
+	if (config->journal_path != NULL) {
+		uint64_t next_seq = atomic_load(&state.next_seq);
+		if (!Journal_start(&journal, config->journal_path, config->fsync_ms, next_seq)) {
+			logMessage("Unable to open journal at %s.\n", config->journal_path);
+			result = 1;
+			goto cleanup;
+		}
+		state.journal = &journal;
+		// Messages the server being replaced has numbered cannot be numbered again
+		if (took_over && journal.first_seq > next_seq) {
+			logMessage("Journal at %s is ahead of the server being replaced.\n", config->journal_path);
+			result = 1;
+			goto cleanup;
+		}
+		// Numbering carries on from the journal across restarts
+		atomic_store(&state.next_seq, journal.first_seq);
+	}
+
+	if (config->stats_path != NULL) {
+		state.sfd_stats = openStatsSocket(config->stats_path);
+		if (state.sfd_stats == -1) {
+			result = 1;
+			goto cleanup;
+		}
+		if (thrd_create(&state.stats_thread, (thrd_start_t)statsLoop, &state) != thrd_success) {
+			logMessage("Failed to create stats thread.\n");
+			close(state.sfd_stats);
+			state.sfd_stats = -1;
+			result = 1;
+			goto cleanup;
+		}
+	}
+
+	if (config->handoff_path != NULL) {
+		state.sfd_handoff = Handoff_listen(config->handoff_path);
+		if (state.sfd_handoff != -1 && thrd_create(&state.handoff_thread, (thrd_start_t)handoffLoop, &state) != thrd_success) {
+			close(state.sfd_handoff);
+			state.sfd_handoff = -1;
+		}
+		if (state.sfd_handoff == -1) logMessage("Unable to listen for handoffs, upgrades are disabled.\n");
+	}
+
+	for (; num_started < num_workers; num_started++) {
+		struct Worker* worker = &state.workers[num_started];
+		thrd_start_t loop = worker->uring ? (thrd_start_t)uringLoop : (thrd_start_t)pollLoop;
+		if (thrd_create(&worker->thread, loop, worker) != thrd_success) {
+			logMessage("Failed to create worker thread.\n");
+			shutdownServer(&state);
+			result = 1;
+			break;
+		}
+	}
+
+	for (unsigned int i = 0; i < num_started; i++)
+		thrd_join(state.workers[i].thread, NULL);
+	logMessage("Exited poll loops\n");
+
+	if (state.sfd_stats != -1) {
+		// Wakes the stats thread out of accept
+		shutdown(state.sfd_stats, SHUT_RDWR);
+		thrd_join(state.stats_thread, NULL);
+		close(state.sfd_stats);
+		unlink(config->stats_path);
+	}
+
+	if (state.sfd_handoff != -1) {
+		// Wakes the handoff thread out of accept
+		shutdown(state.sfd_handoff, SHUT_RDWR);
+		thrd_join(state.handoff_thread, NULL);
+		close(state.sfd_handoff);
+		if (state.successor != -1) handOff(&state);
+		else unlink(config->handoff_path);
+	}
+
+cleanup:
+	cleanupPredecessor(&predecessor);
+	// Workers have stopped appending by now
+	if (state.journal != NULL) Journal_stop(state.journal);
+	for (unsigned int i = 0; i < num_initialized; i++)
+		cleanupWorker(&state.workers[i]);
+	free(state.workers);
+	cleanupHashIndex(&state.nicknames);
+	mtx_destroy(&state.nicknames_lock);
+
+	logMessage("Closing.\n");
+	Logger_stop();
+	return result;
+}
@@ -0,0 +1,101 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+
+#define NO_SLOT UINT32_MAX
+
+#define slotOf(id) ((uint32_t)(id))
+#define generationOf(id) ((uint32_t)((id) >> 32))
+
+static void* itemAt(const struct Slab* slab, uint32_t slot) {
+	return slab->chunks[slot / SLAB_CHUNK_ITEMS] + (size_t)(slot % SLAB_CHUNK_ITEMS) * slab->item_size;
+}
+
+// Adds a chunk of free slots, leaving every item already allocated in place
+static void grow(struct Slab* slab) {
+	unsigned int num_slots = (slab->num_chunks + 1) * SLAB_CHUNK_ITEMS;
+	slab->chunks = realloc(slab->chunks, (slab->num_chunks + 1) * sizeof(unsigned char*));
+	slab->chunks[slab->num_chunks] = malloc(SLAB_CHUNK_ITEMS * slab->item_size);
+	slab->slots = realloc(slab->slots, num_slots * sizeof(struct SlabSlot));
+	slab->live = realloc(slab->live, num_slots * sizeof(uint32_t));
+
+	// Lower slots are handed out first
+	uint32_t first = slab->num_chunks * SLAB_CHUNK_ITEMS;
+	for (uint32_t slot = first; slot < num_slots; slot++) {
+		slab->slots[slot].generation = 1;
+		slab->slots[slot].link = slot + 1 < num_slots ? slot + 1 : slab->free_head;
+	}
+	slab->free_head = first;
+	slab->num_chunks++;
+}
+
+void initSlab(struct Slab* slab, size_t item_size) {
+	slab->item_size = item_size;
+	slab->chunks = NULL;
+	slab->num_chunks = 0;
+	slab->slots = NULL;
+	slab->free_head = NO_SLOT;
+	slab->live = NULL;
+	slab->num_live = 0;
+}
+
+void* Slab_insert(struct Slab* slab, uint64_t* id) {
+	if (slab->free_head == NO_SLOT) grow(slab);
+
+	uint32_t slot = slab->free_head;
+	struct SlabSlot* entry = &slab->slots[slot];
+	slab->free_head = entry->link;
+	entry->link = slab->num_live;
+	slab->live[slab->num_live++] = slot;
+
+	*id = (uint64_t)entry->generation << 32 | slot;
+	void* item = itemAt(slab, slot);
+	memset(item, 0, slab->item_size);
+	return item;
+}
+
+void* Slab_get(const struct Slab* slab, uint64_t id) {
+	uint32_t slot = slotOf(id);
+	if (slot >= slab->num_chunks * SLAB_CHUNK_ITEMS) return NULL;
+	const struct SlabSlot* entry = &slab->slots[slot];
+	if (entry->generation != generationOf(id)) return NULL;
+	// A free slot's link may happen to point at a live one
+	if (entry->link >= slab->num_live || slab->live[entry->link] != slot) return NULL;
+	return itemAt(slab, slot);
+}
+
+void Slab_remove(struct Slab* slab, uint64_t id) {
+	if (Slab_get(slab, id) == NULL) return;
+	uint32_t slot = slotOf(id);
+	struct SlabSlot* entry = &slab->slots[slot];
+
+	// The last live slot fills the gap
+	uint32_t moved = slab->live[--slab->num_live];
+	slab->live[entry->link] = moved;
+	slab->slots[moved].link = entry->link;
+
+	// Generation 0 is skipped on wrapping around, so that no ID is 0
+	entry->generation++;
+	if (entry->generation == 0) entry->generation = 1;
+	entry->link = slab->free_head;
+	slab->free_head = slot;
+}
+
+size_t Slab_count(const struct Slab* slab) {
+	return slab->num_live;
+}
+
+void* Slab_at(const struct Slab* slab, size_t index) {
+	return itemAt(slab, slab->live[index]);
+}
+
+void cleanupSlab(struct Slab* slab) {
+	for (unsigned int i = 0; i < slab->num_chunks; i++)
+		free(slab->chunks[i]);
+	free(slab->chunks);
+	free(slab->slots);
+	free(slab->live);
+	initSlab(slab, slab->item_size);
+}
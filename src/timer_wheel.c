@@ -0,0 +1,169 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "timer_wheel.h"
+
+#define SLOT_MASK (TIMER_LEVEL_SLOTS - 1)
+
+#define levelShift(level) ((level) * TIMER_LEVEL_BITS)
+#define slotOf(tick, level) (((tick) >> levelShift(level)) & SLOT_MASK)
+
+static void linkTimer(struct Timer** head, struct Timer* timer) {
+	timer->next = *head;
+	if (timer->next != NULL) timer->next->prev_next = &timer->next;
+	timer->prev_next = head;
+	*head = timer;
+}
+
+static void unlinkTimer(struct Timer* timer) {
+	*timer->prev_next = timer->next;
+	if (timer->next != NULL) timer->next->prev_next = timer->prev_next;
+}
+
+// Which level and slot a timer is in can be told from its links alone
+static void clearIfEmpty(struct TimerWheel* wheel, struct Timer** head) {
+	if (*head != NULL) return;
+	for (int level = 0; level < TIMER_LEVELS; level++) {
+		if (head < wheel->slots[level] || head >= wheel->slots[level] + TIMER_LEVEL_SLOTS) continue;
+		wheel->occupied[level] &= ~(1ull << (head - wheel->slots[level]));
+		return;
+	}
+}
+
+static void place(struct TimerWheel* wheel, struct Timer* timer) {
+	// Anything already due goes in the very next tick
+	uint64_t tick = timer->expires_tick > wheel->now_tick ? timer->expires_tick : wheel->now_tick + 1;
+	uint64_t delta = tick - wheel->now_tick;
+
+	int level = 0;
+	while (level < TIMER_LEVELS - 1 && delta >= 1ull << levelShift(level + 1))
+		level++;
+	// Beyond the last level, wait in the furthest slot it has
+	if (delta >= 1ull << levelShift(TIMER_LEVELS)) tick = wheel->now_tick + (1ull << levelShift(TIMER_LEVELS)) - 1;
+
+	unsigned int slot = slotOf(tick, level);
+	linkTimer(&wheel->slots[level][slot], timer);
+	wheel->occupied[level] |= 1ull << slot;
+}
+
+static void expire(struct TimerWheel* wheel, struct Timer* timer) {
+	timer->next = NULL;
+	timer->prev_next = wheel->expired_tail;
+	*wheel->expired_tail = timer;
+	wheel->expired_tail = &timer->next;
+}
+
+// Returns the index, counting on from `start`, of the first bit set in
+// `bits` at or after `start`, wrapping around. `bits` must not be 0.
+static unsigned int nextSet(uint64_t bits, unsigned int start) {
+	uint64_t rotated = start == 0 ? bits : bits >> start | bits << (64 - start);
+	return __builtin_ctzll(rotated);
+}
+
+// Returns the first tick after `now_tick` at which anything happens: a timer
+// in the lowest level expiring, or a slot of a higher level being placed
+// again. UINT64_MAX if there is none.
+static uint64_t nextEventTick(const struct TimerWheel* wheel) {
+	uint64_t next = UINT64_MAX;
+	for (int level = 0; level < TIMER_LEVELS; level++) {
+		if (wheel->occupied[level] == 0) continue;
+		// The slot the current tick is in has already been placed again, so
+		// one that is occupied is only reached once the ring comes around
+		uint64_t position = wheel->now_tick >> levelShift(level);
+		unsigned int offset = nextSet(wheel->occupied[level], (position + 1) & SLOT_MASK);
+		uint64_t tick = (position + 1 + offset) << levelShift(level);
+		if (tick < next) next = tick;
+	}
+	return next;
+}
+
+// Moves the clock on to `tick`, placing again every higher slot it reaches,
+// highest first so that their timers can cascade all the way down, then
+// firing the lowest level's slot
+static void step(struct TimerWheel* wheel, uint64_t tick) {
+	wheel->now_tick = tick;
+	for (int level = TIMER_LEVELS - 1; level > 0; level--) {
+		if ((tick & ((1ull << levelShift(level)) - 1)) != 0) continue;
+		unsigned int slot = slotOf(tick, level);
+		struct Timer* timer = wheel->slots[level][slot];
+		wheel->slots[level][slot] = NULL;
+		wheel->occupied[level] &= ~(1ull << slot);
+		while (timer != NULL) {
+			struct Timer* next = timer->next;
+			if (timer->expires_tick <= tick) expire(wheel, timer);
+			else place(wheel, timer);
+			timer = next;
+		}
+	}
+
+	unsigned int slot = slotOf(tick, 0);
+	struct Timer* timer = wheel->slots[0][slot];
+	wheel->slots[0][slot] = NULL;
+	wheel->occupied[0] &= ~(1ull << slot);
+	while (timer != NULL) {
+		struct Timer* next = timer->next;
+		expire(wheel, timer);
+		timer = next;
+	}
+}
+
+void initTimerWheel(struct TimerWheel* wheel, uint64_t now_ns) {
+	wheel->now_tick = now_ns >> TIMER_TICK_SHIFT;
+	for (int level = 0; level < TIMER_LEVELS; level++) {
+		for (int slot = 0; slot < TIMER_LEVEL_SLOTS; slot++)
+			wheel->slots[level][slot] = NULL;
+		wheel->occupied[level] = 0;
+	}
+	wheel->expired = NULL;
+	wheel->expired_tail = &wheel->expired;
+}
+
+void TimerWheel_arm(struct TimerWheel* wheel, struct Timer* timer, uint64_t expires_ns) {
+	TimerWheel_cancel(wheel, timer);
+	// Rounded up, so that the timer never fires early
+	timer->expires_tick = (expires_ns + (1ull << TIMER_TICK_SHIFT) - 1) >> TIMER_TICK_SHIFT;
+	timer->armed = true;
+	place(wheel, timer);
+}
+
+void TimerWheel_cancel(struct TimerWheel* wheel, struct Timer* timer) {
+	if (!timer->armed) return;
+	timer->armed = false;
+
+	if (wheel->expired_tail == &timer->next) wheel->expired_tail = timer->prev_next;
+	unlinkTimer(timer);
+	clearIfEmpty(wheel, timer->prev_next);
+}
+
+void TimerWheel_advance(struct TimerWheel* wheel, uint64_t now_ns) {
+	uint64_t target = now_ns >> TIMER_TICK_SHIFT;
+	while (wheel->now_tick < target) {
+		uint64_t tick = nextEventTick(wheel);
+		if (tick > target) {
+			wheel->now_tick = target;
+			break;
+		}
+		step(wheel, tick);
+	}
+}
+
+struct Timer* TimerWheel_pop(struct TimerWheel* wheel) {
+	struct Timer* timer = wheel->expired;
+	if (timer == NULL) return NULL;
+
+	wheel->expired = timer->next;
+	if (wheel->expired != NULL) wheel->expired->prev_next = &wheel->expired;
+	else wheel->expired_tail = &wheel->expired;
+	timer->armed = false;
+	return timer;
+}
+
+int64_t TimerWheel_nextNs(const struct TimerWheel* wheel, uint64_t now_ns) {
+	if (wheel->expired != NULL) return 0;
+	uint64_t tick = nextEventTick(wheel);
+	if (tick == UINT64_MAX) return -1;
+
+	uint64_t due_ns = tick << TIMER_TICK_SHIFT;
+	return due_ns > now_ns ? due_ns - now_ns : 0;
+}
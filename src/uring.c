@@ -0,0 +1,186 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+// Counters shared with the kernel are plain integers in the mappings
+#define loadShared(pointer) atomic_load_explicit((_Atomic unsigned int*)(pointer), memory_order_acquire)
+#define storeShared(pointer, value) atomic_store_explicit((_Atomic unsigned int*)(pointer), value, memory_order_release)
+
+static unsigned int roundUpPow2(unsigned int value) {
+	unsigned int result = 1;
+	while (result < value) result <<= 1;
+	return result;
+}
+
+bool initUring(struct Uring* ring, unsigned int entries, unsigned int cq_entries) {
+	memset(ring, 0, sizeof(struct Uring));
+
+	struct io_uring_params params = {0};
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = roundUpPow2(cq_entries);
+	ring->fd = syscall(__NR_io_uring_setup, roundUpPow2(entries), &params);
+	if (ring->fd == -1) return false;
+
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	// Older kernels map the two rings separately
+	bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single_mmap) {
+		if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = 0;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		ring->sq_ring = NULL;
+		goto failed;
+	}
+	if (single_mmap) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			ring->cq_ring = NULL;
+			goto failed;
+		}
+	}
+
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto failed;
+	}
+
+	unsigned char* sq_ring = ring->sq_ring;
+	ring->sq_head = (unsigned int*)(sq_ring + params.sq_off.head);
+	ring->sq_tail_shared = (unsigned int*)(sq_ring + params.sq_off.tail);
+	ring->sq_tail = *ring->sq_tail_shared;
+	ring->sq_mask = *(unsigned int*)(sq_ring + params.sq_off.ring_mask);
+	ring->sq_entries = params.sq_entries;
+	// Each slot of the index array always names the entry of the same slot
+	unsigned int* sq_array = (unsigned int*)(sq_ring + params.sq_off.array);
+	for (unsigned int i = 0; i < params.sq_entries; i++)
+		sq_array[i] = i;
+
+	unsigned char* cq_ring = ring->cq_ring;
+	ring->cq_head = (unsigned int*)(cq_ring + params.cq_off.head);
+	ring->cq_tail = (unsigned int*)(cq_ring + params.cq_off.tail);
+	ring->cq_mask = *(unsigned int*)(cq_ring + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(cq_ring + params.cq_off.cqes);
+
+	return true;
+
+failed:
+	cleanupUring(ring);
+	return false;
+}
+
+struct io_uring_sqe* Uring_getSqe(struct Uring* ring) {
+	while (ring->sq_tail - loadShared(ring->sq_head) >= ring->sq_entries) {
+		if (!Uring_submit(ring, 0, -1)) return NULL;
+	}
+
+	struct io_uring_sqe* sqe = &ring->sqes[ring->sq_tail & ring->sq_mask];
+	ring->sq_tail++;
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	return sqe;
+}
+
+bool Uring_submit(struct Uring* ring, unsigned int wait_for, int64_t timeout_ns) {
+	storeShared(ring->sq_tail_shared, ring->sq_tail);
+	unsigned int to_submit = ring->sq_tail - loadShared(ring->sq_head);
+	unsigned int flags = wait_for > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+	struct __kernel_timespec timeout;
+	struct io_uring_getevents_arg arg = {0};
+	void* enter_arg = NULL;
+	size_t enter_arg_size = 0;
+	if (wait_for > 0 && timeout_ns >= 0) {
+		timeout.tv_sec = timeout_ns / 1000000000;
+		timeout.tv_nsec = timeout_ns % 1000000000;
+		arg.ts = (uintptr_t)&timeout;
+		flags |= IORING_ENTER_EXT_ARG;
+		enter_arg = &arg;
+		enter_arg_size = sizeof(arg);
+	}
+
+	int result = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_for, flags, enter_arg, enter_arg_size);
+	if (result == -1) return errno == EINTR || errno == EBUSY || errno == EAGAIN || errno == ETIME;
+	return true;
+}
+
+bool Uring_pop(struct Uring* ring, struct io_uring_cqe* cqe) {
+	unsigned int head = *ring->cq_head;
+	if (head == loadShared(ring->cq_tail)) return false;
+
+	*cqe = ring->cqes[head & ring->cq_mask];
+	storeShared(ring->cq_head, head + 1);
+	return true;
+}
+
+void cleanupUring(struct Uring* ring) {
+	if (ring->sqes != NULL) munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring != NULL) munmap(ring->sq_ring, ring->sq_ring_size);
+	if (ring->fd != -1) close(ring->fd);
+	ring->fd = -1;
+}
+
+bool initBufferRing(struct BufferRing* buffers, struct Uring* ring, uint16_t group, unsigned int count, size_t size) {
+	buffers->group = group;
+	buffers->count = count;
+	buffers->size = size;
+	buffers->tail = 0;
+
+	// The kernel needs the ring itself page aligned
+	buffers->ring = mmap(NULL, count * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buffers->ring == MAP_FAILED) {
+		buffers->ring = NULL;
+		buffers->data = NULL;
+		return false;
+	}
+	buffers->data = malloc(count * size);
+
+	struct io_uring_buf_reg registration = {0};
+	registration.ring_addr = (uintptr_t)buffers->ring;
+	registration.ring_entries = count;
+	registration.bgid = group;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &registration, 1) != 0) {
+		cleanupBufferRing(buffers);
+		return false;
+	}
+
+	for (unsigned int i = 0; i < count; i++)
+		BufferRing_recycle(buffers, i);
+	return true;
+}
+
+unsigned char* BufferRing_get(struct BufferRing* buffers, uint16_t id) {
+	return buffers->data + (size_t)id * buffers->size;
+}
+
+void BufferRing_recycle(struct BufferRing* buffers, uint16_t id) {
+	struct io_uring_buf* buffer = &buffers->ring->bufs[buffers->tail & (buffers->count - 1)];
+	buffer->addr = (uintptr_t)BufferRing_get(buffers, id);
+	buffer->len = buffers->size;
+	buffer->bid = id;
+	buffers->tail++;
+	atomic_store_explicit((_Atomic uint16_t*)&buffers->ring->tail, buffers->tail, memory_order_release);
+}
+
+void cleanupBufferRing(struct BufferRing* buffers) {
+	if (buffers->ring != NULL) munmap(buffers->ring, buffers->count * sizeof(struct io_uring_buf));
+	free(buffers->data);
+	buffers->ring = NULL;
+	buffers->data = NULL;
+}